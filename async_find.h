@@ -0,0 +1,149 @@
+#ifndef ASYNC_FIND_H_
+#define ASYNC_FIND_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "hashed_btree.h"
+#include "mhashmap.h"
+
+// Lookups as resumable state machines. start() and every resume() that
+// returns false end by prefetching the line the next resume() reads, so a
+// caller that runs other lookups in between finds it in cache.
+
+class mhashmap_find_op {
+public:
+	typedef mhashmap map_t;
+	typedef mhashpage::entry_t result_t;
+
+	void start(mhashmap* map, const mhashmap::key_t& k) {
+		map_ = map;
+		key_ = k;
+		map->compute_hash(k, key_hash_);
+		level_ = 0;
+		map->prefetch(key_hash_, 0);
+	}
+
+	// Returns true once result() is known.
+	bool resume() {
+		level_ = map_->find_step(key_, key_hash_, level_, &result_);
+		if (level_ < 0) {
+			return true;
+		}
+		map_->prefetch(key_hash_, level_);
+		return false;
+	}
+
+	result_t* result() const { return result_; }
+
+private:
+	mhashmap* map_;
+	mhashmap::key_t key_;
+	mhashmap::hash_array_t key_hash_;
+	int level_;
+	result_t* result_;
+};
+
+// A btree page takes a step per level, then one for the extent it links to.
+// A key that passed a separator equal to it may sit in a run split to the
+// left, and a miss on it is retried with btree_page::find() from the root.
+class hashed_btree_find_op {
+public:
+	typedef hashed_btree map_t;
+	typedef page::elem_t result_t;
+
+	void start(hashed_btree* tree, const hashed_btree::key_t& k) {
+		key_ = k;
+		page_ = tree->find_page(k);
+		root_ = nullptr;
+		child_ = -1;
+		split_run_ = false;
+		prefetch(page_);
+	}
+
+	bool resume() {
+		if (child_ >= 0) {
+			btree_page* bpage = page_->get_btree();
+			result_ = bpage->link_[child_]->find(key_, bpage->child_size_[child_]);
+			if (result_ == nullptr && split_run_) {
+				result_ = root_->find(key_);
+			}
+			return true;
+		}
+		if (page_->tag_ == page::enum_hash_page) {
+			result_ = page_->get_hash()->find(key_);
+			return true;
+		}
+		btree_page* bpage = page_->get_btree();
+		if (root_ == nullptr) {
+			root_ = bpage;
+		}
+		int c = bpage->child_of(key_);
+		split_run_ = split_run_ || (c > 0 && bpage->key_[c - 1] == key_);
+		if (bpage->height_ > 0) {
+			page_ = bpage->child_[c];
+			prefetch(page_);
+			return false;
+		}
+		child_ = c;
+		prefetch(bpage->link_[child_]);
+		return false;
+	}
+
+	result_t* result() const { return result_; }
+
+private:
+	static void prefetch(const void* line) {
+		const char* p = static_cast<const char*>(line);
+		_mm_prefetch(p, _MM_HINT_T0);
+		_mm_prefetch(p + 64, _MM_HINT_T0);
+	}
+
+	hashed_btree::key_t key_;
+	page* page_;
+	btree_page* root_;
+	int child_;
+	bool split_run_;
+	result_t* result_;
+};
+
+static const int kMaxInterleave = 64;
+
+// Looks up |keys| with up to |width| lookups in flight, resuming them in
+// turn and starting the next key in the slot of each one that finishes.
+// Calls |f(i, result)| for every key, not in key order.
+template <typename Op, typename F>
+void interleave_find(typename Op::map_t& map, const uint64_t* keys, size_t n, int width, F f) {
+	Op ops[kMaxInterleave];
+	size_t index[kMaxInterleave];
+	if (width > kMaxInterleave) {
+		width = kMaxInterleave;
+	}
+	size_t next = 0;
+	int active = 0;
+	for (; active < width && next < n; ++active, ++next) {
+		ops[active].start(&map, keys[next]);
+		index[active] = next;
+	}
+	while (active > 0) {
+		for (int i = 0; i < active; ) {
+			if (!ops[i].resume()) {
+				++i;
+				continue;
+			}
+			f(index[i], ops[i].result());
+			if (next < n) {
+				ops[i].start(&map, keys[next]);
+				index[i] = next++;
+				++i;
+			} else {
+				// The last slot takes the place of the finished one.
+				--active;
+				ops[i] = ops[active];
+				index[i] = index[active];
+			}
+		}
+	}
+}
+
+#endif  // ASYNC_FIND_H_
@@ -0,0 +1,166 @@
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "async_find.h"
+
+TEST(async_find, MHashMap) {
+	mhashmap m;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		m.insert(std::make_pair(i, i + 1));
+		keys.push_back(i);
+	}
+	// Keys in an overflow tree take the extra step.
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.insert(std::make_pair((j << 32) | 7, j));
+		keys.push_back((j << 32) | 7);
+	}
+	ASSERT_EQ(1u, m.num_trees());
+	for (uint64_t i = 1; i < 1000; ++i) {
+		keys.push_back(i << 40);
+	}
+
+	for (int width = 1; width <= 16; width *= 4) {
+		std::vector<mhashpage::entry_t*> found(keys.size(), nullptr);
+		std::vector<int> calls(keys.size(), 0);
+		interleave_find<mhashmap_find_op>(m, &keys[0], keys.size(), width,
+			[&](size_t i, mhashpage::entry_t* e) {
+				found[i] = e;
+				++calls[i];
+			});
+		for (size_t i = 0; i < keys.size(); ++i) {
+			ASSERT_EQ(1, calls[i]) << i;
+			mhashmap::iterator iter = m.find(keys[i]);
+			if (iter == m.end()) {
+				EXPECT_EQ(nullptr, found[i]) << keys[i];
+			} else {
+				EXPECT_EQ(&*iter, found[i]) << keys[i];
+			}
+		}
+	}
+}
+
+TEST(async_find, HashedBtree) {
+	hashed_btree t;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 1; i < 5000; ++i) {
+		t.insert(std::make_pair(i * 7, i));
+		keys.push_back(i * 7);
+		keys.push_back(i * 7 + 1);
+	}
+	// Keys that share a page build a tree several levels deep.
+	for (uint64_t j = 1; j <= 2000; ++j) {
+		t.insert(std::make_pair((j << 32) * 7, j << 32));
+		keys.push_back((j << 32) * 7);
+		keys.push_back((j << 32) * 7 + 1);
+	}
+	std::vector<page::elem_t*> found(keys.size(), nullptr);
+	interleave_find<hashed_btree_find_op>(t, &keys[0], keys.size(), 8,
+		[&](size_t i, page::elem_t* e) {
+			found[i] = e;
+		});
+	for (size_t i = 0; i < keys.size(); ++i) {
+		if (keys[i] % 7 == 0) {
+			ASSERT_NE(nullptr, found[i]) << keys[i];
+			EXPECT_EQ(keys[i] / 7, found[i]->second);
+		} else {
+			EXPECT_EQ(nullptr, found[i]) << keys[i];
+		}
+	}
+
+	// Copies of one key make a run that splits over extents; the op has to
+	// reach the copies left of a separator equal to the key while they are
+	// erased.
+	const uint64_t kRun = (1000ULL << 32) * 7;
+	const int kCopies = 100;
+	for (int c = 0; c < kCopies; ++c) {
+		t.insert(std::make_pair(kRun, c));
+	}
+	for (int c = 0; c <= kCopies; ++c) {
+		page::elem_t* e = nullptr;
+		interleave_find<hashed_btree_find_op>(t, &kRun, 1, 8,
+			[&](size_t, page::elem_t* r) {
+				e = r;
+			});
+		ASSERT_NE(t.end(), t.find(kRun)) << c;
+		ASSERT_EQ(&*t.find(kRun), e) << c;
+		ASSERT_TRUE(t.erase(kRun)) << c;
+	}
+	EXPECT_EQ(t.end(), t.find(kRun));
+}
+
+const uint64_t kBenchKeys = 8000000;
+const uint64_t kBenchLookups = 8000000;
+
+std::vector<uint64_t> bench_lookups(uint64_t num_keys) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, num_keys);
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kBenchLookups; ++i) {
+		keys.push_back(dist(eng) * 0x9e3779b97f4a7c15ULL);
+	}
+	return keys;
+}
+
+template <typename Op>
+void interleave_bench(typename Op::map_t& map, const std::vector<uint64_t>& keys) {
+	for (int width = 1; width <= 32; width *= 2) {
+		uint64_t sum = 0;
+		auto start = std::chrono::steady_clock::now();
+		interleave_find<Op>(map, &keys[0], keys.size(), width,
+			[&](size_t, typename Op::result_t* e) {
+				sum += e->second;
+			});
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "Width " << width << " : " << keys.size() / elapsed.count() / 1e6
+			<< " M lookups/s" << std::endl;
+		EXPECT_NE(0u, sum);
+	}
+}
+
+TEST(async_find, MHashMapInterleaveBench) {
+	mhashmap m;
+	for (uint64_t i = 1; i <= kBenchKeys; ++i) {
+		m.insert(std::make_pair(i * 0x9e3779b97f4a7c15ULL, i));
+	}
+	std::vector<uint64_t> keys = bench_lookups(kBenchKeys);
+
+	uint64_t sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); ++i) {
+		sum += m.find(keys[i])->second;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "find() : " << keys.size() / elapsed.count() / 1e6 << " M lookups/s" << std::endl;
+	EXPECT_NE(0u, sum);
+
+	interleave_bench<mhashmap_find_op>(m, keys);
+}
+
+TEST(async_find, HashedBtreeInterleaveBench) {
+	hashed_btree t;
+	for (uint64_t i = 1; i <= kBenchKeys / 2; ++i) {
+		t.insert(std::make_pair(i * 0x9e3779b97f4a7c15ULL, i));
+	}
+	std::vector<uint64_t> keys = bench_lookups(kBenchKeys / 2);
+
+	uint64_t sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); ++i) {
+		sum += t.find(keys[i])->second;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "find() : " << keys.size() / elapsed.count() / 1e6 << " M lookups/s" << std::endl;
+	EXPECT_NE(0u, sum);
+
+	interleave_bench<hashed_btree_find_op>(t, keys);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
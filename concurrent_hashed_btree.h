@@ -0,0 +1,355 @@
+#ifndef CONCURRENT_HASHED_BTREE_H_
+#define CONCURRENT_HASHED_BTREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <emmintrin.h>
+
+#include "hashed_btree.h"
+
+// hashed_btree for one writer at a time and any number of readers that
+// take no locks. Every page has a version word that the writer holds odd
+// while it changes the page or anything its tree links to. A reader copies
+// a node and checks the version before it follows a link out of the copy,
+// checks it again after scanning the extent, and starts over from the page
+// if it moved. Blocks the writer frees, and tables replaced by growth, are
+// only reused once every reader that could still reach them has finished
+// its lookup (epoch-based reclamation).
+class concurrent_hashed_btree {
+	struct reader_slot;
+
+public:
+	typedef uint64_t key_t;
+	typedef uint64_t value_t;
+
+	static const int kMaxReaders = 64;
+
+	// Lookups of one thread. Takes one of kMaxReaders slots for its lifetime.
+	class reader {
+	public:
+		explicit reader(concurrent_hashed_btree* tree) : tree_(tree), slot_(tree->register_reader()) {}
+
+		~reader() {
+			slot_->in_use.store(false, std::memory_order_release);
+		}
+
+		bool find(const key_t& k, value_t* v) {
+			// Pairs with the fence in reclaim(): either the writer sees this
+			// epoch, or this lookup sees every unlink before that scan.
+			slot_->epoch.store(tree_->epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool found;
+			while (!tree_->try_find(k, v, &found)) {
+				_mm_pause();
+			}
+			slot_->epoch.store(kIdle, std::memory_order_release);
+			return found;
+		}
+
+	private:
+		reader(const reader&);
+		reader& operator=(const reader&);
+
+		concurrent_hashed_btree* tree_;
+		reader_slot* slot_;
+	};
+
+	concurrent_hashed_btree() : size_(0), epoch_(1) {
+		for (int i = 0; i < kMaxReaders; ++i) {
+			slots_[i].epoch.store(kIdle, std::memory_order_relaxed);
+			slots_[i].in_use.store(false, std::memory_order_relaxed);
+		}
+		table* t = new table(hashed_btree::kDefaultCapacity);
+		t->pool.defer_to(&deferred_);
+		table_.store(t, std::memory_order_release);
+	}
+
+	// No reader may be left.
+	~concurrent_hashed_btree() {
+		for (size_t i = 0; i < retired_tables_.size(); ++i) {
+			delete retired_tables_[i].second;
+		}
+		delete table_.load(std::memory_order_relaxed);
+	}
+
+	size_t size() const { return size_; }
+	size_t num_page() const { return table_.load(std::memory_order_acquire)->capacity; }
+
+	// Returns true if the key was new, false if its value was replaced.
+	bool insert_or_assign(const page::elem_t& e) {
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		table* t = table_.load(std::memory_order_relaxed);
+		if (static_cast<uint64_t>(size_) * 1000 >= t->capacity * hash_page::kMaxItem * load_factor_) {
+			t = grow();
+		}
+		uint32_t i = t->index(e.first);
+		page* p = t->get_page(i);
+		page::elem_t* found = find_in(p, e.first);
+		begin_write(t, i);
+		if (found != nullptr) {
+			found->second = e.second;
+		} else {
+			t->insert(p, e);
+		}
+		end_write(t, i);
+		retire_deferred(t);
+		if (found != nullptr) {
+			return false;
+		}
+		++size_;
+		return true;
+	}
+
+	// A btree page goes back to a hash page once its elements fit in one.
+	bool erase(const key_t& k) {
+		std::lock_guard<std::mutex> lock(write_mutex_);
+		table* t = table_.load(std::memory_order_relaxed);
+		uint32_t i = t->index(k);
+		page* p = t->get_page(i);
+		if (find_in(p, k) == nullptr) {
+			return false;
+		}
+		begin_write(t, i);
+		if (p->tag_ == page::enum_hash_page) {
+			p->get_hash()->erase(k);
+		} else {
+			btree_page* bpage = p->get_btree();
+			bpage->erase(k, &t->pool);
+			if (bpage->height_ == 0 && bpage->size() <= hash_page::kMaxItem) {
+				hashed_btree::btree_page_to_hash_page(bpage, &t->pool);
+			}
+		}
+		end_write(t, i);
+		retire_deferred(t);
+		--size_;
+		return true;
+	}
+
+private:
+	static const uint64_t load_factor_ = 900;
+	// An idle reader holds nothing back.
+	static const uint64_t kIdle = ~0ULL;
+	// Retired blocks wait for a scan of the reader slots in batches.
+	static const size_t kReclaimBatch = 64;
+
+	struct alignas(CACHELINE_SIZE) reader_slot {
+		std::atomic<uint64_t> epoch;
+		std::atomic<bool> in_use;
+	};
+
+	struct table {
+		explicit table(uint32_t capacity) : capacity(capacity), version(new std::atomic<uint32_t>[capacity]) {
+			size_t alloc_size = CACHELINE_SIZE * static_cast<size_t>(capacity);
+			if (posix_memalign(reinterpret_cast<void**>(&pages), CACHELINE_SIZE, alloc_size) != 0) {
+				abort();
+			}
+			memset(static_cast<void*>(pages), 0, alloc_size);
+			for (uint32_t i = 0; i < capacity; ++i) {
+				version[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		~table() {
+			free(pages);
+		}
+
+		page* get_page(uint32_t i) const {
+			return reinterpret_cast<page*>(reinterpret_cast<char*>(pages) + static_cast<size_t>(i) * CACHELINE_SIZE);
+		}
+
+		uint32_t index(const key_t& k) const {
+			return std::hash<key_t>()(k) % capacity;
+		}
+
+		void insert(page* p, const page::elem_t& e) {
+			if (p->tag_ == page::enum_hash_page) {
+				if (p->get_hash()->insert(page::elem_t(e))) {
+					return;
+				}
+				hashed_btree::hash_page_to_btree_page(p->get_hash(), &pool);
+			}
+			p->get_btree()->insert(page::elem_t(e), &pool);
+		}
+
+		uint32_t capacity;
+		page* pages;
+		std::unique_ptr<std::atomic<uint32_t>[]> version;
+		btree_pool pool;
+	};
+
+	struct retired_block {
+		uint64_t epoch;
+		btree_pool* pool;
+		void* block;
+	};
+
+	reader_slot* register_reader() {
+		for (int i = 0; i < kMaxReaders; ++i) {
+			bool expected = false;
+			if (slots_[i].in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+				return &slots_[i];
+			}
+		}
+		abort();
+	}
+
+	// False if the page changed under the lookup.
+	bool try_find(const key_t& k, value_t* v, bool* found) const {
+		const table* t = table_.load(std::memory_order_acquire);
+		uint32_t i = t->index(k);
+		const std::atomic<uint32_t>& version = t->version[i];
+		uint32_t before = version.load(std::memory_order_acquire);
+		if (before & 1) {
+			return false;
+		}
+		alignas(CACHELINE_SIZE) char buffer[CACHELINE_SIZE];
+		const void* src = t->get_page(i);
+		while (true) {
+			std::memcpy(buffer, src, CACHELINE_SIZE);
+			if (!unchanged(version, before)) {
+				return false;
+			}
+			page* copy = reinterpret_cast<page*>(buffer);
+			*found = false;
+			if (copy->tag_ == page::enum_hash_page) {
+				page::elem_t* e = copy->get_hash()->find(k);
+				if (e != nullptr) {
+					*v = e->second;
+					*found = true;
+				}
+				return true;
+			}
+			btree_page* node = copy->get_btree();
+			int c = node->child_of(k);
+			if (node->height_ > 0) {
+				src = node->child_[c];
+				continue;
+			}
+			const btree_page::extent* x = node->link_[c];
+			for (int j = 0; j < node->child_size_[c]; ++j) {
+				if (x->item_[j].first == k) {
+					*v = x->item_[j].second;
+					*found = true;
+					break;
+				}
+			}
+			return unchanged(version, before);
+		}
+	}
+
+	static bool unchanged(const std::atomic<uint32_t>& version, uint32_t before) {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return version.load(std::memory_order_relaxed) == before;
+	}
+
+	static page::elem_t* find_in(page* p, const key_t& k) {
+		if (p->tag_ == page::enum_hash_page) {
+			return p->get_hash()->find(k);
+		}
+		return p->get_btree()->find(k);
+	}
+
+	static void begin_write(table* t, uint32_t i) {
+		std::atomic<uint32_t>& version = t->version[i];
+		version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	static void end_write(table* t, uint32_t i) {
+		std::atomic<uint32_t>& version = t->version[i];
+		version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Builds the doubled table aside and publishes it with one store, so no
+	// page of it is ever seen half built. Readers already on the old table
+	// finish there.
+	table* grow() {
+		table* old = table_.load(std::memory_order_relaxed);
+		table* t = new table(old->capacity * 2);
+		auto move_to = [t](const page::elem_t& e) {
+			t->insert(t->get_page(t->index(e.first)), e);
+		};
+		for (uint32_t i = 0; i < old->capacity; ++i) {
+			page* p = old->get_page(i);
+			if (p->tag_ == page::enum_hash_page) {
+				for (int j = 0; j < p->size_; ++j) {
+					move_to(p->get_hash()->item_[j]);
+				}
+			} else {
+				p->get_btree()->for_each_extent([&move_to](btree_page::extent* x, int size) {
+					for (int j = 0; j < size; ++j) {
+						move_to(x->item_[j]);
+					}
+				});
+			}
+		}
+		t->pool.defer_to(&deferred_);
+		table_.store(t, std::memory_order_release);
+		retired_tables_.push_back(std::make_pair(epoch_.load(std::memory_order_relaxed), old));
+		reclaim();
+		return t;
+	}
+
+	void retire_deferred(table* t) {
+		uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < deferred_.size(); ++i) {
+			retired_block b = {epoch, &t->pool, deferred_[i]};
+			retired_blocks_.push_back(b);
+		}
+		deferred_.clear();
+		if (retired_blocks_.size() >= kReclaimBatch) {
+			reclaim();
+		}
+	}
+
+	// Something retired in epoch e was unlinked before the epoch moved past
+	// e, so a reader that announced a later epoch cannot reach it.
+	void reclaim() {
+		epoch_.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		uint64_t oldest = kIdle;
+		for (int i = 0; i < kMaxReaders; ++i) {
+			oldest = std::min(oldest, slots_[i].epoch.load(std::memory_order_relaxed));
+		}
+		size_t n = 0;
+		for (size_t i = 0; i < retired_blocks_.size(); ++i) {
+			if (retired_blocks_[i].epoch < oldest) {
+				retired_blocks_[i].pool->recycle(retired_blocks_[i].block);
+			} else {
+				retired_blocks_[n++] = retired_blocks_[i];
+			}
+		}
+		retired_blocks_.resize(n);
+		// Blocks go back before their tables, which were retired after them.
+		n = 0;
+		for (size_t i = 0; i < retired_tables_.size(); ++i) {
+			if (retired_tables_[i].first < oldest) {
+				delete retired_tables_[i].second;
+			} else {
+				retired_tables_[n++] = retired_tables_[i];
+			}
+		}
+		retired_tables_.resize(n);
+	}
+
+	std::atomic<table*> table_;
+	size_t size_;
+	std::mutex write_mutex_;
+	std::atomic<uint64_t> epoch_;
+	reader_slot slots_[kMaxReaders];
+	// Blocks released by the current write, not yet tagged with an epoch.
+	std::vector<void*> deferred_;
+	std::vector<retired_block> retired_blocks_;
+	std::vector<std::pair<uint64_t, table*> > retired_tables_;
+};
+
+#endif  // CONCURRENT_HASHED_BTREE_H_
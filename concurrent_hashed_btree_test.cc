@@ -0,0 +1,181 @@
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "concurrent_hashed_btree.h"
+
+TEST(concurrent_hashed_btree, InsertFindErase) {
+	concurrent_hashed_btree t;
+	concurrent_hashed_btree::reader r(&t);
+	std::unordered_map<uint64_t, uint64_t> expected;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		EXPECT_TRUE(t.insert_or_assign(std::make_pair(i, i + 1)));
+		expected[i] = i + 1;
+	}
+	// Keys a multiple of 2^32 apart share page 0 and build a deep tree.
+	for (uint64_t j = 1; j <= 5000; ++j) {
+		EXPECT_TRUE(t.insert_or_assign(std::make_pair(j << 32, j)));
+		expected[j << 32] = j;
+	}
+	EXPECT_FALSE(t.insert_or_assign(std::make_pair(5ULL, 50ULL)));
+	expected[5] = 50;
+	EXPECT_EQ(expected.size(), t.size());
+
+	for (uint64_t i = 1; i < 20000; i += 2) {
+		EXPECT_TRUE(t.erase(i)) << i;
+		expected.erase(i);
+	}
+	for (uint64_t j = 1; j <= 5000; j += 3) {
+		EXPECT_TRUE(t.erase(j << 32)) << j;
+		expected.erase(j << 32);
+	}
+	EXPECT_FALSE(t.erase(1));
+	EXPECT_EQ(expected.size(), t.size());
+
+	for (const auto& e : expected) {
+		concurrent_hashed_btree::value_t v = 0;
+		ASSERT_TRUE(r.find(e.first, &v)) << e.first;
+		EXPECT_EQ(e.second, v);
+	}
+	concurrent_hashed_btree::value_t v;
+	EXPECT_FALSE(r.find(1, &v));
+	EXPECT_FALSE(r.find(1ULL << 32, &v));
+	EXPECT_FALSE(r.find(1ULL << 40 | 1, &v));
+}
+
+// The writer keeps splitting, merging and converting pages, and growing
+// the table, while readers look up keys that stay put.
+TEST(concurrent_hashed_btree, ReadersWithWriter) {
+	const uint64_t kStable = 20000;
+	const int kReaders = 3;
+	concurrent_hashed_btree t;
+	for (uint64_t i = 1; i <= kStable; ++i) {
+		t.insert_or_assign(std::make_pair(i, i * 3));
+	}
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> errors(0);
+	std::atomic<uint64_t> lookups(0);
+	std::vector<std::thread> readers;
+	for (int n = 0; n < kReaders; ++n) {
+		readers.push_back(std::thread([&, n]() {
+			concurrent_hashed_btree::reader r(&t);
+			std::default_random_engine eng(n);
+			std::uniform_int_distribution<uint64_t> dist(1, kStable);
+			uint64_t count = 0;
+			while (!done.load(std::memory_order_relaxed) || count < 100000) {
+				uint64_t k = dist(eng);
+				concurrent_hashed_btree::value_t v = 0;
+				if (!r.find(k, &v) || v != k * 3) {
+					++errors;
+				}
+				// Churned keys are either absent or carry their own value.
+				uint64_t c = (k << 32) | (k & 3);
+				if (r.find(c, &v) && v != c + 1) {
+					++errors;
+				}
+				++count;
+			}
+			lookups += count;
+		}));
+	}
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, kStable);
+	for (int round = 0; round < 300000; ++round) {
+		uint64_t k = dist(eng);
+		uint64_t c = (k << 32) | (k & 3);
+		if (round % 2 == 0) {
+			t.insert_or_assign(std::make_pair(c, c + 1));
+		} else {
+			t.erase(c);
+		}
+	}
+	done = true;
+	for (size_t n = 0; n < readers.size(); ++n) {
+		readers[n].join();
+	}
+	EXPECT_EQ(0u, errors.load());
+	EXPECT_LE(kReaders * 100000u, lookups.load());
+}
+
+TEST(concurrent_hashed_btree, ReaderSlots) {
+	concurrent_hashed_btree t;
+	t.insert_or_assign(std::make_pair(1ULL, 2ULL));
+	// Slots come back when readers go away.
+	for (int i = 0; i < concurrent_hashed_btree::kMaxReaders * 2; ++i) {
+		concurrent_hashed_btree::reader r(&t);
+		concurrent_hashed_btree::value_t v = 0;
+		ASSERT_TRUE(r.find(1, &v));
+		EXPECT_EQ(2u, v);
+	}
+}
+
+// Random lookups by 1 to 8 reader threads while one writer replaces keys
+// as fast as it can.
+TEST(concurrent_hashed_btree, ReadScalingBench) {
+	const uint64_t kKeys = 4000000;
+	const uint64_t kLookupsPerReader = 4000000;
+	concurrent_hashed_btree t;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kKeys; ++i) {
+		keys.push_back(dist(eng) & ~1ULL);
+		t.insert_or_assign(std::make_pair(keys[i], i));
+	}
+	std::cout << "Hardware threads : " << std::thread::hardware_concurrency() << std::endl;
+
+	for (int num_readers = 1; num_readers <= 8; num_readers *= 2) {
+		std::atomic<bool> done(false);
+		std::atomic<int> finished(0);
+		std::atomic<uint64_t> found(0);
+		uint64_t writes = 0;
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> readers;
+		for (int n = 0; n < num_readers; ++n) {
+			readers.push_back(std::thread([&, n]() {
+				concurrent_hashed_btree::reader r(&t);
+				std::default_random_engine reng(n);
+				std::uniform_int_distribution<size_t> pick(0, kKeys - 1);
+				uint64_t hits = 0;
+				for (uint64_t i = 0; i < kLookupsPerReader; ++i) {
+					concurrent_hashed_btree::value_t v;
+					hits += r.find(keys[pick(reng)], &v);
+				}
+				found += hits;
+				if (++finished == num_readers) {
+					done = true;
+				}
+			}));
+		}
+		// The writer churns odd keys, which the readers do not look up.
+		std::default_random_engine weng(num_readers);
+		std::vector<uint64_t> churn(1000, 0);
+		while (!done.load(std::memory_order_relaxed)) {
+			uint64_t& k = churn[writes % churn.size()];
+			if (k != 0) {
+				t.erase(k);
+			}
+			k = dist(weng) | 1;
+			t.insert_or_assign(std::make_pair(k, k));
+			++writes;
+		}
+		for (size_t n = 0; n < readers.size(); ++n) {
+			readers[n].join();
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "Readers " << num_readers << " : " << num_readers * kLookupsPerReader / elapsed.count() / 1e6
+			<< " M lookups/s, writer " << writes / elapsed.count() / 1e6 << " M writes/s" << std::endl;
+		EXPECT_EQ(num_readers * kLookupsPerReader, found.load());
+	}
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
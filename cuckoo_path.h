@@ -0,0 +1,131 @@
+#ifndef CUCKOO_PATH_H_
+#define CUCKOO_PATH_H_
+
+#include <cstdint>
+
+// Cuckoo path search and execution shared by the multi-level tables
+// (mhashmap, soa_mhashmap, string_mhashmap). |table_t| makes this class a
+// friend and provides:
+//   page_t, hash_array_t, kMaxPlacementStatus and the page array page_;
+//   candidate(h, l): the candidate page of hash |h| at level |l|;
+//   slot_hash(page, s, h): the hash of the entry in slot |s|, false if that
+//     entry must not move;
+//   copy_slot(from, from_slot, to, to_slot, to_level): copies an entry, and
+//     appends to |to| if |to_slot| is negative;
+//   increase_foreign_element() and decrease_foreign_element().
+// Pages provide full(), level(slot) and cxt.num_elements.
+template <typename table_t, int kMaxDepth, int kMaxSearchNodes>
+class cuckoo_path {
+public:
+	typedef typename table_t::page_t page_t;
+	typedef typename table_t::hash_array_t hash_array_t;
+
+	// One hop of a cuckoo path: the entry in |slot| of the parent node's page
+	// moves into |page| at |level|. Root nodes are the candidate pages of the
+	// key being inserted and have no parent.
+	struct node {
+		uint32_t page;
+		int16_t parent;
+		int8_t slot;
+		int8_t level;
+		int8_t depth;
+	};
+
+	cuckoo_path() : num_nodes_(0), last_() {}
+
+	// Breadth-first search over the candidate graph for the shortest path
+	// that ends in a page with a free slot. Only reads the table.
+	bool find(table_t& t, const hash_array_t& key_hash) {
+		num_nodes_ = 0;
+		for (int i = 0; i < table_t::kMaxPlacementStatus; ++i) {
+			uint32_t p = table_t::candidate(key_hash, i);
+			if (!is_visited(p)) {
+				node root = {p, -1, -1, static_cast<int8_t>(i), 0};
+				nodes_[num_nodes_++] = root;
+			}
+		}
+
+		for (int n = 0; n < num_nodes_; ++n) {
+			const page_t& page = t.page_[nodes_[n].page];
+			bool found = false;
+			for (int s = 0; s < page.cxt.num_elements; ++s) {
+				hash_array_t h;
+				if (!t.slot_hash(page, s, h)) {
+					continue;
+				}
+				for (int l = 0; l < table_t::kMaxPlacementStatus; ++l) {
+					uint32_t p = table_t::candidate(h, l);
+					if (l == page.level(s) || p == nodes_[n].page) {
+						continue;
+					}
+					node next = {p, static_cast<int16_t>(n), static_cast<int8_t>(s),
+						static_cast<int8_t>(l), static_cast<int8_t>(nodes_[n].depth + 1)};
+					if (!t.page_[p].full()) {
+						// Prefer the hop that leaves the fewest foreign placements.
+						if (!found || l < last_.level) {
+							last_ = next;
+							found = true;
+						}
+						break;
+					}
+					if (next.depth < kMaxDepth && num_nodes_ < kMaxSearchNodes && !is_visited(p)) {
+						nodes_[num_nodes_++] = next;
+					}
+				}
+			}
+			if (found) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Entries the path found by find() displaces.
+	int depth() const { return last_.depth; }
+
+	// Executes the moves backward, starting from the hop into the free slot.
+	// Returns the page, slot and level the new key goes to; the caller places
+	// it there and accounts for it.
+	void execute(table_t& t, uint32_t* page, int* slot, int* level) const {
+		int n = last_.parent;
+		int s = last_.slot;
+		move_entry(t, nodes_[n].page, s, last_.page, -1, last_.level);
+		while (nodes_[n].parent != -1) {
+			const node& hop = nodes_[n];
+			move_entry(t, nodes_[hop.parent].page, hop.slot, hop.page, s, hop.level);
+			s = hop.slot;
+			n = hop.parent;
+		}
+		*page = nodes_[n].page;
+		*slot = s;
+		*level = nodes_[n].level;
+	}
+
+private:
+	bool is_visited(uint32_t p) const {
+		for (int i = 0; i < num_nodes_; ++i) {
+			if (nodes_[i].page == p) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Copies an entry into another page and moves its foreign accounting
+	// along. The source slot still holds the entry until the caller
+	// overwrites it, so the key never becomes unreachable.
+	static void move_entry(table_t& t, uint32_t from, int from_slot, uint32_t to, int to_slot, int to_level) {
+		hash_array_t h;
+		t.slot_hash(t.page_[from], from_slot, h);
+		int from_level = t.page_[from].level(from_slot);
+		t.copy_slot(from, from_slot, to, to_slot, to_level);
+		t.increase_foreign_element(to_level, h);
+		t.decrease_foreign_element(from_level, h);
+	}
+
+	node nodes_[kMaxSearchNodes];
+	int num_nodes_;
+	node last_;
+};
+
+#endif  // CUCKOO_PATH_H_
@@ -0,0 +1,139 @@
+// Loads a key file into an mhashmap and a hashed_btree and reports how the
+// keys spread over them, and how well the mhashmap hash constants spread
+// them.
+//
+//   diagnose [-b] [-a a0,a1,a2,a3 -m m0,m1,m2,m3] keyfile
+//
+// Keys are read one per line, in decimal or 0x-prefixed hex, or with -b as
+// raw little-endian 64 bit words. -a and -m give other constants to run the
+// hash quality test with, next to the ones mhashmap uses.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "diagnostics.h"
+
+namespace {
+
+bool read_keys(const char* path, bool binary, std::vector<uint64_t>* keys) {
+	std::ifstream in(path, binary ? std::ios::binary : std::ios::in);
+	if (!in) {
+		return false;
+	}
+	if (binary) {
+		uint64_t k;
+		while (in.read(reinterpret_cast<char*>(&k), sizeof(k))) {
+			keys->push_back(k);
+		}
+		return true;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!line.empty()) {
+			keys->push_back(strtoull(line.c_str(), nullptr, 0));
+		}
+	}
+	return true;
+}
+
+bool parse_constants(const char* arg, uint32_t* out) {
+	for (int l = 0; l < mhashmap::kMaxPlacementStatus; ++l) {
+		char* end;
+		out[l] = static_cast<uint32_t>(strtoul(arg, &end, 0));
+		if (end == arg || (*end != ',' && *end != '\0')) {
+			return false;
+		}
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return true;
+}
+
+template <typename T>
+void print_histogram(const char* name, const std::vector<T>& counts) {
+	std::cout << name << " :";
+	for (size_t i = 0; i < counts.size(); ++i) {
+		std::cout << " " << counts[i];
+	}
+	std::cout << std::endl;
+}
+
+void print_hash_quality(const char* name, const hash_quality_report& r) {
+	std::cout << name << std::endl;
+	for (int l = 0; l < mhashmap::kMaxPlacementStatus; ++l) {
+		std::cout << "  level " << l << " : chi-square/dof " << r.chi_square[l] << ", avalanche bias mean "
+			<< r.mean_avalanche_bias[l] << " worst " << r.worst_avalanche_bias[l] << ", dead key bits "
+			<< r.dead_key_bits[l] << std::endl;
+	}
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  bool binary = false;
+  bool custom = false;
+  uint32_t add[mhashmap::kMaxPlacementStatus];
+  uint32_t mult[mhashmap::kMaxPlacementStatus];
+  std::copy(mhashmap::hash_add_constants(), mhashmap::hash_add_constants() + mhashmap::kMaxPlacementStatus, add);
+  std::copy(mhashmap::hash_mult_constants(), mhashmap::hash_mult_constants() + mhashmap::kMaxPlacementStatus, mult);
+  int i = 1;
+  for (; i < argc - 1; ++i) {
+    if (strcmp(argv[i], "-b") == 0) {
+      binary = true;
+    } else if (strcmp(argv[i], "-a") == 0 && i + 2 < argc && parse_constants(argv[i + 1], add)) {
+      custom = true;
+      ++i;
+    } else if (strcmp(argv[i], "-m") == 0 && i + 2 < argc && parse_constants(argv[i + 1], mult)) {
+      custom = true;
+      ++i;
+    } else {
+      break;
+    }
+  }
+  std::vector<uint64_t> keys;
+  if (i != argc - 1 || !read_keys(argv[i], binary, &keys)) {
+    std::cerr << "usage: " << argv[0] << " [-b] [-a a0,a1,a2,a3 -m m0,m1,m2,m3] keyfile" << std::endl;
+    return 1;
+  }
+
+  mhashmap m;
+  hashed_btree h;
+  for (size_t k = 0; k < keys.size(); ++k) {
+    m.insert(std::make_pair(keys[k], static_cast<uint64_t>(k)));
+    h.insert_or_assign(std::make_pair(keys[k], static_cast<uint64_t>(k)));
+  }
+
+  mhashmap_report mr = diagnostics::inspect(m);
+  std::cout << "mhashmap : " << mr.num_entries << " entries, " << mr.num_pages << " pages, load "
+    << m.load_factor() / 10.0 << "%" << std::endl;
+  print_histogram("Pages by entries", mr.occupancy);
+  print_histogram("Entries by level (last: trees)", mr.entries_at_level);
+  for (int l = 0; l < mhashpage::kMaxLevel; ++l) {
+    std::string name = "Pages by foreign_placed[" + std::to_string(l) + "]";
+    print_histogram(name.c_str(), mr.foreign_placed[l]);
+  }
+  print_histogram("Placements by cuckoo displacements", mr.cuckoo_paths);
+  std::cout << "Cuckoo searches failed : " << mr.cuckoo_failures << std::endl;
+  print_histogram("Overflow trees by levels", mr.tree_levels);
+  std::cout << "Probes per hit : " << mr.probes_per_hit << ", per miss : " << mr.probes_per_miss << std::endl;
+
+  hashed_btree_report hr = diagnostics::inspect(h);
+  std::cout << "hashed_btree : " << hr.num_entries << " entries, " << hr.num_pages << " pages" << std::endl;
+  print_histogram("Hash pages by entries", hr.occupancy);
+  std::cout << "Btree pages : " << 100.0 * hr.num_btree_pages / hr.num_pages << "% holding "
+    << 100.0 * hr.btree_entries / std::max<size_t>(hr.num_entries, 1) << "% of entries" << std::endl;
+  print_histogram("Btree pages by levels", hr.btree_levels);
+  std::cout << "Probes per hit : " << hr.probes_per_hit << ", per miss : " << hr.probes_per_miss << std::endl;
+
+  uint32_t num_pages = static_cast<uint32_t>(mr.num_pages);
+  print_hash_quality("Hash quality, mhashmap constants", diagnostics::hash_quality(keys, num_pages));
+  if (custom) {
+    print_hash_quality("Hash quality, given constants", diagnostics::hash_quality(keys, num_pages, add, mult));
+  }
+  return 0;
+}
@@ -0,0 +1,244 @@
+#ifndef DIAGNOSTICS_H_
+#define DIAGNOSTICS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "hashed_btree.h"
+#include "mhashmap.h"
+
+// Where the entries of an mhashmap sit and what lookups cost there. A probe
+// is one 128 byte block read: a page, a tree node or an extent.
+struct mhashmap_report {
+	size_t num_pages;
+	size_t num_entries;
+	// Pages by number of entries.
+	std::vector<size_t> occupancy;
+	// Entries by the level they were placed at. The last bucket counts the
+	// entries of overflow trees.
+	std::vector<size_t> entries_at_level;
+	// foreign_placed[l][n] is the number of pages with n entries that went
+	// past them at level l. The last bucket also counts larger n.
+	std::vector<std::vector<size_t> > foreign_placed;
+	// Placements by the number of entries a cuckoo path displaced for them,
+	// and path searches that found none, since the table was last cleared.
+	std::vector<uint64_t> cuckoo_paths;
+	uint64_t cuckoo_failures;
+	// Overflow trees by number of levels.
+	std::vector<size_t> tree_levels;
+	double probes_per_hit;
+	double probes_per_miss;
+};
+
+// The same for hashed_btree. Misses are taken to land on every page alike.
+struct hashed_btree_report {
+	size_t num_pages;
+	size_t num_entries;
+	// Hash pages by number of entries.
+	std::vector<size_t> occupancy;
+	size_t num_btree_pages;
+	size_t btree_entries;
+	// Btree pages by number of levels, the page itself included.
+	std::vector<size_t> btree_levels;
+	double probes_per_hit;
+	double probes_per_miss;
+};
+
+// How well the constants of mhashmap::compute_hash() spread a key set over
+// a table of num_pages pages, per level.
+struct hash_quality_report {
+	// Largest and mean deviation from 1/2 of the chance that flipping one
+	// key bit flips one page index bit.
+	std::vector<double> worst_avalanche_bias;
+	std::vector<double> mean_avalanche_bias;
+	// Key bits that never change the page index.
+	std::vector<int> dead_key_bits;
+	// Pearson's chi-square of the page counts against a uniform spread,
+	// over its degrees of freedom. About 1 when uniform, far above under
+	// clustering.
+	std::vector<double> chi_square;
+};
+
+class diagnostics {
+public:
+	typedef uint64_t key_t;
+
+	static const int kForeignBuckets = 8;
+	// Keys a hash quality test flips bits of.
+	static const size_t kAvalancheKeys = 4096;
+
+	// Misses are measured on |num_misses| random keys that are not in |m|.
+	static mhashmap_report inspect(mhashmap& m, size_t num_misses = 1 << 16) {
+		mhashmap_report r;
+		r.num_pages = m.capacity_;
+		r.num_entries = m.num_entries_;
+		r.occupancy.assign(mhashpage::num_max_entries + 1, 0);
+		r.entries_at_level.assign(mhashmap::kMaxPlacementStatus + 1, 0);
+		r.foreign_placed.assign(mhashpage::kMaxLevel, std::vector<size_t>(kForeignBuckets, 0));
+		r.cuckoo_paths.assign(m.cuckoo_paths_, m.cuckoo_paths_ + mhashmap::kMaxCuckooPathDepth + 1);
+		r.cuckoo_failures = m.cuckoo_failures_;
+		for (int32_t i = 0; i < m.capacity_; ++i) {
+			const mhashpage& page = m.page_[i];
+			++r.occupancy[page.cxt.num_elements];
+			for (int j = 0; j < page.cxt.num_elements; ++j) {
+				++r.entries_at_level[page.level(j)];
+			}
+			for (int l = 0; l < mhashpage::kMaxLevel; ++l) {
+				++r.foreign_placed[l][std::min<int>(page.cxt.foreign_placed[l], kForeignBuckets - 1)];
+			}
+			if (page.has_tree()) {
+				const btree_page* tree = m.tree_[i];
+				r.entries_at_level[mhashmap::kMaxPlacementStatus] += tree->size();
+				count_level(&r.tree_levels, tree->height_ + 1);
+			}
+		}
+
+		uint64_t probes = 0;
+		m.for_each([&](const mhashpage::entry_t& e) {
+			probes += probe(m, e.first);
+		});
+		r.probes_per_hit = r.num_entries == 0 ? 0 : static_cast<double>(probes) / r.num_entries;
+
+		std::default_random_engine eng;
+		std::uniform_int_distribution<key_t> dist;
+		probes = 0;
+		size_t misses = 0;
+		while (misses < num_misses) {
+			key_t k = dist(eng);
+			if (m.find(k) == m.end()) {
+				probes += probe(m, k);
+				++misses;
+			}
+		}
+		r.probes_per_miss = misses == 0 ? 0 : static_cast<double>(probes) / misses;
+		return r;
+	}
+
+	static hashed_btree_report inspect(const hashed_btree& m) {
+		hashed_btree_report r;
+		r.num_pages = m.capacity_;
+		r.num_entries = m.size_;
+		r.occupancy.assign(hash_page::kMaxItem + 1, 0);
+		r.num_btree_pages = 0;
+		r.btree_entries = 0;
+		uint64_t hit_probes = 0;
+		uint64_t miss_probes = 0;
+		for (uint32_t i = 0; i < m.capacity_; ++i) {
+			page* p = m.get_page(i);
+			if (p->tag_ == page::enum_hash_page) {
+				++r.occupancy[p->size_];
+				hit_probes += p->size_;
+				++miss_probes;
+				continue;
+			}
+			// Every leaf is as deep as the others, and ends in an extent.
+			const btree_page* bpage = p->get_btree();
+			size_t size = bpage->size();
+			int levels = bpage->height_ + 1;
+			++r.num_btree_pages;
+			r.btree_entries += size;
+			count_level(&r.btree_levels, levels);
+			hit_probes += size * (levels + 1);
+			miss_probes += levels + 1;
+		}
+		r.probes_per_hit = r.num_entries == 0 ? 0 : static_cast<double>(hit_probes) / r.num_entries;
+		r.probes_per_miss = r.num_pages == 0 ? 0 : static_cast<double>(miss_probes) / r.num_pages;
+		return r;
+	}
+
+	// |num_pages| is a power of two. Defaults to the constants mhashmap
+	// runs with.
+	static hash_quality_report hash_quality(const std::vector<key_t>& keys, uint32_t num_pages,
+			const uint32_t* add = mhashmap::hash_add_constants(),
+			const uint32_t* mult = mhashmap::hash_mult_constants()) {
+		hash_quality_report r;
+		uint32_t mask = num_pages - 1;
+		int index_bits = 0;
+		while ((1u << index_bits) < num_pages) {
+			++index_bits;
+		}
+		size_t num_samples = std::min(keys.size(), static_cast<size_t>(kAvalancheKeys));
+		for (int l = 0; l < mhashmap::kMaxPlacementStatus; ++l) {
+			std::vector<uint32_t> flips(64 * index_bits, 0);
+			for (size_t s = 0; s < num_samples; ++s) {
+				key_t k = keys[s * keys.size() / num_samples];
+				uint32_t h = page_of(k, add[l], mult[l], mask);
+				for (int i = 0; i < 64; ++i) {
+					uint32_t diff = h ^ page_of(k ^ (1ULL << i), add[l], mult[l], mask);
+					for (int j = 0; j < index_bits; ++j) {
+						flips[i * index_bits + j] += (diff >> j) & 1;
+					}
+				}
+			}
+			double worst = 0;
+			double sum = 0;
+			int dead = 0;
+			for (int i = 0; i < 64; ++i) {
+				bool live = false;
+				for (int j = 0; j < index_bits; ++j) {
+					uint32_t n = flips[i * index_bits + j];
+					double bias = num_samples == 0 ? 0.5 : std::fabs(static_cast<double>(n) / num_samples - 0.5);
+					worst = std::max(worst, bias);
+					sum += bias;
+					live |= n != 0;
+				}
+				dead += !live;
+			}
+			r.worst_avalanche_bias.push_back(index_bits == 0 ? 0 : worst);
+			r.mean_avalanche_bias.push_back(index_bits == 0 ? 0 : sum / (64 * index_bits));
+			r.dead_key_bits.push_back(index_bits == 0 ? 64 : dead);
+
+			std::vector<uint32_t> count(num_pages, 0);
+			for (size_t i = 0; i < keys.size(); ++i) {
+				++count[page_of(keys[i], add[l], mult[l], mask)];
+			}
+			double expected = static_cast<double>(keys.size()) / num_pages;
+			double chi_square = 0;
+			for (uint32_t p = 0; p < num_pages; ++p) {
+				chi_square += (count[p] - expected) * (count[p] - expected) / expected;
+			}
+			r.chi_square.push_back(num_pages < 2 || keys.empty() ? 0 : chi_square / (num_pages - 1));
+		}
+		return r;
+	}
+
+private:
+	// The scalar form of one lane of mhashmap::compute_hash().
+	static uint32_t page_of(key_t k, uint32_t add, uint32_t mult, uint32_t mask) {
+		return (static_cast<uint32_t>(k) + add) * mult & mask;
+	}
+
+	static void count_level(std::vector<size_t>* levels, int n) {
+		if (levels->size() <= static_cast<size_t>(n)) {
+			levels->resize(n + 1, 0);
+		}
+		++(*levels)[n];
+	}
+
+	// Blocks find() reads for |k|.
+	static int probe(mhashmap& m, const key_t& k) {
+		mhashmap::hash_array_t key_hash;
+		m.compute_hash(k, key_hash);
+		int probes = 0;
+		for (int i = 0; i < mhashmap::kMaxPlacementStatus; ++i) {
+			const mhashpage& page = m.page_[mhashmap::hash_at(key_hash, i)];
+			++probes;
+			if (page.find_index(k) >= 0) {
+				return probes;
+			}
+			if (i != mhashpage::kMaxLevel && !page.overflow(i)) {
+				break;
+			}
+		}
+		int32_t home = mhashmap::hash_at(key_hash, 0);
+		if (m.page_[home].has_tree()) {
+			probes += m.tree_[home]->height_ + 2;
+		}
+		return probes;
+	}
+};
+
+#endif  // DIAGNOSTICS_H_
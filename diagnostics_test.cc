@@ -0,0 +1,113 @@
+#include <numeric>
+#include <random>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "diagnostics.h"
+
+template <typename T>
+size_t sum(const std::vector<T>& v) {
+	return std::accumulate(v.begin(), v.end(), static_cast<size_t>(0));
+}
+
+TEST(diagnostics, mhashmap) {
+	mhashmap m;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	for (int i = 0; i < 100000; ++i) {
+		m.insert(std::make_pair(dist(eng), 0ULL));
+	}
+	mhashmap_report r = diagnostics::inspect(m);
+	EXPECT_EQ(m.size(), r.num_entries);
+	EXPECT_EQ(r.num_pages, sum(r.occupancy));
+	EXPECT_EQ(r.num_entries, sum(r.entries_at_level));
+	for (int l = 0; l < mhashpage::kMaxLevel; ++l) {
+		EXPECT_EQ(r.num_pages, sum(r.foreign_placed[l]));
+	}
+	// Every key went in once, rebuilds move some again.
+	EXPECT_LE(r.num_entries, sum(r.cuckoo_paths));
+	EXPECT_LT(0u, r.cuckoo_paths[1]);
+	EXPECT_LE(1.0, r.probes_per_hit);
+	EXPECT_GE(static_cast<double>(mhashmap::kMaxPlacementStatus), r.probes_per_hit);
+	EXPECT_LE(1.0, r.probes_per_miss);
+	EXPECT_LE(r.probes_per_hit, r.probes_per_miss);
+}
+
+TEST(diagnostics, mhashmap_trees) {
+	mhashmap m;
+	for (int i = 0; i < 20000; ++i) {
+		m.insert(std::make_pair(static_cast<uint64_t>(i), 0ULL));
+	}
+	// The same low half gives the same candidate pages.
+	for (uint64_t j = 1; j <= 1000; ++j) {
+		m.insert(std::make_pair(j << 32, 0ULL));
+	}
+	mhashmap_report r = diagnostics::inspect(m);
+	EXPECT_EQ(r.num_entries, sum(r.entries_at_level));
+	EXPECT_LT(900u, r.entries_at_level[mhashmap::kMaxPlacementStatus]);
+	EXPECT_EQ(m.num_trees(), sum(r.tree_levels));
+	EXPECT_LE(3u, r.tree_levels.size());
+}
+
+TEST(diagnostics, hashed_btree) {
+	hashed_btree m;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	hashed_btree_report r = diagnostics::inspect(m);
+	EXPECT_EQ(0u, r.num_btree_pages);
+	EXPECT_EQ(r.num_pages, sum(r.occupancy));
+	EXPECT_DOUBLE_EQ(1.0, r.probes_per_hit);
+
+	for (uint64_t j = 1; j <= 3000; ++j) {
+		m.insert(std::make_pair(j << 32, j));
+	}
+	r = diagnostics::inspect(m);
+	EXPECT_LE(1u, r.num_btree_pages);
+	EXPECT_EQ(r.num_pages, sum(r.occupancy) + r.num_btree_pages);
+	EXPECT_EQ(r.num_btree_pages, sum(r.btree_levels));
+	EXPECT_LE(3000u, r.btree_entries);
+	EXPECT_LE(3u, r.btree_levels.size());
+	EXPECT_LT(1.0, r.probes_per_hit);
+	EXPECT_LT(1.0, r.probes_per_miss);
+}
+
+TEST(diagnostics, hash_quality) {
+	const uint32_t kPages = 1 << 16;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> random_keys;
+	std::vector<uint64_t> aligned_keys;
+	for (int i = 0; i < 1000000; ++i) {
+		random_keys.push_back(dist(eng));
+		aligned_keys.push_back(dist(eng) << 10);
+	}
+	hash_quality_report r = diagnostics::hash_quality(random_keys, kPages);
+	for (int l = 0; l < mhashmap::kMaxPlacementStatus; ++l) {
+		EXPECT_NEAR(1.0, r.chi_square[l], 0.05) << l;
+		// A multiply by an odd constant leaves the low bits of the page
+		// index to the low bits of the key.
+		EXPECT_EQ(64 - 16, r.dead_key_bits[l]);
+		EXPECT_DOUBLE_EQ(0.5, r.worst_avalanche_bias[l]);
+	}
+
+	r = diagnostics::hash_quality(aligned_keys, kPages);
+	for (int l = 0; l < mhashmap::kMaxPlacementStatus; ++l) {
+		EXPECT_LT(100.0, r.chi_square[l]) << l;
+	}
+
+	// Constants under test need not be the ones mhashmap runs with.
+	const uint32_t add[mhashmap::kMaxPlacementStatus] = {1, 2, 3, 4};
+	const uint32_t mult[mhashmap::kMaxPlacementStatus] = {0, 0, 0, 0};
+	r = diagnostics::hash_quality(random_keys, kPages, add, mult);
+	EXPECT_EQ(64, r.dead_key_bits[0]);
+	// Every key on one page.
+	EXPECT_NEAR(random_keys.size(), r.chi_square[0], 1.0);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
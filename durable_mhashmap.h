@@ -0,0 +1,479 @@
+#ifndef DURABLE_MHASHMAP_H_
+#define DURABLE_MHASHMAP_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lookup3.h"
+#include "mhashmap.h"
+
+// Append-only log of the operations applied to a durable_mhashmap. Records
+// collect in memory and go to the file as one batch per commit(), framed by
+// the batch length and a lookup3 checksum so that a torn tail is dropped on
+// replay. With kGroupCommit a batch is synced once at least
+// group_commit_bytes have been written since the last sync.
+class mhashmap_log {
+public:
+	enum op_t {
+		kInsert = 1,
+		kAssign = 2,
+		kErase = 3,
+	};
+
+	enum sync_policy {
+		kNoSync,
+		kSyncEachCommit,
+		kGroupCommit,
+	};
+
+	static const size_t kRecordSize = 1 + 2 * sizeof(uint64_t);
+
+	mhashmap_log(sync_policy sync, size_t group_commit_bytes)
+		: fd_(-1), sync_(sync), group_commit_bytes_(group_commit_bytes), unsynced_bytes_(0), bytes_written_(0) {}
+
+	~mhashmap_log() {
+		close();
+	}
+
+	bool open(const std::string& path) {
+		close();
+		fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		return fd_ >= 0;
+	}
+
+	void close() {
+		if (fd_ >= 0) {
+			commit();
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	void append(op_t op, uint64_t key, uint64_t value) {
+		size_t pos = buffer_.size();
+		buffer_.resize(pos + kRecordSize);
+		buffer_[pos] = static_cast<char>(op);
+		std::memcpy(&buffer_[pos + 1], &key, sizeof(key));
+		std::memcpy(&buffer_[pos + 1 + sizeof(key)], &value, sizeof(value));
+	}
+
+	// Writes the pending records as one batch and syncs as the policy says.
+	bool commit() {
+		if (buffer_.empty()) {
+			return true;
+		}
+		uint32_t header[2] = {static_cast<uint32_t>(buffer_.size()), checksum(&buffer_[0], buffer_.size())};
+		bool ok = write_all(fd_, header, sizeof(header)) && write_all(fd_, &buffer_[0], buffer_.size());
+		unsynced_bytes_ += sizeof(header) + buffer_.size();
+		bytes_written_ += sizeof(header) + buffer_.size();
+		buffer_.clear();
+		if (sync_ == kSyncEachCommit || (sync_ == kGroupCommit && unsynced_bytes_ >= group_commit_bytes_)) {
+			ok = sync() && ok;
+		}
+		return ok;
+	}
+
+	bool sync() {
+		unsynced_bytes_ = 0;
+		return fsync(fd_) == 0;
+	}
+
+	size_t bytes_written() const { return bytes_written_; }
+
+	// Calls |f(op, key, value)| for every record of the intact batches of
+	// |path|, stopping at the first short or corrupt one. Returns the length
+	// of the intact part.
+	template <typename F>
+	static size_t replay(const std::string& path, F f) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return 0;
+		}
+		size_t length = 0;
+		std::vector<char> batch;
+		uint32_t header[2];
+		while (read_all(fd, header, sizeof(header))) {
+			if (header[0] == 0 || header[0] % kRecordSize != 0) {
+				break;
+			}
+			batch.resize(header[0]);
+			if (!read_all(fd, &batch[0], batch.size()) || checksum(&batch[0], batch.size()) != header[1]) {
+				break;
+			}
+			for (size_t pos = 0; pos < batch.size(); pos += kRecordSize) {
+				uint64_t key, value;
+				std::memcpy(&key, &batch[pos + 1], sizeof(key));
+				std::memcpy(&value, &batch[pos + 1 + sizeof(key)], sizeof(value));
+				f(static_cast<op_t>(batch[pos]), key, value);
+			}
+			length += sizeof(header) + batch.size();
+		}
+		::close(fd);
+		return length;
+	}
+
+	static uint32_t checksum(const void* data, size_t size) {
+		uint32_t pc = 0, pb = 0;
+		hashlittle2(data, size, &pc, &pb);
+		return pc;
+	}
+
+	static bool write_all(int fd, const void* data, size_t size) {
+		const char* p = static_cast<const char*>(data);
+		while (size > 0) {
+			ssize_t n = ::write(fd, p, size);
+			if (n <= 0) {
+				return false;
+			}
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	static bool read_all(int fd, void* data, size_t size) {
+		char* p = static_cast<char*>(data);
+		while (size > 0) {
+			ssize_t n = ::read(fd, p, size);
+			if (n <= 0) {
+				return false;
+			}
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+
+private:
+	mhashmap_log(const mhashmap_log&);
+	mhashmap_log& operator=(const mhashmap_log&);
+
+	int fd_;
+	sync_policy sync_;
+	size_t group_commit_bytes_;
+	size_t unsynced_bytes_;
+	size_t bytes_written_;
+	std::vector<char> buffer_;
+};
+
+// mhashmap persisted to a directory as a chain of checkpoints and a log.
+// A full checkpoint holds every page; an incremental one holds only the
+// pages written since the previous checkpoint, from the map's dirty page
+// bitmap. Overflow tree entries are few and go into every checkpoint. Each
+// checkpoint n starts log-n, which records the operations after it, so
+// recovery loads the latest full checkpoint, applies the incremental ones
+// that follow it and replays the last log.
+//
+// A checkpoint is written to a temporary file and renamed into place, and
+// the previous log is removed only afterwards, so a crash at any point
+// leaves a recoverable directory. Values changed through find() iterators
+// are not logged; use insert_or_assign().
+class durable_mhashmap {
+public:
+	typedef mhashmap::key_t key_t;
+	typedef mhashmap::value_t value_t;
+	typedef mhashpage::entry_t entry_t;
+
+	struct options {
+		options() : sync(mhashmap_log::kGroupCommit), group_commit_bytes(1 << 20), full_checkpoint_interval(8) {}
+
+		mhashmap_log::sync_policy sync;
+		size_t group_commit_bytes;
+		// Every this many checkpoints one is full, and the files before it
+		// are deleted. A checkpoint after the table grew is always full.
+		int full_checkpoint_interval;
+	};
+
+	durable_mhashmap(const std::string& dir, const options& opts)
+		: dir_(dir), opts_(opts), log_(opts.sync, opts.group_commit_bytes),
+		  seq_(0), full_seq_(0), last_capacity_(0), checkpoint_bytes_(0) {}
+
+	// Recovers the table from |dir| and opens the log for appending.
+	// Returns false on an I/O error.
+	bool open() {
+		std::vector<uint64_t> checkpoints = list_files("checkpoint-");
+		map_.clear();
+		map_.track_dirty_pages();
+		seq_ = 0;
+		for (size_t i = checkpoints.size(); i-- > 0; ) {
+			checkpoint_header h;
+			if (read_header(checkpoints[i], &h) && h.full) {
+				seq_ = checkpoints[i];
+				break;
+			}
+		}
+		if (seq_ != 0) {
+			full_seq_ = seq_;
+			std::vector<entry_t> tree_entries;
+			if (!load_checkpoint(seq_, &tree_entries)) {
+				return false;
+			}
+			while (std::binary_search(checkpoints.begin(), checkpoints.end(), seq_ + 1) &&
+					load_checkpoint(seq_ + 1, &tree_entries)) {
+				++seq_;
+			}
+			last_capacity_ = map_.capacity_;
+			// The loaded pages are what the checkpoints hold.
+			map_.take_dirty_pages([](int32_t, const mhashpage&) {});
+			restore_trees(tree_entries);
+		}
+		size_t length = mhashmap_log::replay(log_path(seq_), [&](mhashmap_log::op_t op, uint64_t key, uint64_t value) {
+			apply(op, key, value);
+		});
+		// Appends go after the last intact batch.
+		if (truncate(log_path(seq_).c_str(), length) != 0 && errno != ENOENT) {
+			return false;
+		}
+		return log_.open(log_path(seq_));
+	}
+
+	size_t size() const { return map_.size(); }
+
+	mhashmap::iterator find(const key_t& k) { return map_.find(k); }
+	mhashmap::iterator end() { return map_.end(); }
+
+	void insert(const entry_t& e) {
+		log_.append(mhashmap_log::kInsert, e.first, e.second);
+		map_.insert(e);
+	}
+
+	void insert_or_assign(const entry_t& e) {
+		log_.append(mhashmap_log::kAssign, e.first, e.second);
+		map_.insert_or_assign(e);
+	}
+
+	bool erase(const key_t& k) {
+		log_.append(mhashmap_log::kErase, k, 0);
+		return map_.erase(k);
+	}
+
+	// Makes the operations so far durable as far as the sync policy goes.
+	bool commit() { return log_.commit(); }
+
+	bool checkpoint() {
+		if (!log_.commit() || !log_.sync()) {
+			return false;
+		}
+		uint64_t seq = seq_ + 1;
+		bool full = map_.capacity_ != last_capacity_ ||
+			static_cast<int>(seq - full_seq_) >= opts_.full_checkpoint_interval;
+		if (!write_checkpoint(seq, full)) {
+			return false;
+		}
+		if (!log_.open(log_path(seq))) {
+			return false;
+		}
+		unlink(log_path(seq_).c_str());
+		if (full) {
+			for (uint64_t s = full_seq_; s < seq; ++s) {
+				unlink(checkpoint_path(s).c_str());
+			}
+			full_seq_ = seq;
+		}
+		seq_ = seq;
+		last_capacity_ = map_.capacity_;
+		return true;
+	}
+
+	size_t log_bytes_written() const { return log_.bytes_written(); }
+	size_t checkpoint_bytes_written() const { return checkpoint_bytes_; }
+
+	const mhashmap& map() const { return map_; }
+
+private:
+	static const uint32_t kMagic = 0x4b43484d;
+	static const uint32_t kTrailer = 0x444e484d;
+
+	struct checkpoint_header {
+		uint32_t magic;
+		uint32_t full;
+		uint64_t seq;
+		int32_t capacity;
+		int32_t num_entries;
+		uint32_t epoch;
+		int32_t ttl;
+		uint32_t num_pages;
+		uint32_t num_tree_entries;
+	};
+
+	durable_mhashmap(const durable_mhashmap&);
+	durable_mhashmap& operator=(const durable_mhashmap&);
+
+	void apply(mhashmap_log::op_t op, uint64_t key, uint64_t value) {
+		switch (op) {
+		case mhashmap_log::kInsert:
+			map_.insert(std::make_pair(key, value));
+			break;
+		case mhashmap_log::kAssign:
+			map_.insert_or_assign(std::make_pair(key, value));
+			break;
+		case mhashmap_log::kErase:
+			map_.erase(key);
+			break;
+		}
+	}
+
+	std::string checkpoint_path(uint64_t seq) const {
+		return dir_ + "/checkpoint-" + std::to_string(seq);
+	}
+
+	std::string log_path(uint64_t seq) const {
+		return dir_ + "/log-" + std::to_string(seq);
+	}
+
+	std::vector<uint64_t> list_files(const std::string& prefix) const {
+		std::vector<uint64_t> seqs;
+		DIR* d = opendir(dir_.c_str());
+		if (d == nullptr) {
+			return seqs;
+		}
+		while (struct dirent* ent = readdir(d)) {
+			std::string name = ent->d_name;
+			if (name.compare(0, prefix.size(), prefix) == 0 &&
+					name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) {
+				seqs.push_back(std::stoull(name.substr(prefix.size())));
+			}
+		}
+		closedir(d);
+		std::sort(seqs.begin(), seqs.end());
+		return seqs;
+	}
+
+	bool write_checkpoint(uint64_t seq, bool full) {
+		if (full) {
+			map_.mark_all_dirty();
+		}
+		std::vector<char> body;
+		uint32_t num_pages = 0;
+		map_.take_dirty_pages([&](int32_t p, const mhashpage& page) {
+			size_t pos = body.size();
+			body.resize(pos + sizeof(p) + sizeof(page));
+			std::memcpy(&body[pos], &p, sizeof(p));
+			std::memcpy(&body[pos + sizeof(p)], &page, sizeof(page));
+			++num_pages;
+		});
+		uint32_t num_tree_entries = 0;
+		for (size_t p = 0; p < map_.tree_.size(); ++p) {
+			if (map_.tree_[p] == nullptr) {
+				continue;
+			}
+			map_.tree_[p]->for_each_extent([&](btree_page::extent* e, int size) {
+				for (int j = 0; j < size; ++j) {
+					size_t pos = body.size();
+					body.resize(pos + sizeof(entry_t));
+					std::memcpy(&body[pos], &e->item_[j], sizeof(entry_t));
+					++num_tree_entries;
+				}
+			});
+		}
+
+		checkpoint_header h = {kMagic, full ? 1u : 0u, seq, map_.capacity_, map_.num_entries_,
+			map_.epoch_, map_.ttl_, num_pages, num_tree_entries};
+		uint32_t trailer = kTrailer;
+		std::string tmp = checkpoint_path(seq) + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		bool ok = mhashmap_log::write_all(fd, &h, sizeof(h)) &&
+			(body.empty() || mhashmap_log::write_all(fd, &body[0], body.size())) &&
+			mhashmap_log::write_all(fd, &trailer, sizeof(trailer)) && fsync(fd) == 0;
+		ok = ::close(fd) == 0 && ok;
+		ok = ok && rename(tmp.c_str(), checkpoint_path(seq).c_str()) == 0 && sync_dir();
+		checkpoint_bytes_ += sizeof(h) + body.size() + sizeof(trailer);
+		return ok;
+	}
+
+	bool read_header(uint64_t seq, checkpoint_header* h) const {
+		int fd = ::open(checkpoint_path(seq).c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		bool ok = mhashmap_log::read_all(fd, h, sizeof(*h)) && h->magic == kMagic;
+		::close(fd);
+		return ok;
+	}
+
+	// Reads checkpoint |seq| over the map. Its tree entries replace
+	// |tree_entries|; they only go back into trees once the chain is loaded.
+	bool load_checkpoint(uint64_t seq, std::vector<entry_t>* tree_entries) {
+		int fd = ::open(checkpoint_path(seq).c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		checkpoint_header h;
+		bool ok = mhashmap_log::read_all(fd, &h, sizeof(h)) && h.magic == kMagic;
+		if (ok && h.full) {
+			map_.release_trees(nullptr);
+			map_.release_pages();
+			map_.init(h.capacity);
+		}
+		ok = ok && h.capacity == map_.capacity_;
+		for (uint32_t i = 0; ok && i < h.num_pages; ++i) {
+			int32_t p;
+			ok = mhashmap_log::read_all(fd, &p, sizeof(p)) && p >= 0 && p < map_.capacity_ &&
+				mhashmap_log::read_all(fd, &map_.page_[p], sizeof(mhashpage));
+		}
+		if (ok) {
+			tree_entries->resize(h.num_tree_entries);
+			ok = h.num_tree_entries == 0 ||
+				mhashmap_log::read_all(fd, &(*tree_entries)[0], sizeof(entry_t) * h.num_tree_entries);
+		}
+		uint32_t trailer = 0;
+		ok = ok && mhashmap_log::read_all(fd, &trailer, sizeof(trailer)) && trailer == kTrailer;
+		::close(fd);
+		if (ok) {
+			map_.num_entries_ = h.num_entries;
+			map_.epoch_ = h.epoch;
+			map_.ttl_ = h.ttl;
+		}
+		return ok;
+	}
+
+	// The pages still carry the tree flags of the last checkpoint. Trees are
+	// built again from those entries; one that no longer fits its tree,
+	// which depends on insertion order, goes into the pages.
+	void restore_trees(const std::vector<entry_t>& tree_entries) {
+		for (int32_t p = 0; p < map_.capacity_; ++p) {
+			map_.page_[p].cxt.flags[mhashpage::kTreeFlag] = 0;
+		}
+		for (size_t i = 0; i < tree_entries.size(); ++i) {
+			mhashmap::hash_array_t key_hash;
+			map_.compute_hash(tree_entries[i].first, key_hash);
+			if (!map_.try_insert_tree(tree_entries[i], key_hash)) {
+				map_.insert_internal(tree_entries[i], key_hash, map_.current_stamp());
+			}
+		}
+	}
+
+	bool sync_dir() const {
+		int fd = ::open(dir_.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		bool ok = fsync(fd) == 0;
+		::close(fd);
+		return ok;
+	}
+
+	std::string dir_;
+	options opts_;
+	mhashmap map_;
+	mhashmap_log log_;
+	// Checkpoint the log continues from, and the full checkpoint it builds on.
+	uint64_t seq_;
+	uint64_t full_seq_;
+	int32_t last_capacity_;
+	size_t checkpoint_bytes_;
+};
+
+#endif  // DURABLE_MHASHMAP_H_
@@ -0,0 +1,205 @@
+#include <chrono>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "durable_mhashmap.h"
+
+class scratch_dir {
+public:
+	scratch_dir() {
+		char path[] = "/tmp/durable_mhashmap_XXXXXX";
+		path_ = mkdtemp(path);
+	}
+
+	~scratch_dir() {
+		DIR* d = opendir(path_.c_str());
+		while (struct dirent* ent = readdir(d)) {
+			unlink((path_ + "/" + ent->d_name).c_str());
+		}
+		closedir(d);
+		rmdir(path_.c_str());
+	}
+
+	const std::string& path() const { return path_; }
+
+private:
+	std::string path_;
+};
+
+void expect_same(durable_mhashmap& m, const std::unordered_map<uint64_t, uint64_t>& expected) {
+	EXPECT_EQ(expected.size(), m.size());
+	for (std::unordered_map<uint64_t, uint64_t>::const_iterator iter = expected.begin(); iter != expected.end(); ++iter) {
+		mhashmap::iterator found = m.find(iter->first);
+		ASSERT_NE(m.end(), found) << iter->first;
+		EXPECT_EQ(iter->second, found->second) << iter->first;
+	}
+}
+
+TEST(durable_mhashmap, RecoverFromLog) {
+	scratch_dir dir;
+	std::unordered_map<uint64_t, uint64_t> expected;
+	{
+		durable_mhashmap m(dir.path(), durable_mhashmap::options());
+		ASSERT_TRUE(m.open());
+		for (uint64_t i = 1; i <= 10000; ++i) {
+			m.insert(std::make_pair(i, i));
+			expected[i] = i;
+		}
+		for (uint64_t i = 1; i <= 10000; i += 3) {
+			m.erase(i);
+			expected.erase(i);
+		}
+		ASSERT_TRUE(m.commit());
+	}
+	durable_mhashmap m(dir.path(), durable_mhashmap::options());
+	ASSERT_TRUE(m.open());
+	expect_same(m, expected);
+}
+
+TEST(durable_mhashmap, IncrementalCheckpoints) {
+	scratch_dir dir;
+	std::unordered_map<uint64_t, uint64_t> expected;
+	durable_mhashmap::options opts;
+	opts.full_checkpoint_interval = 4;
+	{
+		durable_mhashmap m(dir.path(), opts);
+		ASSERT_TRUE(m.open());
+		for (uint64_t i = 1; i <= 50000; ++i) {
+			m.insert(std::make_pair(i, i));
+			expected[i] = i;
+		}
+		ASSERT_TRUE(m.checkpoint());
+		size_t full_bytes = m.checkpoint_bytes_written();
+
+		for (int round = 1; round <= 6; ++round) {
+			for (uint64_t i = round; i <= 50000; i += 500) {
+				m.insert_or_assign(std::make_pair(i, i * 10 + round));
+				expected[i] = i * 10 + round;
+			}
+			m.erase(round * 1000);
+			expected.erase(round * 1000);
+			size_t before = m.checkpoint_bytes_written();
+			ASSERT_TRUE(m.checkpoint());
+			if (round % opts.full_checkpoint_interval != 0) {
+				EXPECT_GT(full_bytes / 4, m.checkpoint_bytes_written() - before) << round;
+			}
+		}
+		m.insert(std::make_pair(100000ULL, 7ULL));
+		expected[100000] = 7;
+		ASSERT_TRUE(m.commit());
+	}
+	durable_mhashmap m(dir.path(), opts);
+	ASSERT_TRUE(m.open());
+	expect_same(m, expected);
+}
+
+TEST(durable_mhashmap, TornLogTail) {
+	scratch_dir dir;
+	{
+		durable_mhashmap m(dir.path(), durable_mhashmap::options());
+		ASSERT_TRUE(m.open());
+		m.insert(std::make_pair(1ULL, 1ULL));
+		ASSERT_TRUE(m.commit());
+	}
+	int fd = open((dir.path() + "/log-0").c_str(), O_WRONLY | O_APPEND);
+	ASSERT_LE(0, fd);
+	const char garbage[] = "torn batch";
+	ASSERT_TRUE(mhashmap_log::write_all(fd, garbage, sizeof(garbage)));
+	close(fd);
+	{
+		durable_mhashmap m(dir.path(), durable_mhashmap::options());
+		ASSERT_TRUE(m.open());
+		EXPECT_EQ(1u, m.size());
+		m.insert(std::make_pair(2ULL, 2ULL));
+		ASSERT_TRUE(m.commit());
+	}
+	durable_mhashmap m(dir.path(), durable_mhashmap::options());
+	ASSERT_TRUE(m.open());
+	EXPECT_EQ(2u, m.size());
+	EXPECT_NE(m.end(), m.find(2));
+}
+
+TEST(durable_mhashmap, CheckpointKeepsTreeEntries) {
+	scratch_dir dir;
+	{
+		durable_mhashmap m(dir.path(), durable_mhashmap::options());
+		ASSERT_TRUE(m.open());
+		for (uint64_t i = 1; i < 2000; ++i) {
+			m.insert(std::make_pair(i, i));
+		}
+		for (uint64_t j = 1; j <= 40; ++j) {
+			m.insert(std::make_pair((j << 32) | 7, j));
+		}
+		ASSERT_EQ(1u, m.map().num_trees());
+		ASSERT_TRUE(m.checkpoint());
+	}
+	durable_mhashmap m(dir.path(), durable_mhashmap::options());
+	ASSERT_TRUE(m.open());
+	EXPECT_EQ(1999u + 40, m.size());
+	for (uint64_t j = 1; j <= 40; ++j) {
+		mhashmap::iterator iter = m.find((j << 32) | 7);
+		ASSERT_NE(m.end(), iter) << j;
+		EXPECT_EQ(j, iter->second);
+	}
+}
+
+// Every round rewrites 1% of the values and checkpoints. Incremental
+// checkpoints are compared with writing the whole table each time.
+void checkpoint_rounds(int full_checkpoint_interval) {
+	const uint64_t kKeys = 1000000;
+	const int kRounds = 8;
+	scratch_dir dir;
+	durable_mhashmap::options opts;
+	opts.full_checkpoint_interval = full_checkpoint_interval;
+	{
+		durable_mhashmap m(dir.path(), opts);
+		ASSERT_TRUE(m.open());
+		for (uint64_t i = 1; i <= kKeys; ++i) {
+			m.insert(std::make_pair(i * 0x9e3779b97f4a7c15ULL, i));
+		}
+		ASSERT_TRUE(m.checkpoint());
+		size_t base = m.checkpoint_bytes_written();
+
+		std::default_random_engine eng;
+		std::uniform_int_distribution<uint64_t> dist(1, kKeys);
+		for (int round = 0; round < kRounds; ++round) {
+			for (uint64_t n = 0; n < kKeys / 100; ++n) {
+				uint64_t i = dist(eng);
+				m.insert_or_assign(std::make_pair(i * 0x9e3779b97f4a7c15ULL, i + round));
+			}
+			ASSERT_TRUE(m.commit());
+			ASSERT_TRUE(m.checkpoint());
+		}
+		std::cout << "Full checkpoint : " << base << " bytes, " << kRounds << " rounds : "
+			<< m.checkpoint_bytes_written() - base << " bytes, log : " << m.log_bytes_written() << " bytes" << std::endl;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	durable_mhashmap m(dir.path(), opts);
+	ASSERT_TRUE(m.open());
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	EXPECT_EQ(kKeys, m.size());
+	std::cout << "Recovery : " << elapsed.count() << " s" << std::endl;
+}
+
+TEST(durable_mhashmap, IncrementalCheckpointBench) {
+	checkpoint_rounds(16);
+}
+
+TEST(durable_mhashmap, FullCheckpointBench) {
+	checkpoint_rounds(1);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,316 @@
+#ifndef FINGERPRINT_SET_H_
+#define FINGERPRINT_SET_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include <emmintrin.h>
+
+// Memory-dense set of 64-bit keys that stores a 16-bit fingerprint per slot.
+// The bucket index supplies the remaining bits of the hash, as in a cuckoo
+// filter: a key has two candidate buckets, the second derived from the
+// first and the fingerprint alone, so fingerprints can be relocated without
+// the original key.
+//
+// approximate: fingerprints only. No false negatives; a false positive
+//   needs one of the 2 * 8 fingerprints of the candidate buckets to match,
+//   so at load a the rate is about 1 - (1 - 1/65535)^(16a), i.e. 0.023% at
+//   95% load, for 2 / a bytes per key (2.1 bytes at 95% load). The capacity
+//   is fixed because fingerprints cannot be rehashed.
+// exact: adds a verification store with the full key of every slot, read
+//   only when a fingerprint matches. (2 + 8) / a bytes per key, and the set
+//   grows like mhashmap.
+//
+// For comparison an mhashpage spends 128 / 7 = 18.3 bytes on a slot, about
+// 26 bytes per key at the 70% load mhashmap grows at.
+struct fingerprint_bucket {
+	typedef uint16_t fingerprint_t;
+	static const int num_max_entries = 8;
+	fingerprint_t fp[num_max_entries];
+
+	// Bitmask of the slots holding |f|. Empty slots hold 0.
+	int match(fingerprint_t f) const {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fp));
+		__m128i eq = _mm_cmpeq_epi16(v, _mm_set1_epi16(static_cast<short>(f)));
+		return _mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128()));
+	}
+
+	int free_index() const {
+		int bits = match(0);
+		return bits == 0 ? -1 : __builtin_ctz(bits);
+	}
+};
+
+class fingerprint_set {
+public:
+	typedef uint64_t key_t;
+	typedef fingerprint_bucket::fingerprint_t fingerprint_t;
+	enum mode_t {
+		approximate,
+		exact,
+	};
+
+	// Sized so that |expected_keys| stay below 95% load.
+	fingerprint_set(size_t expected_keys, mode_t mode) : mode_(mode), keys_(nullptr) {
+		size_t buckets = 1;
+		while (buckets * fingerprint_bucket::num_max_entries * 95 / 100 < expected_keys) {
+			buckets *= 2;
+		}
+		init(buckets);
+		rng_ = 88172645463325252ULL;
+		has_victim_ = false;
+	}
+
+	~fingerprint_set() {
+		free(bucket_);
+		free(keys_);
+	}
+
+	size_t size() const { return size_; }
+	size_t capacity() const { return num_buckets_ * fingerprint_bucket::num_max_entries; }
+	mode_t mode() const { return mode_; }
+
+	int load_factor() const {
+		return size_ * 1000LL / capacity();
+	}
+
+	size_t memory_usage() const {
+		size_t slot_size = sizeof(fingerprint_t) + (mode_ == exact ? sizeof(key_t) : 0);
+		return capacity() * slot_size;
+	}
+
+	double bytes_per_entry() const {
+		return static_cast<double>(memory_usage()) / size_;
+	}
+
+	// False positive rate of an approximate set at its current load.
+	double expected_false_positive_rate() const {
+		double probes = 2.0 * fingerprint_bucket::num_max_entries * size_ / capacity();
+		return 1.0 - std::pow(1.0 - 1.0 / 65535, probes);
+	}
+
+	// Returns false if the key is (or, in approximate mode, may be) present
+	// already, or if an approximate set is full.
+	bool insert(const key_t& k) {
+		if (contains(k) || has_victim_) {
+			return false;
+		}
+		uint64_t h = mix(k);
+		// A failed insert has still placed |k|; what is left over is a
+		// resident it kicked out.
+		if (!insert_internal(fingerprint(h), k, h & mask_) && mode_ == exact) {
+			rebuild();
+		}
+		++size_;
+		return true;
+	}
+
+	bool contains(const key_t& k) const {
+		uint64_t h = mix(k);
+		fingerprint_t f = fingerprint(h);
+		size_t i1 = h & mask_;
+		size_t i2 = alt_index(i1, f);
+		if (lookup(i1, f, k) || lookup(i2, f, k)) {
+			return true;
+		}
+		return has_victim_ && victim_fp_ == f && (victim_index_ == i1 || victim_index_ == i2) &&
+			(mode_ == approximate || victim_key_ == k);
+	}
+
+	// In approximate mode only keys that were inserted may be erased.
+	bool erase(const key_t& k) {
+		uint64_t h = mix(k);
+		fingerprint_t f = fingerprint(h);
+		size_t i1 = h & mask_;
+		size_t i2 = alt_index(i1, f);
+		if (has_victim_ && victim_fp_ == f && (victim_index_ == i1 || victim_index_ == i2) &&
+				(mode_ == approximate || victim_key_ == k)) {
+			has_victim_ = false;
+			--size_;
+			return true;
+		}
+		if (erase_internal(i1, f, k) || erase_internal(i2, f, k)) {
+			--size_;
+			if (has_victim_) {
+				has_victim_ = false;
+				insert_internal(victim_fp_, victim_key_, victim_index_);
+			}
+			return true;
+		}
+		return false;
+	}
+
+private:
+	static const int kMaxKicks = 500;
+
+	void init(size_t num_buckets) {
+		num_buckets_ = num_buckets;
+		mask_ = num_buckets - 1;
+		size_ = 0;
+		bucket_ = reinterpret_cast<fingerprint_bucket*>(malloc(sizeof(fingerprint_bucket) * num_buckets));
+		memset(bucket_, 0, sizeof(fingerprint_bucket) * num_buckets);
+		if (mode_ == exact) {
+			keys_ = reinterpret_cast<key_t*>(malloc(sizeof(key_t) * capacity()));
+		}
+	}
+
+	static uint64_t mix(uint64_t k) {
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	// The top 16 bits of the hash, which never take part in the index.
+	static fingerprint_t fingerprint(uint64_t h) {
+		fingerprint_t f = static_cast<fingerprint_t>(h >> 48);
+		return f == 0 ? 1 : f;
+	}
+
+	size_t alt_index(size_t i, fingerprint_t f) const {
+		return (i ^ (f * 0x5bd1e995ULL)) & mask_;
+	}
+
+	key_t& key_at(size_t i, int slot) {
+		return keys_[i * fingerprint_bucket::num_max_entries + slot];
+	}
+
+	const key_t& key_at(size_t i, int slot) const {
+		return keys_[i * fingerprint_bucket::num_max_entries + slot];
+	}
+
+	bool lookup(size_t i, fingerprint_t f, const key_t& k) const {
+		int bits = bucket_[i].match(f);
+		if (mode_ == approximate) {
+			return bits != 0;
+		}
+		while (bits != 0) {
+			if (key_at(i, __builtin_ctz(bits)) == k) {
+				return true;
+			}
+			bits &= bits - 1;
+		}
+		return false;
+	}
+
+	bool erase_internal(size_t i, fingerprint_t f, const key_t& k) {
+		int bits = bucket_[i].match(f);
+		while (bits != 0) {
+			int slot = __builtin_ctz(bits);
+			if (mode_ == approximate || key_at(i, slot) == k) {
+				bucket_[i].fp[slot] = 0;
+				return true;
+			}
+			bits &= bits - 1;
+		}
+		return false;
+	}
+
+	bool try_place(size_t i, fingerprint_t f, const key_t& k) {
+		int slot = bucket_[i].free_index();
+		if (slot < 0) {
+			return false;
+		}
+		bucket_[i].fp[slot] = f;
+		if (mode_ == exact) {
+			key_at(i, slot) = k;
+		}
+		return true;
+	}
+
+	uint64_t next_random() {
+		rng_ ^= rng_ << 13;
+		rng_ ^= rng_ >> 7;
+		rng_ ^= rng_ << 17;
+		return rng_;
+	}
+
+	// Places the fingerprint in one of its two buckets, kicking random
+	// residents to their alternate bucket when both are full. On failure the
+	// last kicked item is kept aside: an approximate set keeps it as the
+	// victim and stops accepting keys, an exact set returns false so the
+	// caller can grow and retry with it.
+	bool insert_internal(fingerprint_t f, key_t k, size_t i) {
+		if (try_place(i, f, k) || try_place(alt_index(i, f), f, k)) {
+			return true;
+		}
+
+		size_t cur = (next_random() & 1) ? i : alt_index(i, f);
+		for (int n = 0; n < kMaxKicks; ++n) {
+			int slot = next_random() % fingerprint_bucket::num_max_entries;
+			std::swap(f, bucket_[cur].fp[slot]);
+			if (mode_ == exact) {
+				std::swap(k, key_at(cur, slot));
+			}
+			cur = alt_index(cur, f);
+			if (try_place(cur, f, k)) {
+				return true;
+			}
+		}
+
+		if (mode_ == approximate) {
+			has_victim_ = true;
+			victim_fp_ = f;
+			victim_key_ = k;
+			victim_index_ = cur;
+			return false;
+		}
+		pending_key_ = k;
+		return false;
+	}
+
+	// Exact mode only: rehashes every key into twice as many buckets,
+	// including the item left over by the failed insert.
+	void rebuild() {
+		fingerprint_bucket* old_bucket = bucket_;
+		key_t* old_keys = keys_;
+		size_t old_num_buckets = num_buckets_;
+		size_t old_size = size_;
+		key_t pending = pending_key_;
+
+		init(old_num_buckets * 2);
+		for (size_t i = 0; i < old_num_buckets; ++i) {
+			for (int j = 0; j < fingerprint_bucket::num_max_entries; ++j) {
+				if (old_bucket[i].fp[j] != 0) {
+					reinsert(old_keys[i * fingerprint_bucket::num_max_entries + j]);
+				}
+			}
+		}
+		reinsert(pending);
+		size_ = old_size;
+		free(old_bucket);
+		free(old_keys);
+	}
+
+	// A failed insert has placed |k| and left a resident in pending_key_,
+	// which the rebuild places.
+	void reinsert(const key_t& k) {
+		uint64_t h = mix(k);
+		if (!insert_internal(fingerprint(h), k, h & mask_)) {
+			// Practically unreachable at half load; grow once more.
+			rebuild();
+		}
+	}
+
+	mode_t mode_;
+	fingerprint_bucket* bucket_;
+	key_t* keys_;
+	size_t num_buckets_;
+	size_t mask_;
+	size_t size_;
+	uint64_t rng_;
+
+	bool has_victim_;
+	fingerprint_t victim_fp_;
+	key_t victim_key_;
+	size_t victim_index_;
+
+	key_t pending_key_;
+};
+
+#endif  // FINGERPRINT_SET_H_
@@ -0,0 +1,198 @@
+#include <random>
+#include <unordered_set>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "fingerprint_set.h"
+
+TEST(fingerprint_set, BucketAlign) {
+	EXPECT_EQ(16u, sizeof(fingerprint_bucket));
+}
+
+TEST(fingerprint_set, ApproximateNoFalseNegative) {
+	const size_t kKeys = 1000000;
+	fingerprint_set s(kKeys, fingerprint_set::approximate);
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (size_t i = 0; i < kKeys; ++i) {
+		keys.push_back(dist(eng));
+		s.insert(keys.back());
+	}
+	for (uint64_t k : keys) {
+		ASSERT_TRUE(s.contains(k)) << k;
+	}
+
+	size_t false_positives = 0;
+	const size_t kProbes = 10000000;
+	for (size_t i = 0; i < kProbes; ++i) {
+		if (s.contains(dist(eng))) {
+			++false_positives;
+		}
+	}
+	double rate = static_cast<double>(false_positives) / kProbes;
+	std::cout << "Load Factor : " << s.load_factor() << " False positive rate : " << 100.0 * rate
+		<< "% (expected " << 100.0 * s.expected_false_positive_rate() << "%)" << std::endl;
+	EXPECT_LT(rate, 2 * s.expected_false_positive_rate());
+}
+
+TEST(fingerprint_set, ApproximateFull) {
+	fingerprint_set s(1000, fingerprint_set::approximate);
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	while (keys.size() < s.capacity() * 2) {
+		uint64_t k = dist(eng);
+		if (!s.insert(k) && !s.contains(k)) {
+			break;
+		}
+		keys.push_back(k);
+	}
+	EXPECT_GT(s.load_factor(), 900);
+	for (uint64_t k : keys) {
+		ASSERT_TRUE(s.contains(k)) << k;
+	}
+}
+
+// Inserts random keys until |s| refuses one, and returns those it took.
+std::vector<uint64_t> fill(fingerprint_set& s) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	while (true) {
+		uint64_t k = dist(eng);
+		if (!s.insert(k)) {
+			if (!s.contains(k)) {
+				return keys;
+			}
+			continue;
+		}
+		keys.push_back(k);
+	}
+}
+
+// One of the keys of a full set is held outside the buckets. Whichever key
+// goes first, that one included, every key erases and the set empties.
+TEST(fingerprint_set, ApproximateEraseFromFull) {
+	const size_t kKeys = 200;
+	size_t num_keys;
+	{
+		fingerprint_set s(kKeys, fingerprint_set::approximate);
+		num_keys = fill(s).size();
+	}
+	for (size_t j = 0; j < num_keys; ++j) {
+		fingerprint_set s(kKeys, fingerprint_set::approximate);
+		std::vector<uint64_t> keys = fill(s);
+		ASSERT_EQ(num_keys, keys.size());
+		ASSERT_TRUE(s.erase(keys[j])) << j;
+		EXPECT_EQ(num_keys - 1, s.size()) << j;
+		for (size_t i = 0; i < num_keys; ++i) {
+			if (i != j) {
+				ASSERT_TRUE(s.erase(keys[i])) << j << " " << i;
+			}
+		}
+		EXPECT_EQ(0u, s.size()) << j;
+		EXPECT_TRUE(s.insert(keys[j])) << j;
+	}
+}
+
+TEST(fingerprint_set, ExactGrowAndErase) {
+	fingerprint_set s(16, fingerprint_set::exact);
+	std::unordered_set<uint64_t> ref;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, 2000000);
+	for (int i = 0; i < 3000000; ++i) {
+		uint64_t k = dist(eng);
+		if (i % 4 == 0) {
+			EXPECT_EQ(ref.erase(k) == 1, s.erase(k)) << k;
+		} else {
+			EXPECT_EQ(ref.insert(k).second, s.insert(k)) << k;
+		}
+	}
+	EXPECT_EQ(ref.size(), s.size());
+	for (uint64_t k = 1; k <= 2000000; ++k) {
+		ASSERT_EQ(ref.count(k) == 1, s.contains(k)) << k;
+	}
+}
+
+// Inverse of fingerprint_set's hash, which is the MurmurHash3 finalizer.
+uint64_t unmix(uint64_t h) {
+	auto inverse = [](uint64_t c) {
+		uint64_t x = c;
+		for (int i = 0; i < 5; ++i) {
+			x *= 2 - c * x;
+		}
+		return x;
+	};
+	h ^= h >> 33;
+	h *= inverse(0xc4ceb9fe1a85ec53ULL);
+	h ^= h >> 33;
+	h *= inverse(0xff51afd7ed558ccdULL);
+	h ^= h >> 33;
+	return h;
+}
+
+// Keys sharing the fingerprint and the low 8 bits of the hash have the
+// same two buckets until the set has 512 buckets, so more of them than two
+// buckets hold fail again in every rebuild before that.
+TEST(fingerprint_set, ExactRebuildFailsInsideRebuild) {
+	fingerprint_set s(16, fingerprint_set::exact);
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (int i = 0; i < 2 * fingerprint_bucket::num_max_entries + 4; ++i) {
+		uint64_t h = (0xabcdULL << 48) | (dist(eng) & 0xffffffff00ULL) | 0x5a;
+		keys.push_back(unmix(h));
+		EXPECT_TRUE(s.insert(keys.back()));
+	}
+	EXPECT_EQ(keys.size(), s.size());
+	for (uint64_t k : keys) {
+		ASSERT_TRUE(s.contains(k)) << k;
+	}
+	for (uint64_t k : keys) {
+		EXPECT_TRUE(s.erase(k)) << k;
+		EXPECT_FALSE(s.contains(k)) << k;
+		EXPECT_FALSE(s.erase(k)) << k;
+	}
+	EXPECT_EQ(0u, s.size());
+}
+
+const size_t kHundredMillion = 100000000;
+
+TEST(fingerprint_set, ApproximateHundredMillionBench) {
+	fingerprint_set s(kHundredMillion, fingerprint_set::approximate);
+	for (uint64_t k = 1; k <= kHundredMillion; ++k) {
+		s.insert(k * 0x9e3779b97f4a7c15ULL);
+	}
+	size_t false_positives = 0;
+	for (uint64_t k = 1; k <= kHundredMillion / 10; ++k) {
+		ASSERT_TRUE(s.contains(k * 0x9e3779b97f4a7c15ULL));
+		if (s.contains(k * 0x9e3779b97f4a7c15ULL + 1)) {
+			++false_positives;
+		}
+	}
+	std::cout << "Load Factor : " << s.load_factor() << std::endl;
+	std::cout << "Bytes per entry : " << s.bytes_per_entry() << std::endl;
+	std::cout << "False positive rate : " << 100.0 * false_positives / (kHundredMillion / 10)
+		<< "% (expected " << 100.0 * s.expected_false_positive_rate() << "%)" << std::endl;
+}
+
+TEST(fingerprint_set, ExactHundredMillionBench) {
+	fingerprint_set s(kHundredMillion, fingerprint_set::exact);
+	for (uint64_t k = 1; k <= kHundredMillion; ++k) {
+		s.insert(k * 0x9e3779b97f4a7c15ULL);
+	}
+	for (uint64_t k = 1; k <= kHundredMillion / 10; ++k) {
+		ASSERT_TRUE(s.contains(k * 0x9e3779b97f4a7c15ULL));
+		ASSERT_FALSE(s.contains(k * 0x9e3779b97f4a7c15ULL + 1));
+	}
+	std::cout << "Load Factor : " << s.load_factor() << std::endl;
+	std::cout << "Bytes per entry : " << s.bytes_per_entry() << std::endl;
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
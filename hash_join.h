@@ -0,0 +1,170 @@
+#ifndef HASH_JOIN_H_
+#define HASH_JOIN_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "mhashmap.h"
+
+struct join_pair {
+	uint32_t build_row;
+	uint32_t probe_row;
+};
+
+// Equi-join of two uint64_t key columns. The build side goes into an
+// mhashmap from key to the position of the last build row with that key;
+// earlier rows with the same key are chained through next_, so repeated
+// join keys cost one table entry. The probe side is looked up in groups with
+// mhashmap::find_batch so that page misses overlap.
+//
+// With radix_bits > 0 both sides are first scattered into 2^radix_bits
+// partitions by the low bits of a hash independent of mhashmap's, and each
+// probe partition only meets the small, cache-resident table of its build
+// partition.
+class hash_join {
+public:
+	typedef uint64_t key_t;
+	static const uint32_t kNoRow = 0xffffffff;
+
+	explicit hash_join(int radix_bits = 0) : radix_bits_(radix_bits) {}
+
+	~hash_join() {
+		release_tables();
+	}
+
+	int num_partitions() const { return 1 << radix_bits_; }
+
+	void build(const key_t* keys, size_t n) {
+		release_tables();
+		if (radix_bits_ == 0) {
+			build_keys_.assign(keys, keys + n);
+			build_rows_.clear();
+			build_begin_.assign(2, 0);
+			build_begin_[1] = n;
+		} else {
+			partition(keys, n, build_keys_, build_rows_, build_begin_);
+		}
+
+		next_.assign(n, static_cast<uint32_t>(kNoRow));
+		for (int p = 0; p < num_partitions(); ++p) {
+			size_t begin = build_begin_[p];
+			size_t end = build_begin_[p + 1];
+			mhashmap* table = new mhashmap(initial_pages(end - begin));
+			for (size_t pos = begin; pos < end; ++pos) {
+				mhashmap::iterator iter = table->find(build_keys_[pos]);
+				if (iter != table->end()) {
+					next_[pos] = static_cast<uint32_t>(iter->second);
+					iter->second = pos;
+				} else {
+					table->insert(std::make_pair(build_keys_[pos], static_cast<mhashmap::value_t>(pos)));
+				}
+			}
+			tables_.push_back(table);
+		}
+	}
+
+	// Emits every matching (build row, probe row) pair. Only the first
+	// |capacity| pairs are written to |out|; the return value is the total
+	// number of matches, so a short buffer can be detected and resized.
+	size_t probe(const key_t* keys, size_t n, join_pair* out, size_t capacity) {
+		size_t num_matches = 0;
+		if (n == 0 || tables_.empty()) {
+			return 0;
+		}
+		if (radix_bits_ == 0) {
+			probe_partition(0, keys, nullptr, n, out, capacity, num_matches);
+			return num_matches;
+		}
+
+		std::vector<key_t> probe_keys;
+		std::vector<uint32_t> probe_rows;
+		std::vector<size_t> probe_begin;
+		partition(keys, n, probe_keys, probe_rows, probe_begin);
+		for (int p = 0; p < num_partitions(); ++p) {
+			size_t begin = probe_begin[p];
+			probe_partition(p, &probe_keys[0] + begin, &probe_rows[0] + begin,
+				probe_begin[p + 1] - begin, out, capacity, num_matches);
+		}
+		return num_matches;
+	}
+
+private:
+	static const int kProbeBatch = 64;
+
+	hash_join(const hash_join&);
+	hash_join& operator=(const hash_join&);
+
+	void release_tables() {
+		for (size_t i = 0; i < tables_.size(); ++i) {
+			delete tables_[i];
+		}
+		tables_.clear();
+	}
+
+	// Power of two page count for about 50% load if the keys are distinct.
+	static int32_t initial_pages(size_t n) {
+		int32_t pages = mhashmap::kInitialCapacity;
+		while (static_cast<size_t>(pages) * mhashpage::num_max_entries < n * 2) {
+			pages *= 2;
+		}
+		return pages;
+	}
+
+	int partition_of(const key_t& k) const {
+		uint64_t h = k * 0x9e3779b97f4a7c15ULL;
+		return static_cast<int>(h >> (64 - radix_bits_));
+	}
+
+	// Histogram and scatter of (key, row) into contiguous partitions.
+	void partition(const key_t* keys, size_t n, std::vector<key_t>& part_keys,
+			std::vector<uint32_t>& part_rows, std::vector<size_t>& begin) const {
+		begin.assign(num_partitions() + 1, 0);
+		for (size_t i = 0; i < n; ++i) {
+			++begin[partition_of(keys[i]) + 1];
+		}
+		for (int p = 0; p < num_partitions(); ++p) {
+			begin[p + 1] += begin[p];
+		}
+
+		std::vector<size_t> cursor(begin.begin(), begin.end() - 1);
+		part_keys.resize(n);
+		part_rows.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			size_t pos = cursor[partition_of(keys[i])]++;
+			part_keys[pos] = keys[i];
+			part_rows[pos] = static_cast<uint32_t>(i);
+		}
+	}
+
+	void probe_partition(int p, const key_t* keys, const uint32_t* rows, size_t n,
+			join_pair* out, size_t capacity, size_t& num_matches) {
+		mhashmap* table = tables_[p];
+		mhashpage::entry_t* hits[kProbeBatch];
+		for (size_t base = 0; base < n; base += kProbeBatch) {
+			size_t count = std::min<size_t>(kProbeBatch, n - base);
+			table->find_batch(keys + base, count, hits);
+			for (size_t i = 0; i < count; ++i) {
+				if (hits[i] == nullptr) {
+					continue;
+				}
+				uint32_t probe_row = rows == nullptr ? static_cast<uint32_t>(base + i) : rows[base + i];
+				for (uint32_t pos = static_cast<uint32_t>(hits[i]->second); pos != kNoRow; pos = next_[pos]) {
+					if (num_matches < capacity) {
+						out[num_matches].build_row = build_rows_.empty() ? pos : build_rows_[pos];
+						out[num_matches].probe_row = probe_row;
+					}
+					++num_matches;
+				}
+			}
+		}
+	}
+
+	int radix_bits_;
+	std::vector<mhashmap*> tables_;
+	std::vector<key_t> build_keys_;
+	std::vector<uint32_t> build_rows_;
+	std::vector<size_t> build_begin_;
+	std::vector<uint32_t> next_;
+};
+
+#endif  // HASH_JOIN_H_
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "hash_join.h"
+
+typedef std::vector<std::pair<uint32_t, uint32_t> > pair_list;
+
+pair_list reference_join(const std::vector<uint64_t>& build, const std::vector<uint64_t>& probe) {
+	std::unordered_multimap<uint64_t, uint32_t> table;
+	for (size_t i = 0; i < build.size(); ++i) {
+		table.insert(std::make_pair(build[i], static_cast<uint32_t>(i)));
+	}
+	pair_list ret;
+	for (size_t i = 0; i < probe.size(); ++i) {
+		auto range = table.equal_range(probe[i]);
+		for (auto iter = range.first; iter != range.second; ++iter) {
+			ret.push_back(std::make_pair(iter->second, static_cast<uint32_t>(i)));
+		}
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+pair_list run_join(int radix_bits, const std::vector<uint64_t>& build, const std::vector<uint64_t>& probe) {
+	hash_join join(radix_bits);
+	join.build(&build[0], build.size());
+	std::vector<join_pair> out(16);
+	size_t n = join.probe(&probe[0], probe.size(), &out[0], out.size());
+	if (n > out.size()) {
+		out.resize(n);
+		EXPECT_EQ(n, join.probe(&probe[0], probe.size(), &out[0], out.size()));
+	}
+	pair_list ret;
+	for (size_t i = 0; i < n; ++i) {
+		ret.push_back(std::make_pair(out[i].build_row, out[i].probe_row));
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+TEST(hash_join, DuplicateKeysOnBothSides) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(0, 5000);
+	std::vector<uint64_t> build(20000);
+	std::vector<uint64_t> probe(30000);
+	for (auto& k : build) {
+		k = dist(eng);
+	}
+	for (auto& k : probe) {
+		k = dist(eng) + 2500;
+	}
+
+	pair_list expected = reference_join(build, probe);
+	EXPECT_EQ(expected, run_join(0, build, probe));
+	EXPECT_EQ(expected, run_join(4, build, probe));
+}
+
+TEST(hash_join, NoMatch) {
+	std::vector<uint64_t> build(1000);
+	std::vector<uint64_t> probe(1000);
+	for (size_t i = 0; i < build.size(); ++i) {
+		build[i] = i * 2;
+		probe[i] = i * 2 + 1;
+	}
+	EXPECT_TRUE(run_join(0, build, probe).empty());
+	EXPECT_TRUE(run_join(3, build, probe).empty());
+}
+
+// TPC-H like orders and lineitem: 1.5M orders with sparse order keys, and
+// 1 to 7 line items per order.
+struct tpch_tables {
+	std::vector<uint64_t> o_orderkey;
+	std::vector<uint64_t> l_orderkey;
+
+	tpch_tables() {
+		const size_t kOrders = 1500000;
+		std::default_random_engine eng;
+		std::uniform_int_distribution<int> lines(1, 7);
+		for (size_t i = 0; i < kOrders; ++i) {
+			uint64_t key = (i / 8) * 32 + (i % 8) + 1;
+			o_orderkey.push_back(key);
+			for (int j = lines(eng); j > 0; --j) {
+				l_orderkey.push_back(key);
+			}
+		}
+		std::shuffle(o_orderkey.begin(), o_orderkey.end(), eng);
+		std::shuffle(l_orderkey.begin(), l_orderkey.end(), eng);
+	}
+};
+
+tpch_tables& tables() {
+	static tpch_tables t;
+	return t;
+}
+
+TEST(hash_join, TpchTables) {
+	EXPECT_EQ(1500000u, tables().o_orderkey.size());
+	EXPECT_LT(tables().o_orderkey.size(), tables().l_orderkey.size());
+}
+
+void bench_join(int radix_bits, const std::vector<uint64_t>& build, const std::vector<uint64_t>& probe) {
+	hash_join join(radix_bits);
+	join.build(&build[0], build.size());
+	std::vector<join_pair> out(probe.size() * 7);
+	size_t n = join.probe(&probe[0], probe.size(), &out[0], out.size());
+	std::cout << "Matches : " << n << std::endl;
+}
+
+TEST(hash_join, OrdersLineitemBench) {
+	bench_join(0, tables().o_orderkey, tables().l_orderkey);
+}
+
+TEST(hash_join, OrdersLineitemRadixBench) {
+	bench_join(8, tables().o_orderkey, tables().l_orderkey);
+}
+
+TEST(hash_join, LineitemOrdersBench) {
+	bench_join(0, tables().l_orderkey, tables().o_orderkey);
+}
+
+TEST(hash_join, LineitemOrdersRadixBench) {
+	bench_join(8, tables().l_orderkey, tables().o_orderkey);
+}
+
+TEST(unordered_multimap, OrdersLineitemBench) {
+	const std::vector<uint64_t>& build = tables().o_orderkey;
+	const std::vector<uint64_t>& probe = tables().l_orderkey;
+	std::unordered_multimap<uint64_t, uint32_t> table;
+	for (size_t i = 0; i < build.size(); ++i) {
+		table.insert(std::make_pair(build[i], static_cast<uint32_t>(i)));
+	}
+	std::vector<join_pair> out(probe.size() * 7);
+	size_t n = 0;
+	for (size_t i = 0; i < probe.size(); ++i) {
+		auto range = table.equal_range(probe[i]);
+		for (auto iter = range.first; iter != range.second; ++iter) {
+			out[n].build_row = iter->second;
+			out[n].probe_row = static_cast<uint32_t>(i);
+			++n;
+		}
+	}
+	std::cout << "Matches : " << n << std::endl;
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -3,9 +3,26 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <vector>
+
+#include <emmintrin.h>
 
 #define CACHELINE_SIZE 128
 
+// Heap bytes held by a container. Slack counts the free entry slots of the
+// page array and extents, so it is part of those two and not of total().
+struct memory_usage_t {
+	size_t page_array;
+	size_t extents;
+	size_t slack;
+	size_t metadata;
+
+	size_t total() const { return page_array + extents + metadata; }
+};
+
 struct btree_page;
 struct hash_page;
 
@@ -26,6 +43,92 @@ struct page {
 	hash_page* get_hash();
 };
 
+// Hands out the nodes and extents of btree pages from slabs of
+// CACHELINE_SIZE blocks and keeps the freed ones for reuse. The slabs are
+// freed with the pool.
+class btree_pool {
+public:
+	btree_pool() : free_(nullptr), num_free_(0), deferred_(nullptr) {}
+
+	~btree_pool() {
+		for (size_t i = 0; i < slabs_.size(); ++i) {
+			free(slabs_[i]);
+		}
+	}
+
+	btree_pool(const btree_pool&) = delete;
+	btree_pool& operator=(const btree_pool&) = delete;
+
+	void* allocate() {
+		if (free_ == nullptr) {
+			refill();
+		}
+		free_block* b = free_;
+		free_ = b->next;
+		--num_free_;
+		return b;
+	}
+
+	void release(void* p) {
+		if (deferred_ != nullptr) {
+			deferred_->push_back(p);
+			return;
+		}
+		recycle(p);
+	}
+
+	void recycle(void* p) {
+		free_block* b = static_cast<free_block*>(p);
+		b->next = free_;
+		free_ = b;
+		++num_free_;
+	}
+
+	// While set, released blocks are appended to |*deferred| for the owner
+	// to recycle() once nothing reads them.
+	void defer_to(std::vector<void*>* deferred) {
+		deferred_ = deferred;
+	}
+
+	void swap(btree_pool& other) {
+		std::swap(free_, other.free_);
+		std::swap(num_free_, other.num_free_);
+		std::swap(deferred_, other.deferred_);
+		slabs_.swap(other.slabs_);
+	}
+
+	size_t bytes() const { return slabs_.size() * kSlabBlocks * CACHELINE_SIZE; }
+	size_t free_bytes() const { return num_free_ * CACHELINE_SIZE; }
+
+private:
+	struct free_block {
+		free_block* next;
+	};
+
+	static const int kSlabBlocks = 64;
+
+	void refill() {
+		void* slab;
+		if (posix_memalign(&slab, CACHELINE_SIZE, kSlabBlocks * CACHELINE_SIZE) != 0) {
+			abort();
+		}
+		slabs_.push_back(slab);
+		for (int i = kSlabBlocks - 1; i >= 0; --i) {
+			recycle(static_cast<char*>(slab) + i * CACHELINE_SIZE);
+		}
+	}
+
+	free_block* free_;
+	size_t num_free_;
+	std::vector<void*>* deferred_;
+	std::vector<void*> slabs_;
+};
+
+// A B+tree node. Nodes of height 0 link to extents that hold the elements,
+// higher ones to nodes one level down; the key range of child i runs from
+// key_[i - 1] to key_[i], both inclusive as a split can fall inside a run of
+// equal keys. A full tree grows at the top, so the root never moves. Nodes
+// and extents come from |pool|, or the heap when it is null.
 struct btree_page : public page {
 	struct extent {
 		typedef uint64_t key_t;
@@ -60,14 +163,52 @@ struct btree_page : public page {
 	};
 
 	static const int kMaxKey = 6;
+	// Neighbours merge once they fit in these, a little below what a split
+	// leaves, so that one erase does not undo a split.
+	static const int kMergeItems = extent::kMaxItem * 3 / 4;
+	static const int kMergeKeys = kMaxKey - 2;
 	uint8_t child_size_[kMaxKey + 1];
-	extent* link_[kMaxKey + 1];
+	union {
+		extent* link_[kMaxKey + 1];
+		btree_page* child_[kMaxKey + 1];
+	};
 	key_t key_[kMaxKey];
-	uint8_t padding__[16];
+	uint8_t height_;
+	uint8_t padding__[15];
 
-	void release() {
+	template <typename T>
+	static T* allocate(btree_pool* pool) {
+		return pool == nullptr ? new T : new (pool->allocate()) T;
+	}
+
+	template <typename T>
+	static void deallocate(T* p, btree_pool* pool) {
+		if (pool == nullptr) {
+			delete p;
+		} else {
+			pool->release(p);
+		}
+	}
+
+	// Standalone node with one empty extent, for use outside hashed_btree.
+	static btree_page* create() {
+		btree_page* bpage = new btree_page;
+		bpage->tag_ = enum_btree_page;
+		bpage->height_ = 0;
+		bpage->child_size_[0] = 0;
+		bpage->link_[0] = new extent;
+		return bpage;
+	}
+
+	// Frees everything below this node.
+	void release(btree_pool* pool = nullptr) {
 		for (int i = 0; i < size_ + 1; ++i) {
-			delete link_[i];
+			if (height_ == 0) {
+				deallocate(link_[i], pool);
+			} else {
+				child_[i]->release(pool);
+				deallocate(child_[i], pool);
+			}
 		}
 	}
 
@@ -79,34 +220,49 @@ struct btree_page : public page {
 		return size_ >= kMaxKey;
 	}
 
-	void split_child(int target) {
+	void split_child(int target, btree_pool* pool) {
 		link_[target]->sort(child_size_[target]);
-		extent* npage = new extent;
+		extent* npage = allocate<extent>(pool);
 		int num_copied = link_[target]->split_half(npage, child_size_[target]);
 		child_size_[target] -= num_copied;
-
-		for (int i = size_; i > target; --i) {
-			key_[i] = std::move(key_[i - 1]);
-			link_[i + 1] = link_[i];
-			child_size_[i + 1] = child_size_[i];
-		}
-
+		open_slot(target);
 		child_size_[target + 1] = num_copied;
 		link_[target + 1] = npage;
 		key_[target] = npage->item_[0].first;
-		++size_;
 	}
 
-	bool try_insert_at_child(int i, elem_t&& elem) {
+	// Moves the upper half of the full node child_[target] to a new node
+	// next to it, and its middle key up to this one.
+	void split_node(int target, btree_pool* pool) {
+		btree_page* left = child_[target];
+		btree_page* right = allocate<btree_page>(pool);
+		right->tag_ = enum_btree_page;
+		right->height_ = left->height_;
+		int mid = left->size_ / 2;
+		right->size_ = left->size_ - mid - 1;
+		for (int i = 0; i < right->size_ + 1; ++i) {
+			right->child_[i] = left->child_[mid + 1 + i];
+			right->child_size_[i] = left->child_size_[mid + 1 + i];
+			if (i < right->size_) {
+				right->key_[i] = left->key_[mid + 1 + i];
+			}
+		}
+		left->size_ = mid;
+		open_slot(target);
+		child_[target + 1] = right;
+		key_[target] = left->key_[mid];
+	}
+
+	bool try_insert_at_child(int i, elem_t&& elem, btree_pool* pool) {
 		if (is_child_full(i)) {
 			if (is_full_key()) {
 				return false;
 			} else {
-				split_child(i);
+				split_child(i, pool);
 				if (elem.first < key_[i]) {
-					return try_insert_at_child(i, std::forward<elem_t>(elem));
+					return try_insert_at_child(i, std::forward<elem_t>(elem), pool);
 				} else {
-					return try_insert_at_child(i + 1, std::forward<elem_t>(elem));
+					return try_insert_at_child(i + 1, std::forward<elem_t>(elem), pool);
 				}
 			}
 		} else {
@@ -116,33 +272,224 @@ struct btree_page : public page {
 		}
 	}
 
-	bool insert(elem_t&& elem) {
+	// Always succeeds; a full tree gets one level deeper.
+	bool insert(elem_t&& elem, btree_pool* pool = nullptr) {
+		if (!insert_below(elem, pool)) {
+			btree_page* lower = allocate<btree_page>(pool);
+			*lower = *this;
+			size_ = 0;
+			++height_;
+			child_[0] = lower;
+			split_node(0, pool);
+			insert_below(elem, pool);
+		}
+		return true;
+	}
+
+	// Index of the child whose range holds |k| if any does.
+	int child_of(const key_t& k) const {
 		int i = 0;
 		for (; i < size_; ++i) {
-			if (elem.first < key_[i]) {
+			if (k < key_[i]) {
 				break;
 			}
 		}
-		return try_insert_at_child(i, std::forward<elem_t>(elem));
+		return i;
 	}
 
+	// A run of equal keys can span children. The separators inside the run
+	// are the key itself, with copies on both sides, so a search that
+	// misses moves left while the separator still matches.
 	elem_t* find(const key_t& k) {
-		int i = 0;
-		for (; i < size_; ++i) {
-			if (k < key_[i]) {
-				break;
+		for (int i = child_of(k); ; --i) {
+			elem_t* e = height_ > 0 ? child_[i]->find(k) : link_[i]->find(k, child_size_[i]);
+			if (e != nullptr || i == 0 || key_[i - 1] != k) {
+				return e;
 			}
 		}
-		return link_[i]->find(k, child_size_[i]);
 	}
 
-	size_t size() {
+	// Removes |k|. Under-full neighbours merge on the way back up, and a
+	// root left with a single child takes its contents.
+	bool erase(const key_t& k, btree_pool* pool = nullptr) {
+		if (!erase_below(k, pool)) {
+			return false;
+		}
+		while (height_ > 0 && size_ == 0) {
+			btree_page* only = child_[0];
+			*this = *only;
+			deallocate(only, pool);
+		}
+		return true;
+	}
+
+	// Removes any one element.
+	bool pop(elem_t* out) {
+		for (int i = 0; i < size_ + 1; ++i) {
+			if (height_ > 0) {
+				if (child_[i]->pop(out)) {
+					return true;
+				}
+			} else if (child_size_[i] > 0) {
+				--child_size_[i];
+				*out = link_[i]->item_[child_size_[i]];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	size_t size() const {
 		size_t ret = 0;
-		for (int i = 0; i < size_; ++i) {
-			ret += child_size_[i];
+		for (int i = 0; i < size_ + 1; ++i) {
+			ret += height_ == 0 ? child_size_[i] : child_[i]->size();
 		}
 		return ret;
 	}
+
+	// Nodes of the tree, this one included.
+	size_t num_nodes() const {
+		size_t ret = 1;
+		for (int i = 0; height_ > 0 && i < size_ + 1; ++i) {
+			ret += child_[i]->num_nodes();
+		}
+		return ret;
+	}
+
+	// Calls |f(extent, size)| for every extent in key order.
+	template <typename F>
+	void for_each_extent(F f) const {
+		visit_extents(0, std::numeric_limits<key_t>::max(), f);
+	}
+
+	// Calls |f(extent, size)| in key order for the extents whose range
+	// overlaps |lo| to |last| inclusive.
+	template <typename F>
+	void for_each_extent(const key_t& lo, const key_t& last, F f) const {
+		visit_extents(lo, last, f);
+	}
+
+private:
+	template <typename F>
+	void visit_extents(const key_t& lo, const key_t& last, F& f) const {
+		int i = 0;
+		while (i < size_ && key_[i] < lo) {
+			++i;
+		}
+		for (; i < size_ + 1; ++i) {
+			if (i > 0 && key_[i - 1] > last) {
+				break;
+			}
+			if (height_ == 0) {
+				f(link_[i], static_cast<int>(child_size_[i]));
+			} else {
+				child_[i]->visit_extents(lo, last, f);
+			}
+		}
+	}
+
+	// Moves left across a split run of |k| like find().
+	bool erase_below(const key_t& k, btree_pool* pool) {
+		int i = child_of(k);
+		while (!erase_at_child(i, k, pool)) {
+			if (i == 0 || key_[i - 1] != k) {
+				return false;
+			}
+			--i;
+		}
+		if (size_ > 0) {
+			merge_children(i < size_ ? i : i - 1, pool);
+		}
+		return true;
+	}
+
+	bool erase_at_child(int i, const key_t& k, btree_pool* pool) {
+		if (height_ > 0) {
+			return child_[i]->erase_below(k, pool);
+		}
+		elem_t* e = link_[i]->find(k, child_size_[i]);
+		if (e == nullptr) {
+			return false;
+		}
+		--child_size_[i];
+		*e = link_[i]->item_[child_size_[i]];
+		return true;
+	}
+
+	// Merges child |target| + 1 into child |target| if they fit together.
+	void merge_children(int target, btree_pool* pool) {
+		if (height_ == 0) {
+			int left = child_size_[target];
+			int right = child_size_[target + 1];
+			if (left + right > kMergeItems) {
+				return;
+			}
+			for (int j = 0; j < right; ++j) {
+				link_[target]->item_[left + j] = link_[target + 1]->item_[j];
+			}
+			child_size_[target] = left + right;
+			deallocate(link_[target + 1], pool);
+		} else {
+			btree_page* left = child_[target];
+			btree_page* right = child_[target + 1];
+			if (left->size_ + right->size_ + 1 > kMergeKeys) {
+				return;
+			}
+			// The separator between them comes down.
+			left->key_[left->size_] = key_[target];
+			for (int j = 0; j < right->size_ + 1; ++j) {
+				int to = left->size_ + 1 + j;
+				left->child_[to] = right->child_[j];
+				left->child_size_[to] = right->child_size_[j];
+				if (j < right->size_) {
+					left->key_[to] = right->key_[j];
+				}
+			}
+			left->size_ += right->size_ + 1;
+			deallocate(right, pool);
+		}
+		close_slot(target);
+	}
+
+	// Drops the key at |target| and the child at |target| + 1.
+	void close_slot(int target) {
+		for (int i = target; i < size_ - 1; ++i) {
+			key_[i] = std::move(key_[i + 1]);
+			link_[i + 1] = link_[i + 2];
+			child_size_[i + 1] = child_size_[i + 2];
+		}
+		--size_;
+	}
+
+	// Makes room for a key at |target| and a child at |target| + 1.
+	void open_slot(int target) {
+		for (int i = size_; i > target; --i) {
+			key_[i] = std::move(key_[i - 1]);
+			link_[i + 1] = link_[i];
+			child_size_[i + 1] = child_size_[i];
+		}
+		++size_;
+	}
+
+	// Inserts unless this node is full on the path of |elem|.
+	bool insert_below(elem_t& elem, btree_pool* pool) {
+		int i = child_of(elem.first);
+		if (height_ == 0) {
+			return try_insert_at_child(i, std::move(elem), pool);
+		}
+		if (child_[i]->insert_below(elem, pool)) {
+			return true;
+		}
+		if (is_full_key()) {
+			return false;
+		}
+		// Both halves have a free key now, so the retry cannot fail.
+		split_node(i, pool);
+		if (!(elem.first < key_[i])) {
+			++i;
+		}
+		return child_[i]->insert_below(elem, pool);
+	}
 };
 
 struct hash_page : public page {
@@ -173,6 +520,16 @@ struct hash_page : public page {
 		return nullptr;
 	}
 
+	bool erase(const key_t& k) {
+		elem_t* e = find(k);
+		if (e == nullptr) {
+			return false;
+		}
+		--size_;
+		*e = item_[size_];
+		return true;
+	}
+
 	size_t size() {
 		return size_;
 	}
@@ -182,6 +539,8 @@ inline btree_page* page::get_btree() { return static_cast<btree_page*>(this); }
 inline hash_page* page::get_hash() { return static_cast<hash_page*>(this); }
 
 class hashed_btree {
+	friend class diagnostics;
+
 public:
 	typedef uint64_t key_t;
 	typedef uint64_t value_t;
@@ -205,8 +564,8 @@ public:
 		page::elem_t* e_;
 	};
 	
-	static btree_page* hash_page_to_btree_page(hash_page* p) {
-		btree_page::extent* npage = new btree_page::extent;
+	static btree_page* hash_page_to_btree_page(hash_page* p, btree_pool* pool = nullptr) {
+		btree_page::extent* npage = btree_page::allocate<btree_page::extent>(pool);
 		int old_size = p->size_;
 		for (int i = 0; i < old_size; ++i) {
 			npage->insert_at(i, std::move(p->item_[i]));
@@ -216,6 +575,7 @@ public:
 
 		bpage->tag_ = page::enum_btree_page;
 		bpage->size_ = 0;
+		bpage->height_ = 0;
 		bpage->child_size_[0] = old_size;
 		for (int i = 1; i < btree_page::kMaxKey + 1; ++i) {
 			bpage->child_size_[i] = 0;
@@ -224,77 +584,145 @@ public:
 		return bpage;
 	}
 
+	// |bpage| holds at most hash_page::kMaxItem elements.
+	static hash_page* btree_page_to_hash_page(btree_page* bpage, btree_pool* pool = nullptr) {
+		page::elem_t items[hash_page::kMaxItem];
+		int n = 0;
+		while (bpage->pop(&items[n])) {
+			++n;
+		}
+		bpage->release(pool);
+		// Value-initialized, so the page comes back zeroed.
+		hash_page* hpage = new (bpage) hash_page();
+		for (int j = 0; j < n; ++j) {
+			hpage->insert(std::move(items[j]));
+		}
+		return hpage;
+	}
+
 	static const int kDefaultCapacity = 1;
 
+	// kOrdered picks the page from the high bits of the key instead of its
+	// hash, so page i holds a contiguous key range below that of page i + 1
+	// and lower_bound() and scan() can walk keys in order. Keys have to
+	// spread over their high bits for the pages to fill evenly.
+	enum placement {
+		kHashed,
+		kOrdered,
+	};
+
 	hashed_btree() {
-		init(kDefaultCapacity);
+		init(kDefaultCapacity, kHashed);
+	}
+
+	explicit hashed_btree(placement p) {
+		init(kDefaultCapacity, p);
 	}
 
+	// Nodes and extents go with pool_.
 	~hashed_btree() {
-		for (uint32_t i = 0; i < capacity_; ++i) {
-			if (get_page(i)->tag_ == page::enum_btree_page) {
-				get_page(i)->get_btree()->release();
-			}
-		}
 		free(page_);
 	}
 
 	size_t size() const { return size_; }
 
 	void insert(page::elem_t&& e) {
-		if (size_ * 1000 >= capacity_ * hash_page::kMaxItem * load_factor_) {
+		if (static_cast<uint64_t>(size_) * 1000 >= capacity_ * hash_page::kMaxItem * load_factor_) {
 			resize();
 		}
-		int fail_count = 0;
-		const int kMaxInsertFail = 5;
-		while (fail_count < kMaxInsertFail) {
-			page* p = get_page_by_hash(e.first);
-			if (p->tag_ == page::enum_hash_page) {
-				hash_page* hpage = p->get_hash();
-				if (hpage->insert(std::forward<page::elem_t>(e))) {
-					++size_;
-					return;
-				}
-				hash_page_to_btree_page(hpage);
-			}
-
-			btree_page* bpage = p->get_btree();
-			if (bpage->insert(std::forward<page::elem_t>(e))) {
+		page* p = get_page_by_hash(e.first);
+		if (p->tag_ == page::enum_hash_page) {
+			hash_page* hpage = p->get_hash();
+			if (hpage->insert(std::forward<page::elem_t>(e))) {
 				++size_;
 				return;
 			}
+			hash_page_to_btree_page(hpage, &pool_);
+		}
+		// A crowded page deepens its own tree, the table grows by load only.
+		p->get_btree()->insert(std::forward<page::elem_t>(e), &pool_);
+		++size_;
+	}
 
-			resize();
-			++fail_count;
+	// Returns true if the key was new, false if its value was replaced.
+	bool insert_or_assign(page::elem_t&& e) {
+		iterator iter = find(e.first);
+		if (iter != end()) {
+			iter->second = e.second;
+			return false;
 		}
+		insert(std::forward<page::elem_t>(e));
+		return true;
+	}
+
+	// A btree page goes back to a hash page once its elements fit in one.
+	bool erase(const key_t& k) {
+		page* p = get_page_by_hash(k);
+		if (p->tag_ == page::enum_hash_page) {
+			if (!p->get_hash()->erase(k)) {
+				return false;
+			}
+		} else {
+			btree_page* bpage = p->get_btree();
+			if (!bpage->erase(k, &pool_)) {
+				return false;
+			}
+			if (bpage->height_ == 0 && bpage->size() <= hash_page::kMaxItem) {
+				btree_page_to_hash_page(bpage, &pool_);
+			}
+		}
+		--size_;
+		return true;
 	}
 
 	void resize() {
-		double mega_capacity = static_cast<double>(size()) / num_page() / hash_page::kMaxItem;
-		std::cout << "resizing : " << mega_capacity << " " << size() << std::endl;
+		rehash(capacity_ * 2);
+	}
+
+	// Halves the page array for as long as the elements would fill less
+	// than half of what the smaller table grows at, then compacts.
+	void shrink_to_fit() {
+		while (capacity_ > kDefaultCapacity && static_cast<uint64_t>(size_) * 2000 < capacity_ / 2 * hash_page::kMaxItem * load_factor_) {
+			uint32_t before = capacity_;
+			rehash(capacity_ / 2);
+			if (capacity_ >= before) {
+				break;
+			}
+		}
+		compact();
+	}
+
+	// Turns btree pages whose elements fit in a hash page back into hash
+	// pages and frees their extents.
+	void compact() {
+		for (uint32_t i = 0; i < capacity_; ++i) {
+			page* p = get_page(i);
+			if (p->tag_ == page::enum_btree_page && p->get_btree()->size() <= hash_page::kMaxItem) {
+				btree_page_to_hash_page(p->get_btree(), &pool_);
+			}
+		}
+	}
 
-		// TODO: implement inplace resizing.
-		hashed_btree new_target(capacity_ * 2);
+	memory_usage_t memory_usage() const {
+		memory_usage_t usage;
+		usage.page_array = CACHELINE_SIZE * capacity_;
+		usage.extents = pool_.bytes();
+		usage.slack = pool_.free_bytes();
 		for (uint32_t i = 0; i < capacity_; ++i) {
 			page* p = get_page(i);
 			if (p->tag_ == page::enum_hash_page) {
-				hash_page* hpage = p->get_hash();
-				for (int i = 0; i < hpage->size_; ++i) {
-					new_target.insert(std::move(hpage->item_[i]));
-				}
-			} else {
-				btree_page* bpage = p->get_btree();
-				for (int i = 0; i < bpage->size_ + 1; ++i) {
-					btree_page::extent* e = bpage->link_[i];
-					for (int j = 0; j < bpage->child_size_[i]; ++j) {
-						new_target.insert(std::move(e->item_[j]));
-					}
-				}
+				usage.slack += sizeof(page::elem_t) * (hash_page::kMaxItem - p->size_);
+				continue;
 			}
+			// Btree nodes hold keys and links, no elements.
+			btree_page* bpage = p->get_btree();
+			usage.slack += sizeof(page::elem_t) * hash_page::kMaxItem * bpage->num_nodes();
+			bpage->for_each_extent([&usage](btree_page::extent*, int size) {
+				usage.slack += sizeof(page::elem_t) * (btree_page::extent::kMaxItem - size);
+			});
 		}
-		std::swap(capacity_, new_target.capacity_);
-		std::swap(size_, new_target.size_);
-		std::swap(page_, new_target.page_);
+		usage.metadata = sizeof(*this);
+		return usage;
 	}
 
 	iterator find(const key_t& k) const {
@@ -313,14 +741,129 @@ public:
 
 	iterator end() const { return iterator(reinterpret_cast<page::elem_t*>(get_page(capacity_))); }
 
+	// The page find() starts from.
+	page* find_page(const key_t& k) const {
+		return get_page_by_hash(k);
+	}
+
 	size_t num_page() const { return capacity_; }
 
+	// Looks up |n| keys in groups of kFindBatch. Each pass over a group
+	// takes every key one step: the pages of the group are prefetched
+	// first, then each btree page read and the extent or node it leads to
+	// prefetched, and so on, so the dependent misses of different keys
+	// overlap. Missing keys yield nullptr. A key that passed a separator
+	// equal to it may sit in a run split to the left, and a miss on it is
+	// retried with btree_page::find().
+	void find_batch(const key_t* keys, size_t n, page::elem_t** out) const {
+		page* at[kFindBatch];
+		btree_page* root[kFindBatch];
+		int child[kFindBatch];
+		bool split_run[kFindBatch];
+		for (size_t base = 0; base < n; base += kFindBatch) {
+			int count = static_cast<int>(std::min<size_t>(kFindBatch, n - base));
+			for (int i = 0; i < count; ++i) {
+				at[i] = get_page_by_hash(keys[base + i]);
+				root[i] = nullptr;
+				child[i] = -1;
+				split_run[i] = false;
+				prefetch(at[i]);
+			}
+			for (int pending = count; pending > 0; ) {
+				pending = 0;
+				for (int i = 0; i < count; ++i) {
+					if (at[i] == nullptr) {
+						continue;
+					}
+					const key_t& k = keys[base + i];
+					if (at[i]->tag_ == page::enum_hash_page) {
+						out[base + i] = at[i]->get_hash()->find(k);
+						at[i] = nullptr;
+						continue;
+					}
+					btree_page* node = at[i]->get_btree();
+					if (child[i] >= 0) {
+						page::elem_t* e = node->link_[child[i]]->find(k, node->child_size_[child[i]]);
+						out[base + i] = e != nullptr || !split_run[i] ? e : root[i]->find(k);
+						at[i] = nullptr;
+						continue;
+					}
+					if (root[i] == nullptr) {
+						root[i] = node;
+					}
+					int c = node->child_of(k);
+					split_run[i] = split_run[i] || (c > 0 && node->key_[c - 1] == k);
+					if (node->height_ > 0) {
+						at[i] = node->child_[c];
+						prefetch(at[i]);
+					} else {
+						child[i] = c;
+						prefetch(node->link_[c]);
+					}
+					++pending;
+				}
+			}
+		}
+	}
+
+	// Ordered mode only: the element with the smallest key not below |k|.
+	iterator lower_bound(const key_t& k) const {
+		page::elem_t* found = nullptr;
+		auto first = [&found](page::elem_t& e) {
+			if (found == nullptr) {
+				found = &e;
+			}
+		};
+		for (uint32_t i = page_index(k); i < capacity_ && found == nullptr; ++i) {
+			scan_page(i, k, std::numeric_limits<key_t>::max(), first);
+		}
+		return found == nullptr ? end() : iterator(found);
+	}
+
+	// Ordered mode only: calls |f| with every element whose key is at least
+	// |lo| and below |hi|, in key order.
+	template <typename F>
+	void scan(const key_t& lo, const key_t& hi, F f) const {
+		if (lo >= hi) {
+			return;
+		}
+		uint32_t last = page_index(hi - 1);
+		for (uint32_t i = page_index(lo); i <= last; ++i) {
+			scan_page(i, lo, hi - 1, f);
+		}
+	}
+
 private:
-	hashed_btree(uint32_t new_capacity) {
-		init(new_capacity);
+	hashed_btree(uint32_t new_capacity, placement p) {
+		init(new_capacity, p);
+	}
+
+	// TODO: implement inplace resizing.
+	void rehash(uint32_t new_capacity) {
+		hashed_btree new_target(new_capacity, placement_);
+		for (uint32_t i = 0; i < capacity_; ++i) {
+			page* p = get_page(i);
+			if (p->tag_ == page::enum_hash_page) {
+				hash_page* hpage = p->get_hash();
+				for (int i = 0; i < hpage->size_; ++i) {
+					new_target.insert(std::move(hpage->item_[i]));
+				}
+			} else {
+				p->get_btree()->for_each_extent([&new_target](btree_page::extent* e, int size) {
+					for (int j = 0; j < size; ++j) {
+						new_target.insert(std::move(e->item_[j]));
+					}
+				});
+			}
+		}
+		std::swap(capacity_, new_target.capacity_);
+		std::swap(size_, new_target.size_);
+		std::swap(page_, new_target.page_);
+		pool_.swap(new_target.pool_);
 	}
 
-	void init(uint32_t capacity) {
+	void init(uint32_t capacity, placement p) {
+		placement_ = p;
 		capacity_ = capacity;
 		size_ = 0;
 		size_t alloc_size = sizeof(hash_page) * capacity_;
@@ -329,19 +872,75 @@ private:
 	}
 
 	page* get_page_by_hash(const key_t& k) const {
-		int h = hash_func_(k) % capacity_;
-		return get_page(h);
+		return get_page(page_index(k));
+	}
+
+	uint32_t page_index(const key_t& k) const {
+		if (placement_ == kOrdered) {
+			// k * capacity_ / 2^64, which keeps the order of the keys.
+			return static_cast<uint32_t>((static_cast<unsigned __int128>(k) * capacity_) >> 64);
+		}
+		return hash_func_(k) % capacity_;
+	}
+
+	// Calls |f| with the elements of page |i| from |lo| to |last| inclusive,
+	// in key order.
+	template <typename F>
+	void scan_page(uint32_t i, const key_t& lo, const key_t& last, F& f) const {
+		page* p = get_page(i);
+		page::elem_t* items[btree_page::extent::kMaxItem];
+		if (p->tag_ == page::enum_hash_page) {
+			hash_page* hpage = p->get_hash();
+			int n = 0;
+			for (int j = 0; j < hpage->size_; ++j) {
+				if (hpage->item_[j].first >= lo && hpage->item_[j].first <= last) {
+					items[n++] = &hpage->item_[j];
+				}
+			}
+			call_sorted(items, n, f);
+			return;
+		}
+		// Extents are ordered by the separators, their items are not.
+		p->get_btree()->for_each_extent(lo, last, [&](btree_page::extent* e, int size) {
+			int n = 0;
+			for (int j = 0; j < size; ++j) {
+				if (e->item_[j].first >= lo && e->item_[j].first <= last) {
+					items[n++] = &e->item_[j];
+				}
+			}
+			call_sorted(items, n, f);
+		});
+	}
+
+	template <typename F>
+	static void call_sorted(page::elem_t** items, int n, F& f) {
+		std::sort(items, items + n, [](const page::elem_t* a, const page::elem_t* b) {
+			return a->first < b->first;
+		});
+		for (int j = 0; j < n; ++j) {
+			f(*items[j]);
+		}
 	}
 
 	page* get_page(int index) const {
 		return reinterpret_cast<page*>(reinterpret_cast<uintptr_t>(page_) + index * CACHELINE_SIZE);
 	}
 
+	static void prefetch(const void* line) {
+		const char* p = static_cast<const char*>(line);
+		_mm_prefetch(p, _MM_HINT_T0);
+		_mm_prefetch(p + 64, _MM_HINT_T0);
+	}
+
+	static const int kFindBatch = 16;
+
 	uint32_t capacity_;
 	uint32_t size_; 
 	static const uint64_t load_factor_ = 900;
+	placement placement_;
 	std::hash<key_t> hash_func_;
 	page* page_;
+	btree_pool pool_;
 	// TODO: implement linear array and realloc-able extent.
 	//extent* btree_;
 };
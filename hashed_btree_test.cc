@@ -1,5 +1,11 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <random>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <cstdlib>
 
 #include "gtest/gtest.h"
@@ -53,7 +59,11 @@ TEST(btree_page, extensive_sequential_insert) {
 	for (int i = 1; i < kMaxNumInsert; ++i) {
 		ASSERT_TRUE(p->insert(std::make_pair(i + 1, i + 1000))) << i;
 	}
-	ASSERT_FALSE(p->insert(std::make_pair(5000, 5001)));
+	EXPECT_EQ(0, p->height_);
+	// No separator is left for another extent, so the tree gets a level.
+	ASSERT_TRUE(p->insert(std::make_pair(5000, 5001)));
+	EXPECT_EQ(1, p->height_);
+	ASSERT_NE(nullptr, p->find(5000));
 
 	ASSERT_NE(nullptr, p->find(1));
 	for (int i = 1; i < kMaxNumInsert; ++i) {
@@ -95,6 +105,180 @@ TEST(btree_page, extensive_random_insert) {
 	}
 }
 
+TEST(btree_page, erase_and_pop) {
+	btree_page* p = btree_page::create();
+	for (int i = 1; i <= 30; ++i) {
+		ASSERT_TRUE(p->insert(std::make_pair(i, i + 1000))) << i;
+	}
+	EXPECT_EQ(30u, p->size());
+
+	for (int i = 1; i <= 30; i += 3) {
+		EXPECT_TRUE(p->erase(i)) << i;
+	}
+	EXPECT_FALSE(p->erase(1));
+	EXPECT_EQ(20u, p->size());
+	for (int i = 1; i <= 30; ++i) {
+		EXPECT_EQ(i % 3 != 1, p->find(i) != nullptr) << i;
+	}
+
+	page::elem_t e;
+	int sum = 0;
+	while (p->pop(&e)) {
+		EXPECT_EQ(e.first + 1000, e.second);
+		sum += e.first;
+	}
+	EXPECT_EQ(0u, p->size());
+	EXPECT_EQ(30 * 31 / 2 - 145, sum);
+	p->release();
+	delete p;
+}
+
+TEST(btree_page, deep) {
+	const uint64_t kKeys = 20000;
+	for (int shuffled = 0; shuffled < 2; ++shuffled) {
+		std::vector<uint64_t> keys;
+		for (uint64_t i = 1; i <= kKeys; ++i) {
+			keys.push_back(i * 3);
+		}
+		if (shuffled) {
+			std::shuffle(keys.begin(), keys.end(), std::default_random_engine());
+		}
+		btree_pool pool;
+		btree_page* p = hashed_btree::hash_page_to_btree_page(new hash_page, &pool);
+		for (uint64_t k : keys) {
+			ASSERT_TRUE(p->insert(std::make_pair(k, k + 1), &pool)) << k;
+		}
+		EXPECT_LE(2, p->height_);
+		EXPECT_LT(1u, p->num_nodes());
+		EXPECT_EQ(kKeys, p->size());
+		for (uint64_t i = 1; i <= kKeys; ++i) {
+			page::elem_t* e = p->find(i * 3);
+			ASSERT_NE(nullptr, e) << i;
+			EXPECT_EQ(i * 3 + 1, e->second);
+			EXPECT_EQ(nullptr, p->find(i * 3 + 1)) << i;
+		}
+
+		// Extents come in key order.
+		std::vector<uint64_t> all;
+		p->for_each_extent([&all](btree_page::extent* e, int size) {
+			std::vector<uint64_t> items;
+			for (int j = 0; j < size; ++j) {
+				items.push_back(e->item_[j].first);
+			}
+			std::sort(items.begin(), items.end());
+			all.insert(all.end(), items.begin(), items.end());
+		});
+		ASSERT_EQ(kKeys, all.size());
+		EXPECT_TRUE(std::is_sorted(all.begin(), all.end()));
+
+		size_t in_range = 0;
+		p->for_each_extent(3000, 5999, [&in_range](btree_page::extent* e, int size) {
+			for (int j = 0; j < size; ++j) {
+				in_range += e->item_[j].first >= 3000 && e->item_[j].first <= 5999;
+			}
+		});
+		EXPECT_EQ(1000u, in_range);
+
+		for (uint64_t i = 1; i <= kKeys; i += 2) {
+			EXPECT_TRUE(p->erase(i * 3, &pool)) << i;
+		}
+		EXPECT_EQ(kKeys / 2, p->size());
+		page::elem_t e;
+		size_t popped = 0;
+		while (p->pop(&e)) {
+			EXPECT_EQ(0u, e.first % 6);
+			++popped;
+		}
+		EXPECT_EQ(kKeys / 2, popped);
+		p->release(&pool);
+		delete p;
+	}
+}
+
+// A run of one key split over many extents, as insert_duplicate() in
+// mhashmap's overflow trees leaves it. The separators between the extents
+// of the run are the key itself, and copies sit left of them too.
+TEST(btree_page, erase_split_run) {
+	const uint64_t kKeys = 2000;
+	const uint64_t kRun = 1000;
+	// Every 20th insert adds another copy of kRun.
+	const int kCopies = kKeys / 20;
+	btree_pool pool;
+	btree_page* p = hashed_btree::hash_page_to_btree_page(new hash_page, &pool);
+	for (uint64_t k = 1; k <= kKeys; ++k) {
+		p->insert(std::make_pair(k, k), &pool);
+		if (k % 20 == 0) {
+			p->insert(std::make_pair(kRun, k), &pool);
+		}
+	}
+	ASSERT_EQ(kKeys + kCopies, p->size());
+	ASSERT_LE(1, p->height_);
+
+	for (int c = 0; c <= kCopies; ++c) {
+		ASSERT_NE(nullptr, p->find(kRun)) << c;
+		ASSERT_TRUE(p->erase(kRun, &pool)) << c;
+	}
+	EXPECT_EQ(nullptr, p->find(kRun));
+	EXPECT_FALSE(p->erase(kRun, &pool));
+	EXPECT_EQ(kKeys - 1, p->size());
+	for (uint64_t k = 1; k <= kKeys; ++k) {
+		if (k != kRun) {
+			ASSERT_NE(nullptr, p->find(k)) << k;
+		}
+	}
+	p->release(&pool);
+	delete p;
+}
+
+TEST(btree_page, erase_merges) {
+	const uint64_t kKeys = 20000;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		keys.push_back(i);
+	}
+	std::shuffle(keys.begin(), keys.end(), std::default_random_engine());
+	btree_pool pool;
+	btree_page* p = hashed_btree::hash_page_to_btree_page(new hash_page, &pool);
+	for (uint64_t k : keys) {
+		p->insert(std::make_pair(k, k), &pool);
+	}
+	size_t nodes = p->num_nodes();
+	int height = p->height_;
+
+	std::shuffle(keys.begin(), keys.end(), std::default_random_engine(7));
+	for (uint64_t k : keys) {
+		if (k % 100 != 0) {
+			ASSERT_TRUE(p->erase(k, &pool)) << k;
+		}
+	}
+	EXPECT_FALSE(p->erase(1, &pool));
+	EXPECT_EQ(kKeys / 100, p->size());
+	EXPECT_GT(nodes, p->num_nodes());
+	EXPECT_GT(height, p->height_);
+	int num_extents = 0;
+	p->for_each_extent([&num_extents](btree_page::extent*, int size) {
+		EXPECT_LT(0, size);
+		++num_extents;
+	});
+	EXPECT_GE(kKeys / 100 / 2, num_extents);
+	for (uint64_t i = 100; i <= kKeys; i += 100) {
+		page::elem_t* e = p->find(i);
+		ASSERT_NE(nullptr, e) << i;
+		EXPECT_EQ(i, e->second);
+	}
+
+	// Only the root extent is left in use.
+	for (uint64_t i = 100; i <= kKeys; i += 100) {
+		ASSERT_TRUE(p->erase(i, &pool)) << i;
+	}
+	EXPECT_EQ(0u, p->size());
+	EXPECT_EQ(0, p->height_);
+	EXPECT_EQ(0, p->size_);
+	EXPECT_EQ(pool.bytes() - sizeof(btree_page::extent), pool.free_bytes());
+	p->release(&pool);
+	delete p;
+}
+
 TEST(hash_page, conversion) {
 	hash_page* hpage = new hash_page;
 	for (int i = 1; i <= hash_page::kMaxItem; ++i) {
@@ -126,6 +310,208 @@ TEST(hashed_btree, resize) {
 	}
 }
 
+TEST(hashed_btree, memory_usage) {
+	hashed_btree m;
+	for (uint64_t i = 1; i < 1000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	memory_usage_t usage = m.memory_usage();
+	EXPECT_EQ(m.num_page() * CACHELINE_SIZE, usage.page_array);
+	EXPECT_EQ(0u, usage.extents);
+	EXPECT_EQ((m.num_page() * hash_page::kMaxItem - m.size()) * sizeof(page::elem_t), usage.slack);
+
+	// Keys a multiple of the page count apart share a page.
+	uint64_t pages = m.num_page();
+	for (uint64_t i = 1; i <= 20; ++i) {
+		m.insert(std::make_pair(i * pages * 1000, i));
+	}
+	usage = m.memory_usage();
+	EXPECT_LT(0u, usage.extents);
+	EXPECT_EQ(0u, usage.extents % sizeof(btree_page::extent));
+	EXPECT_LT(usage.slack, usage.page_array + usage.extents);
+	EXPECT_EQ(usage.page_array + usage.extents + usage.metadata, usage.total());
+}
+
+// Keys a multiple of 2^32 apart share page 0 at any power of two page
+// count, so growing the table cannot spread them.
+TEST(hashed_btree, colliding_keys) {
+	const uint64_t kKeys = 100000;
+	hashed_btree m;
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		m.insert(std::make_pair(i << 32, i));
+	}
+	EXPECT_EQ(kKeys, m.size());
+	page* p = m.find_page(0);
+	ASSERT_EQ(page::enum_btree_page, p->tag_);
+	EXPECT_LE(2, p->get_btree()->height_);
+	EXPECT_EQ(kKeys, p->get_btree()->size());
+	// The table grows by load alone.
+	EXPECT_GT(kKeys / 4, m.num_page());
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		hashed_btree::iterator iter = m.find(i << 32);
+		ASSERT_NE(m.end(), iter) << i;
+		EXPECT_EQ(i, iter->second);
+		EXPECT_EQ(m.end(), m.find((i << 32) | 1)) << i;
+	}
+	memory_usage_t usage = m.memory_usage();
+	EXPECT_LT(kKeys * sizeof(page::elem_t), usage.extents);
+}
+
+TEST(hashed_btree, find_batch) {
+	hashed_btree m;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		m.insert(std::make_pair(i * 7, i));
+		keys.push_back(i * 7);
+		keys.push_back(i * 7 + 1);
+	}
+	// Keys sharing page 0 take a step per tree level.
+	for (uint64_t j = 1; j <= 3000; ++j) {
+		m.insert(std::make_pair((j << 32) * 7, j));
+		keys.push_back((j << 32) * 7);
+		keys.push_back((j << 32) * 7 + 1);
+	}
+	ASSERT_LE(2, m.find_page(0)->get_btree()->height_);
+	std::shuffle(keys.begin(), keys.end(), std::default_random_engine());
+
+	std::vector<page::elem_t*> found(keys.size(), nullptr);
+	m.find_batch(&keys[0], keys.size(), &found[0]);
+	for (size_t i = 0; i < keys.size(); ++i) {
+		hashed_btree::iterator iter = m.find(keys[i]);
+		if (iter == m.end()) {
+			EXPECT_EQ(nullptr, found[i]) << keys[i];
+		} else {
+			EXPECT_EQ(&*iter, found[i]) << keys[i];
+		}
+	}
+
+	// Copies of one key in page 0 make a run that splits over extents;
+	// find_batch() has to reach the copies left of a separator equal to
+	// the key while they are erased.
+	const uint64_t kRun = (1000ULL << 32) * 7;
+	const int kCopies = 100;
+	for (int c = 0; c < kCopies; ++c) {
+		m.insert(std::make_pair(kRun, c));
+	}
+	for (int c = 0; c <= kCopies; ++c) {
+		page::elem_t* e = nullptr;
+		m.find_batch(&kRun, 1, &e);
+		ASSERT_NE(m.end(), m.find(kRun)) << c;
+		ASSERT_EQ(&*m.find(kRun), e) << c;
+		ASSERT_TRUE(m.erase(kRun)) << c;
+	}
+	EXPECT_EQ(m.end(), m.find(kRun));
+}
+
+TEST(hashed_btree, erase_and_assign) {
+	hashed_btree m;
+	std::unordered_map<uint64_t, uint64_t> expected;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, 20000);
+	for (int round = 0; round < 200000; ++round) {
+		// Every fourth key goes to page 0.
+		uint64_t k = dist(eng);
+		if (k % 4 == 0) {
+			k <<= 32;
+		}
+		if (round % 3 == 0) {
+			EXPECT_EQ(expected.erase(k) == 1, m.erase(k)) << k;
+		} else {
+			bool inserted = expected.find(k) == expected.end();
+			expected[k] = round;
+			EXPECT_EQ(inserted, m.insert_or_assign(std::make_pair(k, static_cast<uint64_t>(round)))) << k;
+		}
+	}
+	ASSERT_EQ(expected.size(), m.size());
+	EXPECT_EQ(page::enum_btree_page, m.find_page(0)->tag_);
+	for (const auto& e : expected) {
+		hashed_btree::iterator iter = m.find(e.first);
+		ASSERT_NE(m.end(), iter) << e.first;
+		EXPECT_EQ(e.second, iter->second);
+	}
+
+	// Drained pages are hash pages again, with every extent back in the pool.
+	for (const auto& e : expected) {
+		ASSERT_TRUE(m.erase(e.first));
+	}
+	EXPECT_EQ(0u, m.size());
+	EXPECT_EQ(page::enum_hash_page, m.find_page(0)->tag_);
+	memory_usage_t usage = m.memory_usage();
+	EXPECT_EQ(m.num_page() * hash_page::kMaxItem * sizeof(page::elem_t) + usage.extents, usage.slack);
+}
+
+TEST(hashed_btree, shrink_to_fit) {
+	hashed_btree m;
+	for (uint64_t i = 1; i < 2000; ++i) {
+		m.insert(std::make_pair(i, 1000ULL + i));
+	}
+	size_t pages = m.num_page();
+	for (int i = 0; i < 4; ++i) {
+		m.resize();
+	}
+	ASSERT_EQ(pages * 16, m.num_page());
+	size_t grown = m.memory_usage().total();
+
+	m.shrink_to_fit();
+	EXPECT_GE(pages * 2, m.num_page());
+	EXPECT_GT(grown, m.memory_usage().total());
+	EXPECT_EQ(1999u, m.size());
+	for (uint64_t i = 1; i < 2000; ++i) {
+		hashed_btree::iterator iter = m.find(i);
+		ASSERT_NE(m.end(), iter) << i;
+		EXPECT_EQ(1000ULL + i, iter->second);
+	}
+}
+
+TEST(hashed_btree, ordered) {
+	hashed_btree m(hashed_btree::kOrdered);
+	std::map<uint64_t, uint64_t> expected;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	for (int i = 0; i < 20000; ++i) {
+		uint64_t k = dist(eng);
+		m.insert(std::make_pair(k, static_cast<uint64_t>(i)));
+		expected.insert(std::make_pair(k, static_cast<uint64_t>(i)));
+	}
+	ASSERT_EQ(expected.size(), m.size());
+
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t k = dist(eng);
+		std::map<uint64_t, uint64_t>::iterator want = expected.lower_bound(k);
+		hashed_btree::iterator got = m.lower_bound(k);
+		if (want == expected.end()) {
+			EXPECT_EQ(m.end(), got) << k;
+		} else {
+			ASSERT_NE(m.end(), got) << k;
+			EXPECT_EQ(want->first, got->first);
+		}
+		// Stored keys are their own lower bound.
+		EXPECT_EQ(want->first, m.lower_bound(want->first)->first);
+	}
+
+	std::vector<uint64_t> all;
+	m.scan(0, std::numeric_limits<uint64_t>::max(), [&](const page::elem_t& e) {
+		all.push_back(e.first);
+	});
+	std::vector<uint64_t> sorted;
+	for (const auto& e : expected) {
+		sorted.push_back(e.first);
+	}
+	// scan() stops below its upper bound.
+	if (sorted.back() == std::numeric_limits<uint64_t>::max()) {
+		sorted.pop_back();
+	}
+	EXPECT_EQ(sorted, all);
+
+	uint64_t lo = sorted[100];
+	uint64_t hi = sorted[200];
+	std::vector<uint64_t> range;
+	m.scan(lo, hi, [&](const page::elem_t& e) {
+		range.push_back(e.first);
+	});
+	EXPECT_EQ(std::vector<uint64_t>(sorted.begin() + 100, sorted.begin() + 200), range);
+}
+
 TEST(hashed_btree, MegaInsert) {
 	hashed_btree m;
 
@@ -158,7 +544,131 @@ TEST(hashed_btree, MegaInsertBench) {
 	EXPECT_EQ(kInsertIteration - 1, m.size());
 	double mega_capacity = static_cast<double>(m.size()) / m.num_page() / hash_page::kMaxItem;
 	std::cout << "Capacity based on hash : " << mega_capacity << std::endl;
-	std::cout << "Memory usage : " << m.num_page() * CACHELINE_SIZE / 1024 / 1024 << " MB" << std::endl;
+	memory_usage_t usage = m.memory_usage();
+	std::cout << "Memory usage : " << usage.total() / 1024 / 1024 << " MB, pages " << usage.page_array / 1024 / 1024
+		<< " MB, extents " << usage.extents / 1024 / 1024 << " MB, slack " << usage.slack / 1024 / 1024 << " MB" << std::endl;
+}
+
+// Replaces random keys at a steady size, so pages keep crossing between
+// hash and btree pages.
+TEST(hashed_btree, ChurnBench) {
+	const uint64_t kKeys = 4000000;
+	const uint64_t kRounds = 20000000;
+	hashed_btree m;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kKeys; ++i) {
+		keys.push_back(dist(eng));
+		m.insert_or_assign(std::make_pair(keys[i], i));
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (uint64_t round = 0; round < kRounds; ++round) {
+		uint64_t& k = keys[round % kKeys];
+		m.erase(k);
+		k = dist(eng);
+		m.insert_or_assign(std::make_pair(k, round));
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Churn : " << kRounds / elapsed.count() / 1e6 << " M erase+insert/s" << std::endl;
+	EXPECT_EQ(kKeys, m.size());
+	memory_usage_t usage = m.memory_usage();
+	std::cout << "Memory usage : " << usage.total() / 1024 / 1024 << " MB, pages " << usage.page_array / 1024 / 1024
+		<< " MB, extents " << usage.extents / 1024 / 1024 << " MB, slack " << usage.slack / 1024 / 1024 << " MB" << std::endl;
+}
+
+// Random hits on a table of about 1 GB, with most pages full enough to be
+// btree pages.
+TEST(hashed_btree, FindBatchBench) {
+	const uint64_t kKeys = 24000000;
+	const uint64_t kLookups = 10000000;
+	hashed_btree m;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kKeys; ++i) {
+		keys.push_back(dist(eng));
+		m.insert(std::make_pair(keys[i], i));
+	}
+	std::uniform_int_distribution<size_t> pick(0, kKeys - 1);
+	std::vector<uint64_t> lookups;
+	for (uint64_t i = 0; i < kLookups; ++i) {
+		lookups.push_back(keys[pick(eng)]);
+	}
+	size_t num_btree = 0;
+	for (size_t i = 0; i < m.num_page(); ++i) {
+		num_btree += m.find_page(i)->tag_ == page::enum_btree_page;
+	}
+	memory_usage_t usage = m.memory_usage();
+	std::cout << "Table : " << usage.total() / 1024 / 1024 << " MB, btree pages " << num_btree * 100.0 / m.num_page()
+		<< " %" << std::endl;
+
+	uint64_t sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < lookups.size(); ++i) {
+		sum += m.find(lookups[i])->second;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "find() : " << kLookups / elapsed.count() / 1e6 << " M lookups/s" << std::endl;
+
+	std::vector<page::elem_t*> found(lookups.size());
+	uint64_t batch_sum = 0;
+	start = std::chrono::steady_clock::now();
+	m.find_batch(&lookups[0], lookups.size(), &found[0]);
+	for (size_t i = 0; i < found.size(); ++i) {
+		batch_sum += found[i]->second;
+	}
+	elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "find_batch() : " << kLookups / elapsed.count() / 1e6 << " M lookups/s" << std::endl;
+	EXPECT_EQ(sum, batch_sum);
+}
+
+// The same random keys in both placements. A scan covers about 100 keys.
+void placement_bench(hashed_btree::placement p) {
+	const uint64_t kKeys = 4000000;
+	const int kScans = 100000;
+	hashed_btree m(p);
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kKeys; ++i) {
+		keys.push_back(dist(eng));
+		m.insert(std::make_pair(keys.back(), i));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < kKeys; ++i) {
+		sum += m.find(keys[i])->second;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Point lookups : " << kKeys / elapsed.count() / 1e6 << " M/s" << std::endl;
+	if (p != hashed_btree::kOrdered) {
+		return;
+	}
+
+	const uint64_t kSpan = std::numeric_limits<uint64_t>::max() / kKeys * 100;
+	size_t scanned = 0;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < kScans; ++i) {
+		uint64_t lo = dist(eng) % (std::numeric_limits<uint64_t>::max() - kSpan);
+		m.scan(lo, lo + kSpan, [&](const page::elem_t& e) {
+			sum += e.second;
+			++scanned;
+		});
+	}
+	elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Range scans : " << kScans / elapsed.count() / 1e6 << " M/s, "
+		<< scanned / elapsed.count() / 1e6 << " M elements/s" << std::endl;
+	EXPECT_NE(0u, sum);
+}
+
+TEST(hashed_btree, HashedPlacementBench) {
+	placement_bench(hashed_btree::kHashed);
+}
+
+TEST(hashed_btree, OrderedPlacementBench) {
+	placement_bench(hashed_btree::kOrdered);
 }
 
 int main(int argc, char **argv) {
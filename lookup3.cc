@@ -43,7 +43,7 @@ on 1 byte), but shoehorning those bytes into integers efficiently is messy.
 */
 #include <stdint.h>     /* defines uint32_t etc */
 //#include <sys/param.h>  /* attempt to define endianness */
-#ifdef linux
+#if defined(linux) || defined(__linux__)
 # include <endian.h>    /* attempt to define endianness */
 #endif
 #include <cstddef>
@@ -376,3 +376,198 @@ void hashlittle2(
   final(a,b,c);
   *pc=c; *pb=b;
 }
+
+/*
+ * Batch kernels: hashlittle2 over many keys of the same length at once, one
+ * key per vector lane. Every key takes the same path through the blocks, so
+ * mix() and final() above run unchanged on GCC vector types. Words are read
+ * with memcpy, which matches the little-endian reads of hashlittle2.
+ */
+#include <cstring>
+
+#include "lookup3.h"
+
+#if defined(__GNUC__) && !defined(__clang__)
+// The helpers below are always inlined, so no vector crosses a call.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+namespace {
+
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+typedef uint32_t v16u __attribute__((vector_size(64)));
+
+inline __attribute__((always_inline)) uint32_t word_at(const uint8_t *k) {
+	uint32_t x;
+	memcpy(&x, k, 4);
+	return x;
+}
+
+// The word at |k| in the key of each lane, |s| bytes apart.
+inline __attribute__((always_inline)) v4u lane_words(const v4u *, const uint8_t *k, size_t s) {
+	v4u w = { word_at(k), word_at(k + s), word_at(k + 2 * s), word_at(k + 3 * s) };
+	return w;
+}
+
+inline __attribute__((always_inline)) v8u lane_words(const v8u *, const uint8_t *k, size_t s) {
+	v8u w = {
+		word_at(k), word_at(k + s), word_at(k + 2 * s), word_at(k + 3 * s),
+		word_at(k + 4 * s), word_at(k + 5 * s), word_at(k + 6 * s), word_at(k + 7 * s)
+	};
+	return w;
+}
+
+inline __attribute__((always_inline)) v16u lane_words(const v16u *, const uint8_t *k, size_t s) {
+	v16u w = {
+		word_at(k), word_at(k + s), word_at(k + 2 * s), word_at(k + 3 * s),
+		word_at(k + 4 * s), word_at(k + 5 * s), word_at(k + 6 * s), word_at(k + 7 * s),
+		word_at(k + 8 * s), word_at(k + 9 * s), word_at(k + 10 * s), word_at(k + 11 * s),
+		word_at(k + 12 * s), word_at(k + 13 * s), word_at(k + 14 * s), word_at(k + 15 * s)
+	};
+	return w;
+}
+
+// The words with only |bytes| < 4 bytes left in the key, zero filled
+// like the masked reads in hashlittle2.
+template <typename V, int W>
+inline __attribute__((always_inline)) V lane_tail_words(const uint8_t *k, size_t s, size_t bytes) {
+	V w;
+	for (int j = 0; j < W; ++j) {
+		uint32_t x = 0;
+		memcpy(&x, k + j * s, bytes);
+		w[j] = x;
+	}
+	return w;
+}
+
+template <typename V, int W>
+inline __attribute__((always_inline)) void hash_lanes(const uint8_t *k, size_t length, uint32_t *pc, uint32_t *pb) {
+	V a, b, c;
+	memcpy(&a, pc, sizeof(V));
+	memcpy(&b, pb, sizeof(V));
+	a += 0xdeadbeef + (uint32_t)length;
+	c = a + b;
+	b = a;
+	size_t left = length;
+	for (; left > 12; left -= 12, k += 12) {
+		a += lane_words(&a, k, length);
+		b += lane_words(&b, k + 4, length);
+		c += lane_words(&c, k + 8, length);
+		mix(a,b,c);
+	}
+	if (left > 0) {
+		a += left >= 4 ? lane_words(&a, k, length) : lane_tail_words<V, W>(k, length, left);
+		if (left > 4) {
+			b += left >= 8 ? lane_words(&b, k + 4, length) : lane_tail_words<V, W>(k + 4, length, left - 4);
+		}
+		if (left > 8) {
+			c += left == 12 ? lane_words(&c, k + 8, length) : lane_tail_words<V, W>(k + 8, length, left - 8);
+		}
+		final(a,b,c);
+	}
+	memcpy(pc, &c, sizeof(V));
+	memcpy(pb, &b, sizeof(V));
+}
+
+template <typename V, int W>
+inline __attribute__((always_inline)) void hash_batch(const uint8_t *k, size_t length, size_t n, uint32_t *pc, uint32_t *pb) {
+	size_t i = 0;
+	for (; i + W <= n; i += W) {
+		hash_lanes<V, W>(k + i * length, length, pc + i, pb + i);
+	}
+	for (; i < n; ++i) {
+		hashlittle2(k + i * length, length, pc + i, pb + i);
+	}
+}
+
+void hash_batch_scalar(const uint8_t *k, size_t length, size_t n, uint32_t *pc, uint32_t *pb) {
+	for (size_t i = 0; i < n; ++i) {
+		hashlittle2(k + i * length, length, pc + i, pb + i);
+	}
+}
+
+__attribute__((target("sse4.1")))
+void hash_batch_sse41(const uint8_t *k, size_t length, size_t n, uint32_t *pc, uint32_t *pb) {
+	hash_batch<v4u, 4>(k, length, n, pc, pb);
+}
+
+__attribute__((target("avx2")))
+void hash_batch_avx2(const uint8_t *k, size_t length, size_t n, uint32_t *pc, uint32_t *pb) {
+	hash_batch<v8u, 8>(k, length, n, pc, pb);
+}
+
+__attribute__((target("avx512f")))
+void hash_batch_avx512(const uint8_t *k, size_t length, size_t n, uint32_t *pc, uint32_t *pb) {
+	hash_batch<v16u, 16>(k, length, n, pc, pb);
+}
+
+typedef void (*hash_batch_fn)(const uint8_t *, size_t, size_t, uint32_t *, uint32_t *);
+
+const hash_batch_fn kHashBatchFns[kNumHashKernels] = {
+	hash_batch_scalar, hash_batch_sse41, hash_batch_avx2, hash_batch_avx512
+};
+
+hash_kernel best_hash_kernel() {
+	hash_kernel k = kHashScalar;
+	while (k + 1 < kNumHashKernels && hash_kernel_supported(static_cast<hash_kernel>(k + 1))) {
+		k = static_cast<hash_kernel>(k + 1);
+	}
+	return k;
+}
+
+hash_kernel current_kernel = best_hash_kernel();
+
+}  // namespace
+
+bool hash_kernel_supported(hash_kernel k) {
+	if (!HASH_LITTLE_ENDIAN) {
+		return k == kHashScalar;
+	}
+	__builtin_cpu_init();
+	switch (k) {
+	case kHashScalar:
+		return true;
+	case kHashSse41:
+		return __builtin_cpu_supports("sse4.1");
+	case kHashAvx2:
+		return __builtin_cpu_supports("avx2");
+	case kHashAvx512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return false;
+	}
+}
+
+hash_kernel batch_hash_kernel() {
+	return current_kernel;
+}
+
+bool set_batch_hash_kernel(hash_kernel k) {
+	if (!hash_kernel_supported(k)) {
+		return false;
+	}
+	current_kernel = k;
+	return true;
+}
+
+void hashlittle2_batch(const void *keys, size_t length, size_t n, uint32_t *pc, uint32_t *pb) {
+	kHashBatchFns[current_kernel](static_cast<const uint8_t *>(keys), length, n, pc, pb);
+}
+
+void hash_buckets(const void *keys, size_t length, size_t n, uint32_t seed, uint32_t mask, uint32_t *buckets) {
+	const size_t kChunk = 256;
+	uint32_t pb[kChunk];
+	const uint8_t *k = static_cast<const uint8_t *>(keys);
+	for (size_t i = 0; i < n; i += kChunk) {
+		size_t m = n - i < kChunk ? n - i : kChunk;
+		for (size_t j = 0; j < m; ++j) {
+			buckets[i + j] = seed;
+			pb[j] = 0;
+		}
+		hashlittle2_batch(k + i * length, length, m, buckets + i, pb);
+		for (size_t j = 0; j < m; ++j) {
+			buckets[i + j] &= mask;
+		}
+	}
+}
@@ -6,4 +6,25 @@
 
 void hashlittle2(const void *key, std::size_t length, uint32_t *pc, uint32_t   *pb);
 
+// Batch hashlittle2 kernels, widest first. Each hashes as many keys at once
+// as it has 32-bit vector lanes.
+enum hash_kernel { kHashScalar, kHashSse41, kHashAvx2, kHashAvx512, kNumHashKernels };
+
+bool hash_kernel_supported(hash_kernel k);
+
+// The kernel hashlittle2_batch() uses, by default the widest the CPU has.
+hash_kernel batch_hash_kernel();
+
+// Returns false, keeping the current kernel, if the CPU lacks |k|.
+bool set_batch_hash_kernel(hash_kernel k);
+
+// Same as hashlittle2() on each of |n| keys of |length| bytes stored back to
+// back: pc[i] and pb[i] are the seeds and then the hashes of key i.
+void hashlittle2_batch(const void *keys, std::size_t length, std::size_t n, uint32_t *pc, uint32_t *pb);
+
+// Bucket of each key, the primary hash seeded with |seed| and masked.
+// A 64-bit key is hashed as its 8 little-endian bytes.
+void hash_buckets(const void *keys, std::size_t length, std::size_t n, uint32_t seed, uint32_t mask,
+	uint32_t *buckets);
+
 #endif  // LOOKUP3_H_
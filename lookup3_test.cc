@@ -0,0 +1,118 @@
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "lookup3.h"
+
+const char* const kKernelNames[kNumHashKernels] = { "scalar", "sse4.1", "avx2", "avx512" };
+
+TEST(lookup3, BatchMatchesScalar) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint32_t> dist;
+	const size_t kKeys = 37;
+	hash_kernel best = batch_hash_kernel();
+	for (int k = 0; k < kNumHashKernels; ++k) {
+		if (!set_batch_hash_kernel(static_cast<hash_kernel>(k))) {
+			std::cout << kKernelNames[k] << " not supported" << std::endl;
+			continue;
+		}
+		for (size_t length = 0; length <= 40; ++length) {
+			// One spare byte so the keys do not all start aligned.
+			std::vector<uint8_t> bytes(kKeys * length + 1);
+			for (size_t i = 0; i < bytes.size(); ++i) {
+				bytes[i] = dist(eng);
+			}
+			std::vector<uint32_t> pc(kKeys), pb(kKeys);
+			for (size_t i = 0; i < kKeys; ++i) {
+				pc[i] = dist(eng);
+				pb[i] = dist(eng);
+			}
+			std::vector<uint32_t> expected_c = pc, expected_b = pb;
+			for (size_t i = 0; i < kKeys; ++i) {
+				hashlittle2(&bytes[1 + i * length], length, &expected_c[i], &expected_b[i]);
+			}
+			hashlittle2_batch(&bytes[1], length, kKeys, &pc[0], &pb[0]);
+			EXPECT_EQ(expected_c, pc) << kKernelNames[k] << " length " << length;
+			EXPECT_EQ(expected_b, pb) << kKernelNames[k] << " length " << length;
+		}
+	}
+	set_batch_hash_kernel(best);
+}
+
+TEST(lookup3, Buckets) {
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < 1000; ++i) {
+		keys.push_back(i * 0x9e3779b97f4a7c15ULL);
+	}
+	std::vector<uint32_t> buckets(keys.size());
+	hash_buckets(&keys[0], sizeof(uint64_t), keys.size(), 7, 1023, &buckets[0]);
+	for (size_t i = 0; i < keys.size(); ++i) {
+		uint32_t pc = 7;
+		uint32_t pb = 0;
+		hashlittle2(&keys[i], sizeof(uint64_t), &pc, &pb);
+		EXPECT_EQ(pc & 1023, buckets[i]) << i;
+	}
+}
+
+void batch_bench(size_t length) {
+	const size_t kKeys = 1 << 16;
+	const int kRounds = 100;
+	std::vector<uint8_t> bytes(kKeys * length);
+	for (size_t i = 0; i < bytes.size(); ++i) {
+		bytes[i] = i * 131;
+	}
+	std::vector<uint32_t> pc(kKeys), pb(kKeys);
+	uint32_t sum = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int round = 0; round < kRounds; ++round) {
+		for (size_t i = 0; i < kKeys; ++i) {
+			pc[i] = pb[i] = round;
+			hashlittle2(&bytes[i * length], length, &pc[i], &pb[i]);
+		}
+		sum += pc[round];
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Length " << length << ", hashlittle2 : "
+		<< kKeys * kRounds / elapsed.count() / 1e6 << " M hashes/s" << std::endl;
+
+	hash_kernel best = batch_hash_kernel();
+	for (int k = 0; k < kNumHashKernels; ++k) {
+		if (!set_batch_hash_kernel(static_cast<hash_kernel>(k))) {
+			continue;
+		}
+		start = std::chrono::steady_clock::now();
+		for (int round = 0; round < kRounds; ++round) {
+			for (size_t i = 0; i < kKeys; ++i) {
+				pc[i] = pb[i] = round;
+			}
+			hashlittle2_batch(&bytes[0], length, kKeys, &pc[0], &pb[0]);
+			sum += pc[round];
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "Length " << length << ", " << kKernelNames[k] << " : "
+			<< kKeys * kRounds / elapsed.count() / 1e6 << " M hashes/s" << std::endl;
+	}
+	set_batch_hash_kernel(best);
+	EXPECT_NE(0u, sum);
+}
+
+TEST(lookup3, BatchHash64Bench) {
+	batch_bench(sizeof(uint64_t));
+}
+
+TEST(lookup3, BatchHash16Bench) {
+	batch_bench(16);
+}
+
+TEST(lookup3, BatchHash40Bench) {
+	batch_bench(40);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -9,15 +9,30 @@
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
+#include <vector>
 
+#include "cuckoo_path.h"
+#include "hashed_btree.h"
 #include "lookup3.h"
 
-#include <smmintrin.h>
+#include <emmintrin.h>
 
 #define HASHPAGE_SIZE 128
 
+// _mm_mullo_epi32 needs SSE4.1. The vector extension multiply builds for
+// plain SSE2 and becomes pmulld wherever SSE4.1 is enabled.
+inline __m128i mullo_epi32(__m128i a, __m128i b) {
+	typedef uint32_t lanes_t __attribute__((vector_size(16)));
+	return (__m128i)((lanes_t)a * (lanes_t)b);
+}
+
 struct hash_function {
 	typedef uint64_t key_t;
 	size_t operator() (const key_t& k, int level) {
@@ -87,11 +102,22 @@ struct doublebitmap_t {
 struct mhashpage {
 	static const int kMaxLevel = 3;
 	static const int kMaxElements = 8;
+	// The flag of an entry holds its level in the low bits and, in TTL mode,
+	// the coarse stamp of its last write above them. kUnplaced is set while
+	// mhashmap::rebuild() still has to move the entry.
+	static const uint8_t kLevelMask = 0x03;
+	static const int kStampShift = 2;
+	static const uint8_t kStampMask = 0x1f;
+	static const uint8_t kUnplaced = 0x80;
+	// The flag past the last entry marks a page that owns an overflow tree.
+	static const int kTreeFlag = kMaxElements - 1;
 	typedef uint64_t key_t;
 	typedef uint64_t value_t;
 	typedef std::pair<key_t, value_t> entry_t;
 	struct context {
-		uint16_t num_elements;
+		uint8_t num_elements;
+		// Per-slot reference bits of mhashmap's cache mode.
+		bitmap_t referenced;
 		uint16_t foreign_placed[kMaxLevel];
 		uint8_t flags[kMaxElements];
 	} cxt;
@@ -106,65 +132,350 @@ struct mhashpage {
 		return cxt.num_elements == num_max_entries;
 	}
 
+	bool has_tree() const {
+		return cxt.flags[kTreeFlag] != 0;
+	}
+
+	int level(int index) const {
+		return cxt.flags[index] & kLevelMask;
+	}
+
+	uint8_t stamp(int index) const {
+		return (cxt.flags[index] >> kStampShift) & kStampMask;
+	}
+
+	bool unplaced(int index) const {
+		return (cxt.flags[index] & kUnplaced) != 0;
+	}
+
+	static uint8_t make_flag(int level, uint8_t stamp) {
+		return static_cast<uint8_t>(level | (stamp << kStampShift));
+	}
+
 	bool empty() const {
 		return cxt.num_elements == 0;
 	}
 
 	entry_t* find(const key_t& k) {
+		int index = find_index(k);
+		return index < 0 ? nullptr : &entries[index];
+	}
+
+	int find_index(const key_t& k) const {
 		for (int i = 0; i < cxt.num_elements; ++i) {
 			if (entries[i].first == k) {
-				return &entries[i];
+				return i;
 			}
 		}
-		return nullptr;
+		return -1;
 	}
 
-	bool try_evict_foreign(entry_t& evicted, int& evicted_level, int minimum_evict_level) {
-		int target = -1;
-		for (int i = 0; i < cxt.num_elements; ++i) {
-			if (cxt.flags[i] > minimum_evict_level) {
-				minimum_evict_level = cxt.flags[i];
-				target = i;
-			}
-		}
-		if (target != -1) {
-			std::swap(entries[target], evicted);
-			cxt.flags[target] = evicted_level;
-			evicted_level = minimum_evict_level;
-			return true;
-		}
-		return false;
+	void place(int index, const entry_t& element, int level, uint8_t stamp = 0) {
+		entries[index] = element;
+		cxt.flags[index] = make_flag(level, stamp);
+		cxt.referenced.clear(index);
 	}
 
-	bool insert(const entry_t& element, int level) {
+	bool insert(const entry_t& element, int level, uint8_t stamp = 0) {
 		if (full()) {
 			return false;
 		}
-		entries[cxt.num_elements] = element;
-		cxt.flags[cxt.num_elements] = level;
+		place(cxt.num_elements, element, level, stamp);
 		++cxt.num_elements;
 		return true;
 	}
 
 	void erase(int index) {
 		--cxt.num_elements;
+		bool referenced = cxt.referenced.test(cxt.num_elements);
+		cxt.referenced.clear(cxt.num_elements);
 		if (cxt.num_elements == 0 || index == cxt.num_elements) {
 			return;
 		}
 		entries[index] = entries[cxt.num_elements];
 		cxt.flags[index] =cxt.flags[cxt.num_elements];
+		cxt.referenced.assign(index, referenced);
+	}
+
+	// Concurrent readers of a cache race on the reference bits, so a bit is
+	// set atomically and only when it is still clear.
+	void touch(int index) {
+		uint8_t bit = static_cast<uint8_t>(1) << index;
+		if ((__atomic_load_n(&cxt.referenced.bm, __ATOMIC_RELAXED) & bit) == 0) {
+			__atomic_fetch_or(&cxt.referenced.bm, bit, __ATOMIC_RELAXED);
+		}
+	}
+};
+
+// The page array of an mhashmap once a snapshot has been taken of it. The
+// map keeps writing it until it reallocates or frees it; from then on the
+// snapshots still reading it own it, and the last one to go frees it.
+struct mhashpage_block {
+	explicit mhashpage_block(mhashpage* p) : pages(p), owned(false) {}
+
+	~mhashpage_block() {
+		if (owned) {
+			free(pages);
+		}
+	}
+
+	mhashpage* pages;
+	bool owned;
+};
+
+// Copy of a run of pages taken just before the map first wrote one of them,
+// shared by every snapshot that still had to see the old contents.
+struct mhashpage_chunk {
+	mhashpage_chunk(int num_refs, const mhashpage* src, int32_t num_pages) : refs(num_refs) {
+		pages = reinterpret_cast<mhashpage*>(malloc(sizeof(mhashpage) * num_pages));
+		std::memcpy(static_cast<void*>(pages), src, sizeof(mhashpage) * num_pages);
+	}
+
+	~mhashpage_chunk() {
+		free(pages);
+	}
+
+	std::atomic<int> refs;
+	mhashpage* pages;
+};
+
+// Read-only view of an mhashmap as of mhashmap::snapshot(). The view reads
+// the map's own page array; before the map writes a chunk of kChunkPages
+// pages for the first time after the snapshot, it copies the chunk for the
+// view. Lookups may run in other threads while the map is updated.
+//
+// Old versions are reclaimed by reference counts, not epochs. A reader only
+// reaches the shared array and the copies through a snapshot it holds, and
+// both stay allocated while any snapshot refers to them: the map frees an
+// array only when no snapshot shares it, hands it over otherwise, and never
+// frees a copy. So read_page() cannot race with a free, and readers need no
+// epoch announcements or quiescent points.
+class mhashmap_snapshot {
+public:
+	typedef uint64_t key_t;
+	typedef uint64_t value_t;
+	// Updates land on random pages, so a chunk larger than a page copies
+	// far more for the same writes.
+	static const int kChunkShift = 0;
+	static const int32_t kChunkPages = 1 << kChunkShift;
+
+	~mhashmap_snapshot() {
+		for (int32_t c = 0; c < num_chunks_; ++c) {
+			mhashpage_chunk* chunk = chunk_[c].load(std::memory_order_acquire);
+			if (chunk != nullptr && chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete chunk;
+			}
+		}
+	}
+
+	size_t size() const { return size_; }
+
+	// Bytes of page copies this view holds, some of them shared with other
+	// views.
+	size_t copied_bytes() const {
+		size_t num_chunks = 0;
+		for (int32_t c = 0; c < num_chunks_; ++c) {
+			if (chunk_[c].load(std::memory_order_relaxed) != nullptr) {
+				++num_chunks;
+			}
+		}
+		return num_chunks * kChunkPages * sizeof(mhashpage);
+	}
+
+	bool find(const key_t& k, value_t* v) const {
+		uint32_t h[mhashpage::kMaxLevel + 1];
+		compute_hash(k, h);
+		mhashpage buffer;
+		for (int i = 0; i <= mhashpage::kMaxLevel; ++i) {
+			const mhashpage& page = read_page(h[i], &buffer);
+			int index = page.find_index(k);
+			if (index >= 0) {
+				if (expired(page.stamp(index))) {
+					return false;
+				}
+				*v = page.entries[index].second;
+				return true;
+			}
+			if (i != mhashpage::kMaxLevel && !page.overflow(i)) {
+				break;
+			}
+		}
+		if (read_page(h[0], &buffer).has_tree()) {
+			std::vector<mhashpage::entry_t>::const_iterator iter = std::lower_bound(
+				tree_entries_.begin(), tree_entries_.end(), std::make_pair(k, static_cast<value_t>(0)));
+			if (iter != tree_entries_.end() && iter->first == k) {
+				*v = iter->second;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Visits every live entry, in page order and then the overflow tree
+	// entries.
+	template <typename F>
+	void for_each(F f) const {
+		mhashpage buffer;
+		for (int32_t p = 0; p < capacity_; ++p) {
+			const mhashpage& page = read_page(p, &buffer);
+			for (int j = 0; j < page.cxt.num_elements; ++j) {
+				if (!expired(page.stamp(j))) {
+					f(page.entries[j]);
+				}
+			}
+		}
+		for (size_t i = 0; i < tree_entries_.size(); ++i) {
+			f(tree_entries_[i]);
+		}
+	}
+
+private:
+	friend class mhashmap;
+
+	explicit mhashmap_snapshot(int32_t capacity)
+		: capacity_(capacity), num_chunks_((capacity + kChunkPages - 1) >> kChunkShift),
+		  chunk_(new std::atomic<mhashpage_chunk*>[num_chunks_]) {
+		for (int32_t c = 0; c < num_chunks_; ++c) {
+			chunk_[c].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	mhashmap_snapshot(const mhashmap_snapshot&);
+	mhashmap_snapshot& operator=(const mhashmap_snapshot&);
+
+	// Without a copy the page is read from the shared array. The map
+	// publishes a copy before it writes any page of the chunk, so a read
+	// that finds no copy afterwards saw none of the writes.
+	const mhashpage& read_page(int32_t p, mhashpage* buffer) const {
+		const std::atomic<mhashpage_chunk*>& slot = chunk_[p >> kChunkShift];
+		mhashpage_chunk* chunk = slot.load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			std::memcpy(static_cast<void*>(buffer), &base_->pages[p], sizeof(mhashpage));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			chunk = slot.load(std::memory_order_acquire);
+			if (chunk == nullptr) {
+				return *buffer;
+			}
+		}
+		return chunk->pages[p & (kChunkPages - 1)];
+	}
+
+	void compute_hash(const key_t& key, uint32_t* h) const {
+		__m128i v = _mm_set1_epi32(static_cast<uint32_t>(key));
+		v = _mm_add_epi32(v, hash_add_);
+		v = mullo_epi32(v, hash_mult_);
+		v = _mm_and_si128(v, capacity_mask_);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(h), v);
+	}
+
+	bool expired(uint8_t stamp) const {
+		return ttl_ != 0 && ((epoch_ - stamp) & mhashpage::kStampMask) > static_cast<uint32_t>(ttl_);
+	}
+
+	std::shared_ptr<mhashpage_block> base_;
+	int32_t capacity_;
+	int32_t num_chunks_;
+	std::unique_ptr<std::atomic<mhashpage_chunk*>[]> chunk_;
+	// Snapshots of one map are numbered in the order they were taken.
+	uint32_t seq_;
+	size_t size_;
+	int ttl_;
+	uint32_t epoch_;
+	// Sorted copy of the overflow tree entries.
+	std::vector<mhashpage::entry_t> tree_entries_;
+	__m128i capacity_mask_;
+	__m128i hash_add_;
+	__m128i hash_mult_;
+};
+
+// Threads that stay parked between jobs, so that a table growing through
+// many rebuilds does not start threads for each one.
+class worker_pool {
+public:
+	explicit worker_pool(int num_threads) : job_(nullptr), generation_(0), pending_(0), stop_(false) {
+		for (int t = 1; t < num_threads; ++t) {
+			threads_.push_back(std::thread([this, t]() { work(t); }));
+		}
+	}
+
+	~worker_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		start_.notify_all();
+		for (size_t i = 0; i < threads_.size(); ++i) {
+			threads_[i].join();
+		}
+	}
+
+	int num_threads() const { return static_cast<int>(threads_.size()) + 1; }
+
+	// Calls |f(t)| for every t below num_threads(), t = 0 on the caller,
+	// and returns once all calls did.
+	void run(const std::function<void(int)>& f) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			job_ = &f;
+			pending_ = static_cast<int>(threads_.size());
+			++generation_;
+		}
+		start_.notify_all();
+		f(0);
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_.wait(lock, [this]() { return pending_ == 0; });
+		job_ = nullptr;
+	}
+
+private:
+	worker_pool(const worker_pool&);
+	worker_pool& operator=(const worker_pool&);
+
+	void work(int t) {
+		uint64_t seen = 0;
+		while (true) {
+			const std::function<void(int)>* job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				start_.wait(lock, [this, seen]() { return stop_ || generation_ != seen; });
+				if (stop_) {
+					return;
+				}
+				seen = generation_;
+				job = job_;
+			}
+			(*job)(t);
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (--pending_ == 0) {
+				done_.notify_one();
+			}
+		}
 	}
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable start_;
+	std::condition_variable done_;
+	const std::function<void(int)>* job_;
+	uint64_t generation_;
+	int pending_;
+	bool stop_;
 };
 
 // TODO: STL conformity.
 // 8 byte key and 8 byte value
 class mhashmap {
+	friend class durable_mhashmap;
+	friend class diagnostics;
+	template <typename, int, int> friend class cuckoo_path;
+
 public:
 	typedef uint64_t key_t;
 	typedef uint64_t value_t;
 	static const int kMaxPlacementStatus = mhashpage::kMaxLevel + 1;
 	//typedef uint32_t hash_array_t[kMaxPlacementStatus];
 	typedef __m128i hash_array_t;
+	typedef mhashpage page_t;
 	class iterator {
 	public:
 		iterator(mhashpage::entry_t* e) : e_(e) {}
@@ -184,20 +495,44 @@ public:
 		mhashpage::entry_t* e_;
 	};
 
-	mhashmap() {
-		const int kInitialCapacity = 2;
+	static const int kInitialCapacity = 2;
+
+	mhashmap() : rebuild_threads_(1), ttl_(0), epoch_(0), cache_mode_(false), clock_hand_(0),
+		  snapshot_seq_(0), track_dirty_(false) {
 		init(kInitialCapacity);
 	}
 
-	mhashmap(int32_t capacity) {
+	mhashmap(int32_t capacity) : rebuild_threads_(1), ttl_(0), epoch_(0), cache_mode_(false), clock_hand_(0),
+		  snapshot_seq_(0), track_dirty_(false) {
 		init(capacity);
 	}
 
 	~mhashmap() {
-		free(page_);
+		release_trees(nullptr);
+		release_pages();
 	}
 
-#define GET(k, x) ((reinterpret_cast<uint32_t*>(&k))[x])
+	// Reading the lanes through a uint32_t pointer breaks strict aliasing and
+	// gets miscompiled, so they are stored to an array first.
+	static uint32_t hash_at(const hash_array_t& h, int x) {
+		uint32_t lanes[kMaxPlacementStatus];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), h);
+		return lanes[x];
+	}
+
+#define GET(k, x) (hash_at(k, x))
+
+	// Candidate page of level l is (key + add[l]) * mult[l] on the low 32
+	// bits of the key, masked to the capacity.
+	static const uint32_t* hash_add_constants() {
+		static const uint32_t add[kMaxPlacementStatus] = {1923775UL, 47472UL, 575757172UL, 39192381UL};
+		return add;
+	}
+
+	static const uint32_t* hash_mult_constants() {
+		static const uint32_t mult[kMaxPlacementStatus] = {512775UL, 47471093UL, 6761UL, 83192381UL};
+		return mult;
+	}
 
 	size_t overflow_rate(int level) const {
 		size_t num_overflow = 0;
@@ -224,6 +559,100 @@ public:
 	size_t capacity() const { return capacity_ * mhashpage::num_max_entries; }
 	size_t size() const { return num_entries_; }
 
+	// Overflow trees count as extents. Pages copied for snapshots belong to
+	// the snapshots and are not counted.
+	memory_usage_t memory_usage() const {
+		memory_usage_t usage;
+		usage.page_array = sizeof(mhashpage) * capacity_;
+		usage.extents = 0;
+		usage.slack = 0;
+		for (int32_t i = 0; i < capacity_; ++i) {
+			usage.slack += sizeof(mhashpage::entry_t) * (mhashpage::num_max_entries - page_[i].cxt.num_elements);
+		}
+		for (size_t p = 0; p < tree_.size(); ++p) {
+			const btree_page* tree = tree_[p];
+			if (tree == nullptr) {
+				continue;
+			}
+			usage.extents += sizeof(btree_page) * tree->num_nodes();
+			tree->for_each_extent([&usage](btree_page::extent*, int size) {
+				usage.extents += sizeof(btree_page::extent);
+				usage.slack += sizeof(page::elem_t) * (btree_page::extent::kMaxItem - size);
+			});
+		}
+		usage.metadata = sizeof(*this) + sizeof(btree_page*) * tree_.capacity() +
+			sizeof(std::weak_ptr<mhashmap_snapshot>) * snapshots_.capacity() +
+			sizeof(uint32_t) * chunk_seq_.capacity() + sizeof(uint64_t) * dirty_pages_.capacity();
+		return usage;
+	}
+
+	// Halves the page array, dropping one mask bit, for as long as the
+	// entries would fill less than shrink_load_factor_ of the smaller table.
+	// Cache mode keeps its size. Returns the number of pages released.
+	int32_t shrink_to_fit() {
+		int32_t old_capacity = capacity_;
+		while (!cache_mode_ && capacity_ > kInitialCapacity &&
+			num_entries_ * 1000LL < static_cast<int64_t>(capacity_ / 2) * mhashpage::num_max_entries * shrink_load_factor_) {
+			int32_t before = capacity_;
+			halve();
+			// An insert that still found no room grew the table again.
+			if (capacity_ >= before) {
+				break;
+			}
+		}
+		return old_capacity - capacity_;
+	}
+
+	// Visits every entry in page order, followed by the overflow tree of the
+	// page if it has one.
+	template <typename F>
+	void for_each(F f) {
+		for (int32_t i = 0; i < capacity_; ++i) {
+			for (int j = 0; j < page_[i].cxt.num_elements; ++j) {
+				f(page_[i].entries[j]);
+			}
+			if (page_[i].has_tree()) {
+				tree_[i]->for_each_extent([&f](btree_page::extent* e, int size) {
+					for (int j = 0; j < size; ++j) {
+						f(e->item_[j]);
+					}
+				});
+			}
+		}
+	}
+
+	// Exchanges the page arrays, so whole tables move without touching a page.
+	void swap(mhashmap& other) {
+		std::swap(page_, other.page_);
+		std::swap(num_entries_, other.num_entries_);
+		std::swap(capacity_, other.capacity_);
+		std::swap(num_overflow_page_, other.num_overflow_page_);
+		std::swap(capacity_mask_, other.capacity_mask_);
+		std::swap(cuckoo_paths_, other.cuckoo_paths_);
+		std::swap(cuckoo_failures_, other.cuckoo_failures_);
+		tree_.swap(other.tree_);
+		std::swap(ttl_, other.ttl_);
+		std::swap(epoch_, other.epoch_);
+		std::swap(sweep_cursor_, other.sweep_cursor_);
+		std::swap(cache_mode_, other.cache_mode_);
+		std::swap(on_evict_, other.on_evict_);
+		std::swap(clock_hand_, other.clock_hand_);
+		block_.swap(other.block_);
+		snapshots_.swap(other.snapshots_);
+		chunk_seq_.swap(other.chunk_seq_);
+		std::swap(snapshot_seq_, other.snapshot_seq_);
+		std::swap(track_dirty_, other.track_dirty_);
+		dirty_pages_.swap(other.dirty_pages_);
+	}
+
+	void clear() {
+		release_trees(nullptr);
+		release_pages();
+		init(kInitialCapacity);
+	}
+
+	size_t num_trees() const { return num_overflow_page_; }
+
 	void debug_find(int idx) {
 		for (int i = 0; i < capacity_; ++i) {
 			for (int j = 0; j < mhashpage::num_max_entries; ++j) {
@@ -235,10 +664,7 @@ public:
 	}
 
 	void set_capacity_mask() {
-		uint32_t mask = capacity_ - 1;
-		float* f_mask = reinterpret_cast<float*>(&mask);
-		__m128 m = _mm_set_ps1(*f_mask);
-		capacity_mask_ = *reinterpret_cast<__m128i*>(&m);
+		capacity_mask_ = _mm_set1_epi32(capacity_ - 1);
 	}
 
 	int load_factor() const {
@@ -256,31 +682,88 @@ public:
 		}
 	}
 
-	bool rebuild_cuckoo(int i, int j) {
+	// Keeps an entry in place after the capacity mask changed only if the page
+	// is still its first candidate. Other entries are marked unplaced and are
+	// moved by rebuild_cuckoo() once every staying entry has been accounted
+	// for, which also gives foreign entries a chance to move back home.
+	void rebuild_level(int i, int j) {
 		hash_array_t key_hash;
 		compute_hash(page_[i].entries[j].first, key_hash);
 
-		for (int l = 0; l < kMaxPlacementStatus; ++l) {
-			if (GET(key_hash, l) == i) {
-				for (int j = 0; j < l; ++j) {
-					++page_[GET(key_hash, j)].cxt.foreign_placed[j];
-				}
-				return true;
-			}
+		uint8_t stamp = page_[i].stamp(j);
+		if (GET(key_hash, 0) == static_cast<uint32_t>(i)) {
+			page_[i].cxt.flags[j] = mhashpage::make_flag(0, stamp);
+		} else {
+			page_[i].cxt.flags[j] = mhashpage::make_flag(0, stamp) | mhashpage::kUnplaced;
+		}
+	}
+
+	bool rebuild_cuckoo(int i, int j) {
+		if (!page_[i].unplaced(j)) {
+			return true;
 		}
 
 		mhashpage::entry_t evicted = page_[i].entries[j];
+		uint8_t stamp = page_[i].stamp(j);
 		page_[i].erase(j);
-		insert_internal(evicted, key_hash);
+		hash_array_t key_hash;
+		compute_hash(evicted.first, key_hash);
+		while (try_place_over_unplaced(evicted, stamp, key_hash)) {
+			compute_hash(evicted.first, key_hash);
+		}
+		insert_internal(evicted, key_hash, stamp);
 		return false;
 	}
 
+	// Places |element| at its lowest candidate page that either has room or
+	// holds an entry still waiting to be moved by rebuild(). In the latter
+	// case that entry is swapped out into |element| and true is returned.
+	bool try_place_over_unplaced(mhashpage::entry_t& element, uint8_t& stamp, hash_array_t key_hash) {
+		for (int l = 0; l < kMaxPlacementStatus; ++l) {
+			mhashpage& page = page_[GET(key_hash, l)];
+			if (!page.full()) {
+				return false;
+			}
+			for (int s = 0; s < page.cxt.num_elements; ++s) {
+				if (page.unplaced(s)) {
+					std::swap(page.entries[s], element);
+					uint8_t evicted_stamp = page.stamp(s);
+					page.cxt.flags[s] = mhashpage::make_flag(l, stamp);
+					stamp = evicted_stamp;
+					increase_foreign_element(l, key_hash);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
 
 	void increment_capacity() {
 		capacity_ *= 2;
 	}
 
+	// Grows with |num_threads| workers once the table has at least
+	// kMinParallelRebuildPages pages; smaller tables rebuild serially. The
+	// workers are started here and kept for every later rebuild.
+	void set_rebuild_threads(int num_threads) {
+		rebuild_threads_ = num_threads;
+		rebuild_pool_.reset(num_threads > 1 ? new worker_pool(num_threads) : nullptr);
+	}
+
 	void rebuild() {
+		// Snapshots keep the old array and the map goes on with a copy.
+		if (block_) {
+			if (block_.use_count() > 1) {
+				mhashpage* pages = reinterpret_cast<mhashpage*>(malloc(sizeof(mhashpage) * capacity_));
+				std::memcpy(static_cast<void*>(pages), page_, sizeof(mhashpage) * capacity_);
+				block_->owned = true;
+				page_ = pages;
+			}
+			drop_snapshots();
+		}
+
+		std::vector<mhashpage::entry_t> tree_entries;
+		release_trees(&tree_entries);
 		int32_t old_capacity = capacity_;
 
 		increment_capacity();
@@ -289,15 +772,33 @@ public:
 		}
 
 		page_ = reinterpret_cast<mhashpage*>(realloc(page_, sizeof(mhashpage) * capacity_));
-		std::memset(&page_[old_capacity], 0, sizeof(mhashpage) * (capacity_ - old_capacity));
 		set_capacity_mask();
-
-		for (int i = 0; i < old_capacity; ++i) {
-			for (int j = 0; j < mhashpage::kMaxLevel; ++j) {
-				page_[i].cxt.foreign_placed[j] = 0;
+		mark_all_dirty();
+
+		int num_threads = old_capacity >= kMinParallelRebuildPages ? rebuild_threads_ : 1;
+		parallel_for_ranges(num_threads, [&](int t) {
+			int32_t begin, end;
+			get_range(capacity_ - old_capacity, t, num_threads, begin, end);
+			std::memset(static_cast<void*>(&page_[old_capacity + begin]), 0, sizeof(mhashpage) * (end - begin));
+
+			get_range(old_capacity, t, num_threads, begin, end);
+			for (int32_t i = begin; i < end; ++i) {
+				for (int j = 0; j < mhashpage::kMaxLevel; ++j) {
+					page_[i].cxt.foreign_placed[j] = 0;
+				}
+				for (int j = 0; j < page_[i].cxt.num_elements; ++j) {
+					rebuild_level(i, j);
+				}
 			}
-		}
+		});
 
+		parallel_for_ranges(num_threads, [&](int t) {
+			int32_t begin, end;
+			get_range(old_capacity, t, num_threads, begin, end);
+			rebuild_local(begin, end, old_capacity);
+		});
+
+		// Cross-range moves and foreign placements run serially.
 		for (int i = 0; i < old_capacity; ++i) {
 			if (page_[i].empty()) {
 				continue;
@@ -308,6 +809,116 @@ public:
 				}
 			}
 		}
+
+		for (size_t i = 0; i < tree_entries.size(); ++i) {
+			hash_array_t key_hash;
+			compute_hash(tree_entries[i].first, key_hash);
+			insert_internal(tree_entries[i], key_hash, current_stamp());
+		}
+	}
+
+	// A candidate page below the new capacity has the same index under both
+	// masks, so the entries of the lower half stay where they are and only
+	// the upper half and the overflow trees are inserted again.
+	void halve() {
+		if (block_) {
+			if (block_.use_count() > 1) {
+				mhashpage* pages = reinterpret_cast<mhashpage*>(malloc(sizeof(mhashpage) * capacity_));
+				std::memcpy(static_cast<void*>(pages), page_, sizeof(mhashpage) * capacity_);
+				block_->owned = true;
+				page_ = pages;
+			}
+			drop_snapshots();
+		}
+
+		std::vector<mhashpage::entry_t> tree_entries;
+		release_trees(&tree_entries);
+		int32_t half = capacity_ / 2;
+		std::vector<mhashpage::entry_t> moved;
+		std::vector<uint8_t> stamps;
+		for (int32_t i = half; i < capacity_; ++i) {
+			for (int j = 0; j < page_[i].cxt.num_elements; ++j) {
+				moved.push_back(page_[i].entries[j]);
+				stamps.push_back(page_[i].stamp(j));
+			}
+		}
+
+		capacity_ = half;
+		page_ = reinterpret_cast<mhashpage*>(realloc(static_cast<void*>(page_), sizeof(mhashpage) * capacity_));
+		set_capacity_mask();
+		mark_all_dirty();
+		if (sweep_cursor_ >= capacity_) {
+			sweep_cursor_ = 0;
+		}
+
+		for (int32_t i = 0; i < capacity_; ++i) {
+			for (int l = 0; l < mhashpage::kMaxLevel; ++l) {
+				page_[i].cxt.foreign_placed[l] = 0;
+			}
+		}
+		for (int32_t i = 0; i < capacity_; ++i) {
+			for (int j = 0; j < page_[i].cxt.num_elements; ++j) {
+				if (page_[i].level(j) > 0) {
+					hash_array_t key_hash;
+					compute_hash(page_[i].entries[j].first, key_hash);
+					increase_foreign_element(page_[i].level(j), key_hash);
+				}
+			}
+		}
+
+		for (size_t i = 0; i < moved.size(); ++i) {
+			hash_array_t key_hash;
+			compute_hash(moved[i].first, key_hash);
+			insert_internal(moved[i], key_hash, stamps[i]);
+		}
+		for (size_t i = 0; i < tree_entries.size(); ++i) {
+			hash_array_t key_hash;
+			compute_hash(tree_entries[i].first, key_hash);
+			insert_internal(tree_entries[i], key_hash, current_stamp());
+		}
+	}
+
+	// Moves unplaced entries of the old pages [begin, end) to their first
+	// candidate page when that page belongs to the same range, i.e. its index
+	// modulo the old capacity falls in [begin, end). Such a move touches no
+	// page of another range and needs no foreign accounting, so ranges run in
+	// parallel.
+	void rebuild_local(int32_t begin, int32_t end, int32_t old_capacity) {
+		for (int32_t i = begin; i < end; ++i) {
+			mhashpage& page = page_[i];
+			for (int j = 0; j < page.cxt.num_elements; ) {
+				if (!page.unplaced(j)) {
+					++j;
+					continue;
+				}
+				hash_array_t key_hash;
+				compute_hash(page.entries[j].first, key_hash);
+				int32_t p = GET(key_hash, 0);
+				int32_t home = p % old_capacity;
+				if (home >= begin && home < end && page_[p].insert(page.entries[j], 0, page.stamp(j))) {
+					page.erase(j);
+				} else {
+					++j;
+				}
+			}
+		}
+	}
+
+	static void get_range(int32_t n, int t, int num_threads, int32_t& begin, int32_t& end) {
+		int32_t chunk = (n + num_threads - 1) / num_threads;
+		begin = std::min<int32_t>(n, t * chunk);
+		end = std::min<int32_t>(n, begin + chunk);
+	}
+
+	template <typename F>
+	void parallel_for_ranges(int num_threads, F f) {
+		if (num_threads > 1 && rebuild_pool_) {
+			rebuild_pool_->run(f);
+			return;
+		}
+		for (int t = 0; t < num_threads; ++t) {
+			f(t);
+		}
 	}
 
 	void rehash() {
@@ -316,12 +927,9 @@ public:
 	}
 
 	void compute_hash(const key_t& key, hash_array_t& h) {
-		uint32_t k = key;
-		float* f_k = reinterpret_cast<float*>(&k);
-		__m128 m = _mm_set_ps1(*f_k);
-		h = *reinterpret_cast<__m128i*>(&m);
+		h = _mm_set1_epi32(static_cast<uint32_t>(key));
 		h = _mm_add_epi32(h, hash_add_);
-		h = _mm_mullo_epi32(h, hash_mult_);
+		h = mullo_epi32(h, hash_mult_);
 		h = _mm_and_si128(h, capacity_mask_);
 
 		//h[0] = static_cast<uint32_t>(h1_(key, 0));
@@ -358,24 +966,33 @@ public:
 				break;
 			}
 		}
+		int32_t home = GET(key_hash, 0);
+		if (page_[home].has_tree()) {
+			return tree_[home]->find(k);
+		}
 		return nullptr;
 	}
 
 	void increase_foreign_element(int level, hash_array_t& key_hash) {
 		for (int i = 0; i < level; ++i) {
+			before_write(GET(key_hash, i));
 			++page_[GET(key_hash, i)].cxt.foreign_placed[i];
 		}
 	}
 
 	void decrease_foreign_element(int level, hash_array_t& key_hash) {
 		for (int i = 0; i < level; ++i) {
+			before_write(GET(key_hash, i));
 			--page_[GET(key_hash, i)].cxt.foreign_placed[i];
 		}
 	}
 
-	bool try_insert(const mhashpage::entry_t& element, hash_array_t key_hash) {
+	bool try_insert(const mhashpage::entry_t& element, hash_array_t key_hash, uint8_t stamp) {
 		for (int i = 0; i < kMaxPlacementStatus; ++i) {
-			if (page_[GET(key_hash, i)].insert(element, i)) {
+			int32_t p = GET(key_hash, i);
+			if (!page_[p].full()) {
+				before_write(p);
+				page_[p].insert(element, i, stamp);
 				increase_foreign_element(i, key_hash);
 				return true;
 			}
@@ -383,55 +1000,61 @@ public:
 		return false;
 	}
 
-	bool try_evict_foreign(mhashpage::entry_t& evicted, int& last_evicted_level, hash_array_t key_hash) {
-		for (int i = 0; i < kMaxPlacementStatus; ++i) {
-			if (last_evicted_level != i) {
-				int evict_level = i;
-				if (page_[GET(key_hash, i)].try_evict_foreign(evicted, evict_level, i)) {
-					last_evicted_level = evict_level;
-					return true;
-				}
-			}
-		}
-		return false;
+	static uint32_t candidate(const hash_array_t& h, int i) {
+		return hash_at(h, i);
 	}
 
-	void evict_any(mhashpage::entry_t& evicted, int& last_evicted_level, hash_array_t key_hash) {
-		int evict_level = 0;
-		bool ret = page_[GET(key_hash, 0)].try_evict_foreign(evicted, evict_level, -1);
-#ifdef _DEBUG
-		assert(ret == true);
-#endif
-		last_evicted_level = evict_level;
+	// Unplaced entries hold no slot of their own and never move.
+	bool slot_hash(const mhashpage& page, int slot, hash_array_t& h) {
+		if (page.unplaced(slot)) {
+			return false;
+		}
+		compute_hash(page.entries[slot].first, h);
+		return true;
 	}
 
-	void insert_internal(const mhashpage::entry_t& element, hash_array_t key_hash) {
-		if (try_insert(element, key_hash)) {
-			return;
+	void copy_slot(int32_t from, int from_slot, int32_t to, int to_slot, int to_level) {
+		const mhashpage::entry_t& e = page_[from].entries[from_slot];
+		uint8_t stamp = page_[from].stamp(from_slot);
+		before_write(to);
+		if (to_slot < 0) {
+			page_[to].insert(e, to_level, stamp);
+		} else {
+			page_[to].place(to_slot, e, to_level, stamp);
 		}
+	}
 
-		mhashpage::entry_t evicted = element;
-		int last_evicted_level = -1;
-
+	void insert_internal(const mhashpage::entry_t& element, hash_array_t key_hash, uint8_t stamp) {
 		while (true) {
-			int count = 0;
-			while (count < MAX_ITERATION) {
-				if (!try_evict_foreign(evicted, last_evicted_level, key_hash)) {
-					evict_any(evicted, last_evicted_level, key_hash);
-				}
-				compute_hash(evicted.first, key_hash);
-				decrease_foreign_element(last_evicted_level, key_hash);
-				// TODO: implement try_insert_except.
-				if (try_insert(evicted, key_hash)) {
+			if (try_insert(element, key_hash, stamp)) {
+				++cuckoo_paths_[0];
+				return;
+			}
+			if (cache_mode_) {
+				evict(key_hash);
+				continue;
+			}
+			cuckoo_path<mhashmap, kMaxCuckooPathDepth, kMaxCuckooSearchNodes> path;
+			if (load_factor() < max_load_factor_) {
+				if (path.find(*this, key_hash)) {
+					uint32_t p;
+					int slot;
+					int level;
+					path.execute(*this, &p, &slot, &level);
+					before_write(p);
+					page_[p].place(slot, element, level, stamp);
+					increase_foreign_element(level, key_hash);
+					++cuckoo_paths_[path.depth()];
 					return;
 				}
-				++count;
+				++cuckoo_failures_;
 			}
-			rebuild_or_rehash();
-			compute_hash(evicted.first, key_hash);
-			if (try_insert(evicted, key_hash)) {
+			// Tree entries carry no stamp, so TTL mode grows instead.
+			if (ttl_ == 0 && load_factor() < static_cast<int>(load_factor_) && try_insert_tree(element, key_hash)) {
 				return;
 			}
+			rebuild_or_rehash();
+			compute_hash(element.first, key_hash);
 		}
 	}
 
@@ -446,25 +1069,495 @@ public:
 
 		mhashpage::entry_t* entry = find_internal(element.first, key_hash);
 		if (entry != nullptr) {
+			if (cache_mode_) {
+				touch(entry);
+			}
+			if (expired(entry)) {
+				// An expired entry comes back with the new value.
+				before_write(&page_of(entry) - page_);
+				entry->second = element.second;
+				restamp(entry);
+			}
 			// update the entry
 			return;
 		}
-		insert_internal(element, key_hash);
+		if (ttl_ != 0 && try_reclaim(element, key_hash, current_stamp())) {
+			return;
+		}
+		insert_internal(element, key_hash, current_stamp());
+		++num_entries_;
+	}
+
+
+	// Adds an entry without looking for one with the same key, so a key can
+	// own several slots among its candidate pages.
+	void insert_duplicate(const mhashpage::entry_t& element) {
+		hash_array_t key_hash;
+		compute_hash(element.first, key_hash);
+		insert_internal(element, key_hash, current_stamp());
 		++num_entries_;
 	}
 
+	// Visits every slot of one key in candidate page order, with the same
+	// foreign_placed cut-off as find(). A page that is the candidate of
+	// several levels is scanned once. Invalidated by any insert or erase.
+	class key_cursor {
+	public:
+		key_cursor() : map_(nullptr), level_(kMaxPlacementStatus) {}
+
+		key_cursor(mhashmap* map, const key_t& k) : map_(map), key_(k), level_(0), slot_(0), child_(0) {
+			map->compute_hash(k, key_hash_);
+		}
+
+		mhashpage::entry_t* next() {
+			while (level_ < kMaxPlacementStatus) {
+				mhashpage& page = map_->page_[GET(key_hash_, level_)];
+				if (!scanned_before(level_)) {
+					while (slot_ < page.cxt.num_elements) {
+						mhashpage::entry_t* e = &page.entries[slot_++];
+						if (e->first == key_ && !map_->expired(page.stamp(slot_ - 1))) {
+							return e;
+						}
+					}
+				}
+				++level_;
+				slot_ = 0;
+				if (level_ != kMaxPlacementStatus && !page.overflow(level_ - 1)) {
+					level_ = kMaxPlacementStatus;
+				}
+			}
+			return next_in_tree();
+		}
+
+	private:
+		mhashpage::entry_t* next_in_tree() {
+			if (map_ == nullptr || !map_->page_[GET(key_hash_, 0)].has_tree()) {
+				return nullptr;
+			}
+			// child_ counts the extents whose range holds key_.
+			btree_page* tree = map_->tree_[GET(key_hash_, 0)];
+			for (;; ++child_, slot_ = 0) {
+				btree_page::extent* extent = nullptr;
+				int size = 0;
+				int n = 0;
+				tree->for_each_extent(key_, key_, [&](btree_page::extent* e, int s) {
+					if (n++ == child_) {
+						extent = e;
+						size = s;
+					}
+				});
+				if (extent == nullptr) {
+					return nullptr;
+				}
+				while (slot_ < size) {
+					mhashpage::entry_t* e = &extent->item_[slot_++];
+					if (e->first == key_) {
+						return e;
+					}
+				}
+			}
+		}
+
+		bool scanned_before(int level) {
+			for (int i = 0; i < level; ++i) {
+				if (GET(key_hash_, i) == GET(key_hash_, level)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		mhashmap* map_;
+		key_t key_;
+		hash_array_t key_hash_;
+		int level_;
+		int slot_;
+		int child_;
+	};
+
+	key_cursor find_all(const key_t& k) {
+		return key_cursor(this, k);
+	}
 
 	iterator find(const key_t& k) {
 		hash_array_t key_hash;
 		compute_hash(k, key_hash);
 		mhashpage::entry_t* e = find_internal(k, key_hash);
-		if (e != nullptr) {
+		if (e != nullptr && !expired(e)) {
+			if (cache_mode_) {
+				touch(e);
+			}
 			return iterator(e);
 		}
 		return end();
 	}
 
-	bool erase(const key_t& k);
+	// Prefetches what step |level| of find_step() reads: a candidate page,
+	// or for kMaxPlacementStatus the overflow tree node.
+	void prefetch(hash_array_t& key_hash, int level = 0) const {
+		const char* p;
+		if (level < kMaxPlacementStatus) {
+			p = reinterpret_cast<const char*>(&page_[GET(key_hash, level)]);
+		} else {
+			p = reinterpret_cast<const char*>(tree_[GET(key_hash, 0)]);
+		}
+		_mm_prefetch(p, _MM_HINT_T0);
+		_mm_prefetch(p + 64, _MM_HINT_T0);
+	}
+
+	// find() cut at page boundaries, for callers that interleave lookups.
+	// Runs step |level| and returns the step to prefetch and run next, or
+	// -1 once |out| holds the result.
+	int find_step(const key_t& k, hash_array_t& key_hash, int level, mhashpage::entry_t** out) {
+		if (level == kMaxPlacementStatus) {
+			*out = tree_[GET(key_hash, 0)]->find(k);
+			return -1;
+		}
+		mhashpage& page = page_[GET(key_hash, level)];
+		mhashpage::entry_t* e = page.find(k);
+		if (e != nullptr) {
+			*out = expired(e) ? nullptr : e;
+			if (*out != nullptr && cache_mode_) {
+				touch(e);
+			}
+			return -1;
+		}
+		if (level != mhashpage::kMaxLevel && page.overflow(level)) {
+			return level + 1;
+		}
+		*out = nullptr;
+		return page_[GET(key_hash, 0)].has_tree() ? kMaxPlacementStatus : -1;
+	}
+
+	// Looks up |n| keys. Every key of a group of kFindBatch is hashed and its
+	// first candidate page prefetched before any of them is probed, so the
+	// page misses of the group overlap. Missing keys yield nullptr.
+	void find_batch(const key_t* keys, size_t n, mhashpage::entry_t** out) {
+		hash_array_t key_hash[kFindBatch];
+		for (size_t base = 0; base < n; base += kFindBatch) {
+			int count = static_cast<int>(std::min<size_t>(kFindBatch, n - base));
+			for (int i = 0; i < count; ++i) {
+				compute_hash(keys[base + i], key_hash[i]);
+				prefetch(key_hash[i]);
+			}
+			for (int i = 0; i < count; ++i) {
+				mhashpage::entry_t* e = find_internal(keys[base + i], key_hash[i]);
+				if (e != nullptr && expired(e)) {
+					e = nullptr;
+				}
+				if (e != nullptr && cache_mode_) {
+					touch(e);
+				}
+				out[base + i] = e;
+			}
+		}
+	}
+
+	bool erase(const key_t& k) {
+		hash_array_t key_hash;
+		compute_hash(k, key_hash);
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			mhashpage& page = page_[GET(key_hash, i)];
+			int index = page.find_index(k);
+			if (index >= 0) {
+				int level = page.level(index);
+				before_write(GET(key_hash, i));
+				page.erase(index);
+				decrease_foreign_element(level, key_hash);
+				--num_entries_;
+				if (page.has_tree()) {
+					demote_tree_entry(GET(key_hash, i));
+				}
+				return true;
+			}
+			if (i != mhashpage::kMaxLevel && !page.overflow(i)) {
+				break;
+			}
+		}
+		int32_t home = GET(key_hash, 0);
+		if (page_[home].has_tree() && tree_[home]->erase(k)) {
+			--num_entries_;
+			if (tree_[home]->size() == 0) {
+				release_tree(home);
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Under skew a cluster of pages can fill up while the table as a whole
+	// is far from full. Rather than growing the table, the entry goes to a
+	// btree_page owned by its first candidate page, which deepens as it
+	// fills.
+	bool try_insert_tree(const mhashpage::entry_t& element, hash_array_t& key_hash) {
+		int32_t home = GET(key_hash, 0);
+		if (!page_[home].has_tree()) {
+			if (tree_.size() != static_cast<size_t>(capacity_)) {
+				tree_.assign(capacity_, nullptr);
+			}
+			tree_[home] = btree_page::create();
+			before_write(home);
+			page_[home].cxt.flags[mhashpage::kTreeFlag] = 1;
+			++num_overflow_page_;
+		}
+		page::elem_t e = element;
+		return tree_[home]->insert(std::move(e));
+	}
+
+	// Every tree entry has |p| as its first candidate, so a slot freed in |p|
+	// takes one back at level 0. The tree goes away once it drains.
+	void demote_tree_entry(int32_t p) {
+		page::elem_t e;
+		if (tree_[p]->pop(&e)) {
+			page_[p].insert(e, 0, current_stamp());
+		}
+		if (tree_[p]->size() == 0) {
+			release_tree(p);
+		}
+	}
+
+	void release_tree(int32_t p) {
+		tree_[p]->release();
+		delete tree_[p];
+		tree_[p] = nullptr;
+		before_write(p);
+		page_[p].cxt.flags[mhashpage::kTreeFlag] = 0;
+		--num_overflow_page_;
+	}
+
+	// Frees every overflow tree, optionally keeping its entries.
+	void release_trees(std::vector<mhashpage::entry_t>* entries) {
+		for (size_t p = 0; p < tree_.size(); ++p) {
+			if (tree_[p] == nullptr) {
+				continue;
+			}
+			if (entries != nullptr) {
+				tree_[p]->for_each_extent([entries](btree_page::extent* e, int size) {
+					entries->insert(entries->end(), e->item_, e->item_ + size);
+				});
+			}
+			release_tree(p);
+		}
+		tree_.clear();
+	}
+
+	// TTL mode: an entry written more than |ttl| epochs before the current
+	// one counts as absent, and its slot can be reused by an insert. Stamps
+	// wrap after 32 epochs, so sweep() has to pass over the whole table at
+	// least every 32 - ttl epochs or old entries come back. Set before the
+	// first insert; 0 turns expiry off.
+	void set_ttl(int ttl) {
+		assert(ttl >= 0 && ttl <= kMaxTtl);
+		ttl_ = ttl;
+	}
+
+	void advance_epoch() { ++epoch_; }
+	uint32_t epoch() const { return epoch_; }
+
+	// Erases the expired entries of at most |budget| pages, continuing where
+	// the previous call stopped. Returns the number of entries erased.
+	size_t sweep(int32_t budget) {
+		size_t num_erased = 0;
+		if (ttl_ == 0) {
+			return 0;
+		}
+		for (int32_t n = 0; n < budget && n < capacity_; ++n) {
+			if (sweep_cursor_ >= capacity_) {
+				sweep_cursor_ = 0;
+			}
+			mhashpage& page = page_[sweep_cursor_];
+			for (int s = 0; s < page.cxt.num_elements; ) {
+				if (expired(page.stamp(s))) {
+					erase_at(sweep_cursor_, s);
+					++num_erased;
+				} else {
+					++s;
+				}
+			}
+			++sweep_cursor_;
+		}
+		return num_erased;
+	}
+
+	uint8_t current_stamp() const {
+		return epoch_ & mhashpage::kStampMask;
+	}
+
+	bool expired(uint8_t stamp) const {
+		return ttl_ != 0 && ((epoch_ - stamp) & mhashpage::kStampMask) > static_cast<uint32_t>(ttl_);
+	}
+
+	// Only for entries in page_, which is where all entries live in TTL mode.
+	bool expired(const mhashpage::entry_t* e) const {
+		if (ttl_ == 0) {
+			return false;
+		}
+		const mhashpage& page = page_of(e);
+		return expired(page.stamp(e - page.entries));
+	}
+
+	void restamp(const mhashpage::entry_t* e) {
+		mhashpage& page = page_of(e);
+		int index = e - page.entries;
+		before_write(&page - page_);
+		page.cxt.flags[index] = mhashpage::make_flag(page.level(index), current_stamp());
+	}
+
+	mhashpage& page_of(const mhashpage::entry_t* e) const {
+		size_t offset = reinterpret_cast<const char*>(e) - reinterpret_cast<const char*>(page_);
+		return page_[offset / sizeof(mhashpage)];
+	}
+
+	void erase_at(int32_t p, int index) {
+		hash_array_t key_hash;
+		compute_hash(page_[p].entries[index].first, key_hash);
+		int level = page_[p].level(index);
+		before_write(p);
+		page_[p].erase(index);
+		decrease_foreign_element(level, key_hash);
+		--num_entries_;
+	}
+
+	// When every candidate page is full, an expired entry in one of them
+	// gives up its slot instead of live entries being displaced.
+	bool try_reclaim(const mhashpage::entry_t& element, hash_array_t& key_hash, uint8_t stamp) {
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			if (!page_[GET(key_hash, i)].full()) {
+				return false;
+			}
+		}
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			int32_t p = GET(key_hash, i);
+			mhashpage& page = page_[p];
+			for (int s = 0; s < page.cxt.num_elements; ++s) {
+				if (expired(page.stamp(s))) {
+					erase_at(p, s);
+					page.insert(element, i, stamp);
+					increase_foreign_element(i, key_hash);
+					++num_entries_;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Cache mode keeps the current page array for good. A key whose candidate
+	// pages are all full evicts an entry chosen by CLOCK instead of
+	// displacing entries or growing the table; |on_evict| sees each victim.
+	// A hit from find() or insert() sets the reference bit of its slot.
+	// Size the table with the capacity constructor and set the mode before
+	// the first insert.
+	void set_cache_mode(std::function<void(const mhashpage::entry_t&)> on_evict) {
+		cache_mode_ = true;
+		on_evict_ = on_evict;
+	}
+
+	void touch(const mhashpage::entry_t* e) {
+		mhashpage& page = page_of(e);
+		page.touch(e - page.entries);
+	}
+
+	// The hand walks the slots of the candidate pages from a rotating start,
+	// clears the reference bits it passes and evicts the first unreferenced
+	// entry. Two rounds always find one.
+	void evict(hash_array_t& key_hash) {
+		const int kSlots = kMaxPlacementStatus * mhashpage::num_max_entries;
+		for (int n = 0; n < 2 * kSlots; ++n) {
+			int slot = (clock_hand_ + n) % kSlots;
+			int32_t p = GET(key_hash, slot / mhashpage::num_max_entries);
+			int s = slot % mhashpage::num_max_entries;
+			mhashpage& page = page_[p];
+			if (page.cxt.referenced.test(s)) {
+				page.cxt.referenced.clear(s);
+				continue;
+			}
+			mhashpage::entry_t victim = page.entries[s];
+			erase_at(p, s);
+			clock_hand_ += n + 1;
+			if (on_evict_) {
+				on_evict_(victim);
+			}
+			return;
+		}
+	}
+
+	// Returns a consistent read-only view of the current contents. Taking one
+	// costs a chunk table and a copy of the overflow tree entries; pages are
+	// copied only as the map goes on to write them, and a copy is freed with
+	// the last view that uses it. Values changed in place through iterators,
+	// find_all() or for_each() bypass the copy and may show in a view.
+	std::shared_ptr<const mhashmap_snapshot> snapshot() {
+		if (!block_) {
+			block_ = std::make_shared<mhashpage_block>(page_);
+		}
+		prune_snapshots();
+		if (snapshots_.empty()) {
+			chunk_seq_.assign((capacity_ + mhashmap_snapshot::kChunkPages - 1) >> mhashmap_snapshot::kChunkShift,
+				snapshot_seq_);
+		}
+
+		std::shared_ptr<mhashmap_snapshot> s(new mhashmap_snapshot(capacity_));
+		s->base_ = block_;
+		s->seq_ = ++snapshot_seq_;
+		s->size_ = num_entries_;
+		s->ttl_ = ttl_;
+		s->epoch_ = epoch_;
+		for (size_t p = 0; p < tree_.size(); ++p) {
+			if (tree_[p] == nullptr) {
+				continue;
+			}
+			std::vector<mhashpage::entry_t>& entries = s->tree_entries_;
+			tree_[p]->for_each_extent([&entries](btree_page::extent* e, int size) {
+				entries.insert(entries.end(), e->item_, e->item_ + size);
+			});
+		}
+		std::sort(s->tree_entries_.begin(), s->tree_entries_.end());
+		s->capacity_mask_ = capacity_mask_;
+		s->hash_add_ = hash_add_;
+		s->hash_mult_ = hash_mult_;
+		snapshots_.push_back(s);
+		return s;
+	}
+
+	// Starts recording which pages are written, with every page dirty.
+	void track_dirty_pages() {
+		track_dirty_ = true;
+		mark_all_dirty();
+	}
+
+	// Calls |f| with the index and contents of every page written since the
+	// previous call, then forgets them.
+	template <typename F>
+	void take_dirty_pages(F f) {
+		for (size_t w = 0; w < dirty_pages_.size(); ++w) {
+			for (uint64_t bits = dirty_pages_[w]; bits != 0; bits &= bits - 1) {
+				int32_t p = w * 64 + __builtin_ctzll(bits);
+				if (p < capacity_) {
+					f(p, page_[p]);
+				}
+			}
+			dirty_pages_[w] = 0;
+		}
+	}
+
+	// Inserts |element| or overwrites the value of its key.
+	void insert_or_assign(const mhashpage::entry_t& element) {
+		hash_array_t key_hash;
+		compute_hash(element.first, key_hash);
+		mhashpage::entry_t* entry = find_internal(element.first, key_hash);
+		if (entry == nullptr) {
+			insert(element);
+			return;
+		}
+		if (entry >= &page_[0].entries[0] && entry < &page_[capacity_].entries[0]) {
+			before_write(&page_of(entry) - page_);
+			entry->second = element.second;
+			restamp(entry);
+		} else {
+			entry->second = element.second;
+		}
+	}
 
 	iterator begin();
 	iterator end() {
@@ -472,33 +1565,144 @@ public:
 	}
 
 private:
-	static const int MAX_ITERATION = 10;
+	// Bounds of the cuckoo path search. A path holds at most
+	// kMaxCuckooPathDepth displacements before the table is rebuilt.
+	static const int kMaxCuckooPathDepth = 4;
+	static const int kMaxCuckooSearchNodes = 128;
+
+	static const int32_t kMinParallelRebuildPages = 1 << 14;
+
+	static const int kFindBatch = 16;
+
+	static const int kMaxTtl = 16;
 
 	// 70% occupancy
 	static const uint32_t load_factor_ = 700;
 
+	// shrink_to_fit() leaves the table at most half as full as it grows at.
+	static const uint32_t shrink_load_factor_ = 350;
+
+	// Above 95% occupancy a full set of candidate pages grows the table
+	// instead of searching for a displacement path.
+	static const int max_load_factor_ = 950;
+
+	// Every write to a page goes through here first. Reference bits are
+	// not part of what a snapshot sees and are written without it.
+	void before_write(int32_t p) {
+		if (track_dirty_) {
+			dirty_pages_[p >> 6] |= 1ULL << (p & 63);
+		}
+		if (!snapshots_.empty() && chunk_seq_[p >> mhashmap_snapshot::kChunkShift] != snapshot_seq_) {
+			copy_chunk(p >> mhashmap_snapshot::kChunkShift);
+		}
+	}
+
+	// Gives one copy of chunk |c| to every live snapshot taken since the
+	// chunk was last copied.
+	void copy_chunk(int32_t c) {
+		std::vector<std::shared_ptr<mhashmap_snapshot> > readers;
+		for (size_t i = 0; i < snapshots_.size(); ++i) {
+			std::shared_ptr<mhashmap_snapshot> s = snapshots_[i].lock();
+			if (s && s->seq_ > chunk_seq_[c]) {
+				readers.push_back(s);
+			}
+		}
+		chunk_seq_[c] = snapshot_seq_;
+		if (readers.empty()) {
+			prune_snapshots();
+			return;
+		}
+		int32_t begin = c << mhashmap_snapshot::kChunkShift;
+		int32_t num_pages = std::min<int32_t>(capacity_ - begin, +mhashmap_snapshot::kChunkPages);
+		mhashpage_chunk* chunk = new mhashpage_chunk(readers.size(), &page_[begin], num_pages);
+		for (size_t i = 0; i < readers.size(); ++i) {
+			readers[i]->chunk_[c].store(chunk, std::memory_order_release);
+		}
+		// Pairs with the fence in mhashmap_snapshot::read_page(): a reader
+		// that sees any of the writes that follow also sees the copy.
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void prune_snapshots() {
+		size_t n = 0;
+		for (size_t i = 0; i < snapshots_.size(); ++i) {
+			if (!snapshots_[i].expired()) {
+				snapshots_[n++] = snapshots_[i];
+			}
+		}
+		snapshots_.resize(n);
+	}
+
+	void drop_snapshots() {
+		block_.reset();
+		snapshots_.clear();
+		chunk_seq_.clear();
+	}
+
+	void mark_all_dirty() {
+		if (track_dirty_) {
+			dirty_pages_.assign((capacity_ + 63) / 64, ~0ULL);
+		}
+	}
+
+	void release_pages() {
+		if (block_) {
+			block_->owned = true;
+			drop_snapshots();
+		} else {
+			free(page_);
+		}
+	}
+
 	void init(int32_t capacity) {
 		page_ = reinterpret_cast<mhashpage*>(malloc(sizeof(mhashpage) * capacity));
 		capacity_ = capacity;
 		num_entries_ = 0;
 		num_overflow_page_ = 0;
+		sweep_cursor_ = 0;
 		std::memset(page_, 0, sizeof(mhashpage) * capacity);
 		set_capacity_mask();
+		mark_all_dirty();
+		std::fill(cuckoo_paths_, cuckoo_paths_ + kMaxCuckooPathDepth + 1, 0);
+		cuckoo_failures_ = 0;
 
-		static const uint32_t addv[4] = {1923775UL, 47472UL, 575757172UL, 39192381UL};
-		hash_add_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(addv)); 
-		static const uint32_t multv[4] = {512775UL, 47471093UL, 6761UL, 83192381UL};
-		hash_mult_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(multv));
+		hash_add_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hash_add_constants())); 
+		hash_mult_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hash_mult_constants()));
 	}
 
 	mhashpage* page_;
 	int32_t num_entries_;
 	int32_t capacity_;
 	int32_t num_overflow_page_;
+	int rebuild_threads_;
+	std::unique_ptr<worker_pool> rebuild_pool_;
+	// Overflow tree per page, allocated on the first promotion.
+	std::vector<btree_page*> tree_;
+	int ttl_;
+	uint32_t epoch_;
+	int32_t sweep_cursor_;
+	bool cache_mode_;
+	std::function<void(const mhashpage::entry_t&)> on_evict_;
+	uint32_t clock_hand_;
+	// Page array shared with snapshots, if any were taken of it.
+	std::shared_ptr<mhashpage_block> block_;
+	std::vector<std::weak_ptr<mhashmap_snapshot> > snapshots_;
+	// Sequence number of the latest snapshot that has its own copy of, or
+	// has seen no write to, each chunk.
+	std::vector<uint32_t> chunk_seq_;
+	uint32_t snapshot_seq_;
+	// One bit per page written since take_dirty_pages().
+	bool track_dirty_;
+	std::vector<uint64_t> dirty_pages_;
 	//hash_function h1_;
 	hash_array_t capacity_mask_;
 	hash_array_t hash_add_;
 	hash_array_t hash_mult_;
+	// Placements by the number of entries a cuckoo path displaced for them,
+	// rebuilds included, and path searches that found none, since the table
+	// was last cleared.
+	uint64_t cuckoo_paths_[kMaxCuckooPathDepth + 1];
+	uint64_t cuckoo_failures_;
 };
 
 #endif  // MHASHMAP_H_
@@ -1,6 +1,12 @@
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <memory>
 #include <random>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 #include <iostream>
 
 #include "gtest/gtest.h"
@@ -55,6 +61,512 @@ TEST(MHASHMAP, Rebuild) {
 	}
 }
 
+TEST(MHASHMAP, Erase) {
+	mhashmap m;
+	for (uint64_t i = 1; i < 9000; ++i) {
+		m.insert(std::make_pair(i, 1000ULL + i));
+	}
+
+	for (uint64_t i = 1; i < 9000; i += 2) {
+		EXPECT_TRUE(m.erase(i)) << i;
+	}
+	EXPECT_FALSE(m.erase(1));
+	EXPECT_FALSE(m.erase(9001));
+	EXPECT_EQ(4499u, m.size());
+
+	for (uint64_t i = 1; i < 9000; ++i) {
+		mhashmap::iterator iter = m.find(i);
+		if (i % 2 == 1) {
+			EXPECT_EQ(m.end(), iter) << i;
+		} else {
+			ASSERT_NE(m.end(), iter) << i;
+			EXPECT_EQ(1000ULL + i, iter->second);
+		}
+	}
+}
+
+TEST(MHASHMAP, ForEachAndSwap) {
+	mhashmap a;
+	mhashmap b;
+	for (uint64_t i = 1; i < 1000; ++i) {
+		a.insert(std::make_pair(i, i));
+	}
+	b.insert(std::make_pair(5000ULL, 1ULL));
+
+	a.swap(b);
+	EXPECT_EQ(1u, a.size());
+	EXPECT_EQ(999u, b.size());
+	EXPECT_NE(a.end(), a.find(5000));
+	EXPECT_EQ(a.end(), a.find(5));
+
+	uint64_t sum = 0;
+	size_t count = 0;
+	b.for_each([&](mhashpage::entry_t& e) {
+		sum += e.second;
+		++count;
+	});
+	EXPECT_EQ(999u, count);
+	EXPECT_EQ(999ULL * 1000 / 2, sum);
+
+	b.clear();
+	EXPECT_EQ(0u, b.size());
+	EXPECT_EQ(b.end(), b.find(5));
+}
+
+TEST(MHASHMAP, DuplicateSlots) {
+	mhashmap m;
+	for (uint64_t i = 1; i < 5000; ++i) {
+		m.insert(std::make_pair(i, i));
+		if (i % 10 == 0) {
+			m.insert_duplicate(std::make_pair(i, i + 1));
+			m.insert_duplicate(std::make_pair(i, i + 2));
+		}
+	}
+	EXPECT_EQ(4999u + 499 * 2, m.size());
+
+	for (uint64_t i = 1; i < 5000; ++i) {
+		mhashmap::key_cursor cursor = m.find_all(i);
+		uint64_t sum = 0;
+		int count = 0;
+		for (mhashpage::entry_t* e = cursor.next(); e != nullptr; e = cursor.next()) {
+			sum += e->second;
+			++count;
+		}
+		if (i % 10 == 0) {
+			EXPECT_EQ(3, count) << i;
+			EXPECT_EQ(3 * i + 3, sum) << i;
+		} else {
+			EXPECT_EQ(1, count) << i;
+			EXPECT_EQ(i, sum) << i;
+		}
+	}
+	EXPECT_EQ(nullptr, m.find_all(5000).next());
+}
+
+// Keys with the same low 32 bits share their four candidate pages.
+TEST(MHASHMAP, SkewedPagesUseTree) {
+	mhashmap m;
+	for (uint64_t i = 1; i < 2000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	size_t capacity = m.capacity();
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.insert(std::make_pair((j << 32) | 7, j));
+	}
+	EXPECT_EQ(capacity, m.capacity());
+	EXPECT_EQ(1u, m.num_trees());
+	EXPECT_EQ(1999u + 40, m.size());
+
+	size_t count = 0;
+	m.for_each([&](mhashpage::entry_t&) {
+		++count;
+	});
+	EXPECT_EQ(m.size(), count);
+
+	for (uint64_t j = 1; j <= 40; ++j) {
+		mhashmap::iterator iter = m.find((j << 32) | 7);
+		ASSERT_NE(m.end(), iter) << j;
+		EXPECT_EQ(j, iter->second);
+	}
+
+	for (uint64_t j = 1; j <= 40; ++j) {
+		EXPECT_TRUE(m.erase((j << 32) | 7)) << j;
+	}
+	EXPECT_EQ(0u, m.num_trees());
+	for (uint64_t i = 1; i < 2000; ++i) {
+		mhashmap::iterator iter = m.find(i);
+		ASSERT_NE(m.end(), iter) << i;
+		EXPECT_EQ(i, iter->second);
+	}
+
+	// Growing the table drains the trees and reinserts their entries.
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.insert(std::make_pair((j << 32) | 9, j));
+	}
+	for (uint64_t i = 2000; i < 20000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	EXPECT_LT(capacity, m.capacity());
+	for (uint64_t j = 1; j <= 40; ++j) {
+		EXPECT_NE(m.end(), m.find((j << 32) | 9)) << j;
+	}
+	EXPECT_EQ(19999u + 40, m.size());
+}
+
+// A group many times the size of its candidate pages deepens one tree.
+TEST(MHASHMAP, DeepTree) {
+	const uint64_t kGroup = 3000;
+	mhashmap m;
+	for (uint64_t j = 1; j <= kGroup; ++j) {
+		m.insert(std::make_pair((j << 32) | 7, j));
+	}
+	// Copies of one key spread over several extents.
+	for (uint64_t i = 0; i < 20; ++i) {
+		m.insert_duplicate(std::make_pair((5ULL << 32) | 7, 100 + i));
+	}
+	EXPECT_EQ(1u, m.num_trees());
+	EXPECT_EQ(kGroup + 20, m.size());
+
+	size_t count = 0;
+	m.for_each([&](mhashpage::entry_t&) {
+		++count;
+	});
+	EXPECT_EQ(m.size(), count);
+	for (uint64_t j = 1; j <= kGroup; ++j) {
+		ASSERT_NE(m.end(), m.find((j << 32) | 7)) << j;
+	}
+	mhashmap::key_cursor cursor = m.find_all((5ULL << 32) | 7);
+	count = 0;
+	for (mhashpage::entry_t* e = cursor.next(); e != nullptr; e = cursor.next()) {
+		++count;
+	}
+	EXPECT_EQ(21u, count);
+
+	// Erase reaches the copies in every extent of the run.
+	for (uint64_t i = 0; i < 21; ++i) {
+		EXPECT_TRUE(m.erase((5ULL << 32) | 7)) << i;
+	}
+	EXPECT_FALSE(m.erase((5ULL << 32) | 7));
+	EXPECT_EQ(m.end(), m.find((5ULL << 32) | 7));
+	for (uint64_t j = 1; j <= kGroup; ++j) {
+		if (j != 5) {
+			EXPECT_TRUE(m.erase((j << 32) | 7)) << j;
+		}
+	}
+	EXPECT_EQ(0u, m.size());
+	EXPECT_EQ(0u, m.num_trees());
+}
+
+TEST(MHASHMAP, Ttl) {
+	mhashmap m;
+	m.set_ttl(2);
+	for (uint64_t i = 1; i <= 1000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	m.advance_epoch();
+	m.advance_epoch();
+	for (uint64_t i = 1; i <= 1000; ++i) {
+		ASSERT_NE(m.end(), m.find(i)) << i;
+	}
+
+	m.advance_epoch();
+	for (uint64_t i = 1; i <= 1000; ++i) {
+		EXPECT_EQ(m.end(), m.find(i)) << i;
+	}
+
+	// An expired key is written again in place.
+	m.insert(std::make_pair(5ULL, 50ULL));
+	ASSERT_NE(m.end(), m.find(5));
+	EXPECT_EQ(50u, m.find(5)->second);
+
+	EXPECT_EQ(999u, m.sweep(m.capacity()));
+	EXPECT_EQ(1u, m.size());
+	EXPECT_EQ(0u, m.sweep(m.capacity()));
+	ASSERT_NE(m.end(), m.find(5));
+}
+
+TEST(MHASHMAP, TtlReclaimsSlots) {
+	mhashmap m;
+	m.set_ttl(1);
+	const uint64_t kKeysPerEpoch = 5000;
+	size_t capacity = 0;
+	for (uint64_t epoch = 0; epoch < 30; ++epoch) {
+		for (uint64_t i = 0; i < kKeysPerEpoch; ++i) {
+			m.insert(std::make_pair(epoch * kKeysPerEpoch + i + 1, epoch));
+		}
+		for (uint64_t i = 0; i < kKeysPerEpoch; i += 97) {
+			mhashmap::iterator iter = m.find(epoch * kKeysPerEpoch + i + 1);
+			ASSERT_NE(m.end(), iter) << epoch << " " << i;
+			EXPECT_EQ(epoch, iter->second);
+		}
+		m.advance_epoch();
+		m.sweep(m.capacity() / mhashpage::num_max_entries / 8);
+		if (epoch == 4) {
+			capacity = m.capacity();
+		}
+	}
+	// Expired slots are reused, so the table stops growing.
+	EXPECT_EQ(capacity, m.capacity());
+}
+
+TEST(MHASHMAP, CacheModeEvicts) {
+	const int32_t kPages = 64;
+	mhashmap m(kPages);
+	std::vector<uint64_t> evicted;
+	m.set_cache_mode([&](const mhashpage::entry_t& e) {
+		evicted.push_back(e.first);
+	});
+
+	const uint64_t kHotKeys = 10;
+	for (uint64_t i = 1; i <= 10000; ++i) {
+		m.insert(std::make_pair(1000000 + i, i));
+		for (uint64_t h = 1; h <= kHotKeys; ++h) {
+			if (m.find(h) == m.end()) {
+				m.insert(std::make_pair(h, h));
+			}
+		}
+	}
+	EXPECT_EQ(kPages * mhashpage::num_max_entries, static_cast<int32_t>(m.capacity()));
+	EXPECT_EQ(10000u + kHotKeys, m.size() + evicted.size());
+
+	// Hot keys are referenced between every two passes of the hand.
+	for (uint64_t h = 1; h <= kHotKeys; ++h) {
+		EXPECT_NE(m.end(), m.find(h)) << h;
+	}
+	for (size_t i = 0; i < evicted.size(); ++i) {
+		EXPECT_EQ(m.end(), m.find(evicted[i])) << evicted[i];
+	}
+}
+
+TEST(MHASHMAP, Snapshot) {
+	mhashmap m;
+	for (uint64_t i = 1; i <= 10000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	std::shared_ptr<const mhashmap_snapshot> s = m.snapshot();
+	EXPECT_EQ(0u, s->copied_bytes());
+
+	for (uint64_t i = 2; i <= 10000; i += 2) {
+		m.erase(i);
+	}
+	for (uint64_t i = 10001; i <= 12000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	EXPECT_EQ(7000u, m.size());
+	EXPECT_EQ(10000u, s->size());
+	for (uint64_t i = 1; i <= 12000; ++i) {
+		mhashmap_snapshot::value_t v = 0;
+		if (i <= 10000) {
+			ASSERT_TRUE(s->find(i, &v)) << i;
+			EXPECT_EQ(i, v);
+		} else {
+			EXPECT_FALSE(s->find(i, &v)) << i;
+		}
+	}
+
+	// Growing the table leaves the old array to the snapshot.
+	size_t capacity = m.capacity();
+	for (uint64_t i = 12001; i <= 100000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	EXPECT_LT(capacity, m.capacity());
+	size_t count = 0;
+	s->for_each([&](const mhashpage::entry_t& e) {
+		EXPECT_EQ(e.first, e.second);
+		EXPECT_LE(e.first, 10000u);
+		++count;
+	});
+	EXPECT_EQ(10000u, count);
+}
+
+TEST(MHASHMAP, SnapshotsShareCopies) {
+	mhashmap m(1024);
+	for (uint64_t i = 1; i <= 3000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	std::shared_ptr<const mhashmap_snapshot> s1 = m.snapshot();
+	std::shared_ptr<const mhashmap_snapshot> s2 = m.snapshot();
+	m.erase(1);
+	// One write copies one chunk per touched page, not the table.
+	EXPECT_LT(0u, s1->copied_bytes());
+	EXPECT_GE(4u * mhashmap_snapshot::kChunkPages * sizeof(mhashpage), s1->copied_bytes());
+	EXPECT_EQ(s1->copied_bytes(), s2->copied_bytes());
+
+	std::shared_ptr<const mhashmap_snapshot> s3 = m.snapshot();
+	s1.reset();
+	m.erase(2);
+	mhashmap_snapshot::value_t v;
+	EXPECT_TRUE(s2->find(1, &v));
+	EXPECT_TRUE(s2->find(2, &v));
+	EXPECT_FALSE(s3->find(1, &v));
+	EXPECT_TRUE(s3->find(2, &v));
+	EXPECT_FALSE(m.snapshot()->find(2, &v));
+}
+
+TEST(MHASHMAP, SnapshotSeesTreeEntries) {
+	mhashmap m;
+	for (uint64_t i = 1; i < 2000; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.insert(std::make_pair((j << 32) | 7, j));
+	}
+	ASSERT_EQ(1u, m.num_trees());
+	std::shared_ptr<const mhashmap_snapshot> s = m.snapshot();
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.erase((j << 32) | 7);
+	}
+	EXPECT_EQ(0u, m.num_trees());
+	for (uint64_t j = 1; j <= 40; ++j) {
+		mhashmap_snapshot::value_t v = 0;
+		ASSERT_TRUE(s->find((j << 32) | 7, &v)) << j;
+		EXPECT_EQ(j, v);
+	}
+}
+
+TEST(MHASHMAP, SnapshotConcurrentReader) {
+	const uint64_t kKeys = 200000;
+	mhashmap m;
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	std::shared_ptr<const mhashmap_snapshot> s = m.snapshot();
+	size_t num_missing = 0;
+	std::thread reader([&]() {
+		for (int round = 0; round < 3; ++round) {
+			for (uint64_t i = 1; i <= kKeys; ++i) {
+				mhashmap_snapshot::value_t v = 0;
+				if (!s->find(i, &v) || v != i) {
+					++num_missing;
+				}
+			}
+		}
+	});
+	for (uint64_t i = 1; i <= kKeys; i += 3) {
+		m.erase(i);
+		m.insert(std::make_pair(kKeys + i, i));
+	}
+	reader.join();
+	EXPECT_EQ(0u, num_missing);
+}
+
+// The map grows past the array the reader's snapshot shares and takes and
+// drops other snapshots meanwhile, so pages are copied, handed over and
+// freed while the reader runs.
+TEST(MHASHMAP, SnapshotReaderDuringGrowth) {
+	const uint64_t kKeys = 50000;
+	mhashmap m;
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		m.insert(std::make_pair(i, i));
+	}
+	std::shared_ptr<const mhashmap_snapshot> s = m.snapshot();
+	size_t num_missing = 0;
+	std::thread reader([&]() {
+		for (int round = 0; round < 3; ++round) {
+			for (uint64_t i = 1; i <= kKeys; ++i) {
+				mhashmap_snapshot::value_t v = 0;
+				if (!s->find(i, &v) || v != i) {
+					++num_missing;
+				}
+			}
+		}
+	});
+	size_t capacity = m.capacity();
+	for (uint64_t i = 1; i <= 4 * kKeys; ++i) {
+		if (i % 1000 == 0) {
+			std::shared_ptr<const mhashmap_snapshot> t = m.snapshot();
+			EXPECT_EQ(kKeys + i - 1, t->size());
+		}
+		m.insert(std::make_pair(kKeys + i, i));
+		m.erase(i % kKeys + 1);
+		m.insert(std::make_pair(i % kKeys + 1, 0ULL));
+	}
+	reader.join();
+	EXPECT_LT(capacity, m.capacity());
+	EXPECT_EQ(0u, num_missing);
+	EXPECT_EQ(kKeys, s->size());
+}
+
+TEST(MHASHMAP, FindBatchMatchesFind) {
+	mhashmap m;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		m.insert(std::make_pair(i, i + 1));
+		keys.push_back(i);
+		keys.push_back(i << 40);
+	}
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.insert(std::make_pair((j << 32) | 7, j));
+		keys.push_back((j << 32) | 7);
+	}
+	ASSERT_EQ(1u, m.num_trees());
+
+	std::vector<mhashpage::entry_t*> found(keys.size());
+	m.find_batch(&keys[0], keys.size(), &found[0]);
+	for (size_t i = 0; i < keys.size(); ++i) {
+		mhashmap::iterator iter = m.find(keys[i]);
+		if (iter == m.end()) {
+			EXPECT_EQ(nullptr, found[i]) << keys[i];
+		} else {
+			EXPECT_EQ(&*iter, found[i]) << keys[i];
+		}
+	}
+}
+
+TEST(MHASHMAP, ShrinkToFit) {
+	mhashmap m;
+	const uint64_t kKeys = 200000;
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		m.insert(std::make_pair(i, i + 1));
+	}
+	for (uint64_t j = 1; j <= 40; ++j) {
+		m.insert(std::make_pair((j << 32) | 7, j));
+	}
+	memory_usage_t before = m.memory_usage();
+	EXPECT_EQ(m.capacity() / mhashpage::num_max_entries * sizeof(mhashpage), before.page_array);
+	EXPECT_LT(0u, before.extents);
+
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		if (i % 20 != 0) {
+			m.erase(i);
+		}
+	}
+	size_t capacity = m.capacity();
+	EXPECT_LT(0, m.shrink_to_fit());
+	EXPECT_GT(capacity / 4, m.capacity());
+	memory_usage_t after = m.memory_usage();
+	EXPECT_GT(before.total() / 4, after.total());
+
+	EXPECT_EQ(kKeys / 20 + 40, m.size());
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		mhashmap::iterator iter = m.find(i);
+		if (i % 20 != 0) {
+			EXPECT_EQ(m.end(), iter) << i;
+		} else {
+			ASSERT_NE(m.end(), iter) << i;
+			EXPECT_EQ(i + 1, iter->second);
+		}
+	}
+	for (uint64_t j = 1; j <= 40; ++j) {
+		mhashmap::iterator iter = m.find((j << 32) | 7);
+		ASSERT_NE(m.end(), iter) << j;
+		EXPECT_EQ(j, iter->second);
+	}
+	EXPECT_EQ(0, m.shrink_to_fit());
+
+	// The smaller table takes new keys as before.
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		m.insert(std::make_pair(i, i + 2));
+	}
+	EXPECT_EQ(kKeys + 40, m.size());
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		ASSERT_NE(m.end(), m.find(i)) << i;
+	}
+}
+
+TEST(MHASHMAP, CuckooPathHighLoad) {
+	const int32_t kPages = 1024;
+	mhashmap m(kPages);
+	const size_t initial_capacity = m.capacity();
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, std::numeric_limits<uint64_t>::max());
+	std::vector<uint64_t> keys;
+	while (keys.size() < initial_capacity * 9 / 10) {
+		uint64_t k = dist(eng);
+		keys.push_back(k);
+		m.insert(std::make_pair(k, k + 1));
+	}
+
+	EXPECT_EQ(initial_capacity, m.capacity());
+	EXPECT_EQ(keys.size(), m.size());
+	for (uint64_t k : keys) {
+		mhashmap::iterator iter = m.find(k);
+		ASSERT_NE(m.end(), iter) << k;
+		EXPECT_EQ(k + 1, iter->second);
+	}
+}
+
 TEST(MHASHMAP, MegaInsert) {
 	mhashmap m;
 
@@ -107,6 +619,40 @@ TEST(MHASHMAP, MegaRandomInsert) {
 	EXPECT_EQ(0, diff_count);
 }
 
+// The same workers run job after job.
+TEST(worker_pool, RunsEveryIndex) {
+	worker_pool pool(4);
+	EXPECT_EQ(4, pool.num_threads());
+	std::vector<std::atomic<int> > calls(4);
+	for (int round = 1; round <= 1000; ++round) {
+		pool.run([&](int t) { ++calls[t]; });
+		for (int t = 0; t < 4; ++t) {
+			ASSERT_EQ(round, calls[t].load()) << t;
+		}
+	}
+}
+
+TEST(MHASHMAP, ParallelRebuild) {
+	mhashmap m;
+	m.set_rebuild_threads(4);
+	std::unordered_map<uint64_t, uint64_t> ref;
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, std::numeric_limits<uint64_t>::max());
+	for (int i = 0; i < 2000000; ++i) {
+		uint64_t k = i % 2 == 0 ? dist(eng) : i;
+		ref.insert(std::make_pair(k, k + 1));
+		m.insert(std::make_pair(k, k + 1));
+	}
+
+	EXPECT_EQ(ref.size(), m.size());
+	for (auto& item : ref) {
+		mhashmap::iterator iter = m.find(item.first);
+		ASSERT_NE(m.end(), iter) << item.first;
+		EXPECT_EQ(item.second, iter->second);
+	}
+}
+
 const uint64_t kInsertIteration = 20000000;
 
 size_t mega_capacity = 6291455;
@@ -125,7 +671,29 @@ TEST(MHASHMAP, MegaInsertBench) {
 		std::cout << "Overflow Rate " << i << " level : " << 100.0 * m.overflow_rate(i) * mhashpage::num_max_entries / m.size() << "%" << std::endl;
 	}
 	mega_capacity = m.capacity() / mhashpage::num_max_entries;
-	std::cout << "Memory usage : " << m.capacity() / mhashpage::num_max_entries * sizeof(mhashpage) / 1024 / 1024 << " MB" << std::endl;
+	memory_usage_t usage = m.memory_usage();
+	std::cout << "Memory usage : " << usage.total() / 1024 / 1024 << " MB, pages " << usage.page_array / 1024 / 1024
+		<< " MB, extents " << usage.extents / 1024 / 1024 << " MB, slack " << usage.slack / 1024 / 1024 << " MB" << std::endl;
+}
+
+// A table drained after a peak gives its pages back.
+TEST(MHASHMAP, MegaShrinkBench) {
+	mhashmap m;
+	for (uint64_t i = 1; i < kInsertIteration; ++i) {
+		m.insert(std::make_pair(i * 0x9e3779b97f4a7c15ULL, i));
+	}
+	for (uint64_t i = 1; i < kInsertIteration; ++i) {
+		if (i % 20 != 0) {
+			m.erase(i * 0x9e3779b97f4a7c15ULL);
+		}
+	}
+	size_t before = m.memory_usage().total();
+	auto start = std::chrono::steady_clock::now();
+	m.shrink_to_fit();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Shrink : " << before / 1024 / 1024 << " MB -> " << m.memory_usage().total() / 1024 / 1024
+		<< " MB in " << elapsed.count() << " s" << std::endl;
+	EXPECT_EQ((kInsertIteration - 1) / 20, m.size());
 }
 
 TEST(MHASHMAP, MegaRandomInsertBench) {
@@ -162,6 +730,282 @@ TEST(MHASHMAP, MegaLookupBench) {
 	}
 }
 
+TEST(MHASHMAP, MegaFindBatchBench) {
+	mhashmap m;
+	for (uint64_t i = 1; i < kInsertIteration; ++i) {
+		m.insert(std::make_pair(i, 1000ULL + i));
+	}
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, kInsertIteration - 1);
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kInsertIteration; ++i) {
+		keys.push_back(dist(eng));
+	}
+	std::vector<mhashpage::entry_t*> found(keys.size());
+
+	auto start = std::chrono::steady_clock::now();
+	m.find_batch(&keys[0], keys.size(), &found[0]);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "find_batch() : " << keys.size() / elapsed.count() / 1e6 << " M lookups/s" << std::endl;
+	EXPECT_NE(nullptr, found[0]);
+}
+
+TEST(MHASHMAP, MegaInsertParallelRebuildBench) {
+	mhashmap m;
+	m.set_rebuild_threads(std::max(1u, std::thread::hardware_concurrency()));
+
+	for (uint64_t i = 1; i < kInsertIteration; ++i) {
+		m.insert(std::make_pair(i, 1000ULL + i));
+	}
+	EXPECT_EQ(kInsertIteration - 1, m.size());
+}
+
+// Every 100th group of keys sharing the low 32 bits is larger than its four
+// candidate pages, so growing the table cannot help those groups.
+std::vector<uint64_t> make_skewed_keys() {
+	std::vector<uint64_t> keys;
+	for (uint64_t g = 0; g < 1000000; ++g) {
+		uint64_t low = static_cast<uint32_t>(g * 2654435761ULL);
+		uint64_t group_size = g % 100 == 0 ? 40 : 3;
+		for (uint64_t j = 0; j < group_size; ++j) {
+			keys.push_back((j << 32) | low);
+		}
+	}
+	std::shuffle(keys.begin(), keys.end(), std::default_random_engine());
+	return keys;
+}
+
+TEST(MHASHMAP, MegaSkewedInsertBench) {
+	std::vector<uint64_t> keys = make_skewed_keys();
+	mhashmap m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(std::make_pair(keys[i], i));
+	}
+	EXPECT_EQ(keys.size(), m.size());
+	std::cout << "Trees : " << m.num_trees() << " load : " << m.load_factor() << std::endl;
+}
+
+// An export scans a snapshot while the writer keeps changing 1% of the
+// keys; only the chunks it writes are copied.
+TEST(MHASHMAP, MegaSnapshotExportBench) {
+	const uint64_t kKeys = 4000000;
+	mhashmap m;
+	for (uint64_t i = 1; i <= kKeys; ++i) {
+		m.insert(std::make_pair(i * 0x9e3779b97f4a7c15ULL, i));
+	}
+	std::shared_ptr<const mhashmap_snapshot> s = m.snapshot();
+	uint64_t sum = 0;
+	uint64_t next = kKeys + 1;
+	uint64_t n = 0;
+	s->for_each([&](const mhashpage::entry_t& e) {
+		sum += e.second;
+		if (++n % 100 == 0) {
+			m.erase(e.first);
+			m.insert(std::make_pair(next * 0x9e3779b97f4a7c15ULL, next));
+			++next;
+		}
+	});
+	EXPECT_EQ(kKeys * (kKeys + 1) / 2, sum);
+	std::cout << "Copied : " << s->copied_bytes() << " of "
+		<< m.capacity() / mhashpage::num_max_entries * sizeof(mhashpage) << " bytes" << std::endl;
+}
+
+// A request-id cache: every epoch adds a batch of new ids, and ids older
+// than four epochs are stale.
+const uint64_t kCacheKeysPerEpoch = 500000;
+const uint64_t kCacheEpochs = 24;
+const uint64_t kCacheTtl = 4;
+
+TEST(MHASHMAP, MegaTtlCacheBench) {
+	mhashmap m;
+	m.set_ttl(kCacheTtl);
+	for (uint64_t epoch = 0; epoch < kCacheEpochs; ++epoch) {
+		for (uint64_t i = 0; i < kCacheKeysPerEpoch; ++i) {
+			uint64_t id = epoch * kCacheKeysPerEpoch + i + 1;
+			m.insert(std::make_pair(id * 0x9e3779b97f4a7c15ULL, epoch));
+			// Ten time slices cover the table once per epoch.
+			if (i % (kCacheKeysPerEpoch / 10) == 0) {
+				m.sweep(m.capacity() / mhashpage::num_max_entries / 10 + 1);
+			}
+		}
+		m.advance_epoch();
+	}
+	std::cout << "Size : " << m.size() << " capacity : " << m.capacity() << std::endl;
+}
+
+// The same cache expired by a full scan and per-key erase every epoch.
+TEST(MHASHMAP, MegaExternalExpiryBench) {
+	mhashmap m;
+	std::vector<uint64_t> stale;
+	for (uint64_t epoch = 0; epoch < kCacheEpochs; ++epoch) {
+		for (uint64_t i = 0; i < kCacheKeysPerEpoch; ++i) {
+			uint64_t id = epoch * kCacheKeysPerEpoch + i + 1;
+			m.insert(std::make_pair(id * 0x9e3779b97f4a7c15ULL, epoch));
+		}
+		stale.clear();
+		m.for_each([&](mhashpage::entry_t& e) {
+			if (e.second + kCacheTtl <= epoch) {
+				stale.push_back(e.first);
+			}
+		});
+		for (size_t i = 0; i < stale.size(); ++i) {
+			m.erase(stale[i]);
+		}
+	}
+	std::cout << "Size : " << m.size() << " capacity : " << m.capacity() << std::endl;
+}
+
+// Zipf(0.99) access trace over kTraceKeys keys.
+const size_t kTraceKeys = 2000000;
+const size_t kTraceLength = 5000000;
+
+std::vector<uint64_t>& access_trace() {
+	static std::vector<uint64_t> trace;
+	if (trace.empty()) {
+		std::vector<double> cdf;
+		double sum = 0;
+		for (size_t i = 1; i <= kTraceKeys; ++i) {
+			sum += 1.0 / std::pow(static_cast<double>(i), 0.99);
+			cdf.push_back(sum);
+		}
+		std::default_random_engine eng;
+		std::uniform_real_distribution<double> dist(0, sum);
+		for (size_t i = 0; i < kTraceLength; ++i) {
+			uint64_t rank = std::lower_bound(cdf.begin(), cdf.end(), dist(eng)) - cdf.begin();
+			trace.push_back((rank + 1) * 0x9e3779b97f4a7c15ULL);
+		}
+	}
+	return trace;
+}
+
+size_t lru_bytes = 0;
+
+template <typename T>
+struct counting_allocator {
+	typedef T value_type;
+	counting_allocator() {}
+	template <typename U>
+	counting_allocator(const counting_allocator<U>&) {}
+
+	T* allocate(size_t n) {
+		lru_bytes += n * sizeof(T);
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n) {
+		lru_bytes -= n * sizeof(T);
+		::operator delete(p);
+	}
+
+	template <typename U>
+	bool operator==(const counting_allocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const counting_allocator<U>&) const { return false; }
+};
+
+class lru_cache {
+public:
+	typedef std::list<uint64_t, counting_allocator<uint64_t> > list_t;
+
+	explicit lru_cache(size_t capacity) : capacity_(capacity) {}
+
+	// Returns true on a hit; a miss inserts the key.
+	bool access(uint64_t k) {
+		auto iter = map_.find(k);
+		if (iter != map_.end()) {
+			order_.splice(order_.begin(), order_, iter->second);
+			return true;
+		}
+		order_.push_front(k);
+		map_[k] = order_.begin();
+		if (map_.size() > capacity_) {
+			map_.erase(order_.back());
+			order_.pop_back();
+		}
+		return false;
+	}
+
+private:
+	size_t capacity_;
+	list_t order_;
+	std::unordered_map<uint64_t, list_t::iterator, std::hash<uint64_t>, std::equal_to<uint64_t>,
+		counting_allocator<std::pair<const uint64_t, list_t::iterator> > > map_;
+};
+
+TEST(MHASHMAP, CacheHitRate) {
+	const std::vector<uint64_t>& trace = access_trace();
+	for (int32_t pages = 1 << 11; pages <= 1 << 15; pages <<= 2) {
+		mhashmap m(pages);
+		m.set_cache_mode(nullptr);
+		size_t hits = 0;
+		for (size_t i = 0; i < trace.size(); ++i) {
+			if (m.find(trace[i]) != m.end()) {
+				++hits;
+			} else {
+				m.insert(std::make_pair(trace[i], i));
+			}
+		}
+
+		lru_bytes = 0;
+		size_t lru_hits = 0;
+		{
+			lru_cache lru(m.capacity());
+			for (size_t i = 0; i < trace.size(); ++i) {
+				lru_hits += lru.access(trace[i]);
+			}
+			std::cout << "Entries : " << m.capacity() <<
+				" clock : " << 100.0 * hits / trace.size() << "% " << pages * HASHPAGE_SIZE / 1024 << "KB" <<
+				" lru : " << 100.0 * lru_hits / trace.size() << "% " << lru_bytes / 1024 << "KB" << std::endl;
+		}
+	}
+}
+
+// Readers share one filled cache; each of them replays the whole trace.
+mhashmap& read_cache() {
+	static mhashmap* m = nullptr;
+	if (m == nullptr) {
+		m = new mhashmap(1 << 15);
+		m->set_cache_mode(nullptr);
+		const std::vector<uint64_t>& trace = access_trace();
+		for (size_t i = 0; i < trace.size(); ++i) {
+			if (m->find(trace[i]) == m->end()) {
+				m->insert(std::make_pair(trace[i], i));
+			}
+		}
+	}
+	return *m;
+}
+
+void concurrent_reads(int num_threads) {
+	mhashmap& m = read_cache();
+	const std::vector<uint64_t>& trace = access_trace();
+	std::vector<size_t> hits(num_threads);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < num_threads; ++t) {
+		threads.push_back(std::thread([&, t]() {
+			for (size_t i = 0; i < trace.size(); ++i) {
+				hits[t] += m.find(trace[i]) != m.end();
+			}
+		}));
+	}
+	for (int t = 0; t < num_threads; ++t) {
+		threads[t].join();
+	}
+	std::cout << "Hits : " << hits[0] << std::endl;
+}
+
+TEST(MHASHMAP, CacheFill) {
+	EXPECT_EQ(static_cast<size_t>(1 << 15) * mhashpage::num_max_entries, read_cache().size());
+}
+
+TEST(MHASHMAP, CacheRead1ThreadBench) {
+	concurrent_reads(1);
+}
+
+TEST(MHASHMAP, CacheRead4ThreadsBench) {
+	concurrent_reads(4);
+}
+
 TEST(unordered_map, MegaInsertBench) {
 	std::unordered_map<uint64_t, uint64_t> m;
 	for (uint64_t i = 1; i < kInsertIteration; ++i) {
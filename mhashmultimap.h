@@ -0,0 +1,200 @@
+#ifndef MHASHMULTIMAP_H_
+#define MHASHMULTIMAP_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "mhashmap.h"
+
+// Values of a heavy key beyond its table slots, chained from the newest
+// extent. One extent fills a cache line pair like an mhashpage.
+struct value_extent {
+	typedef uint64_t value_t;
+	static const int kMaxItem = (HASHPAGE_SIZE - 2 * sizeof(uint32_t)) / sizeof(value_t);
+	uint32_t next;
+	uint32_t size;
+	value_t item_[kMaxItem];
+};
+
+// One-to-many map on top of mhashmap. The first kMaxSlotsPerKey values of a
+// key take ordinary slots among the key's candidate pages, so the common
+// short lists are read by one walk of the pages found with a single
+// compute_hash. Further values go to a chain of value_extents whose head is
+// kept in a side index; only a key that fills all of its slots looks there.
+class mhashmultimap {
+public:
+	typedef uint64_t key_t;
+	typedef uint64_t value_t;
+	static const int kMaxSlotsPerKey = 4;
+	static const uint32_t kNoExtent = 0xffffffff;
+
+	// Forward iterator over the values of one key. Invalidated by any insert
+	// or erase.
+	class value_iterator {
+	public:
+		value_iterator()
+			: owner_(nullptr), key_(0), num_slots_(0), extent_(kNoExtent), pos_(0), value_(nullptr) {}
+
+		value_iterator(mhashmultimap* owner, const key_t& k)
+			: owner_(owner), cursor_(owner->table_.find_all(k)), key_(k),
+			  num_slots_(0), extent_(kNoExtent), pos_(0) {
+			advance();
+		}
+
+		value_t& operator *() { return *value_; }
+		const value_t& operator *() const { return *value_; }
+
+		value_iterator& operator++() {
+			advance();
+			return *this;
+		}
+
+		bool operator==(const value_iterator& rhs) const { return value_ == rhs.value_; }
+		bool operator!=(const value_iterator& rhs) const { return value_ != rhs.value_; }
+
+	private:
+		void advance() {
+			if (extent_ == kNoExtent) {
+				mhashpage::entry_t* e = cursor_.next();
+				if (e != nullptr) {
+					++num_slots_;
+					value_ = &e->second;
+					return;
+				}
+				if (num_slots_ == kMaxSlotsPerKey) {
+					extent_ = owner_->overflow_head(key_);
+					num_slots_ = 0;
+				}
+				pos_ = 0;
+			} else {
+				++pos_;
+			}
+			while (extent_ != kNoExtent) {
+				value_extent& x = owner_->extents_[extent_];
+				if (pos_ < x.size) {
+					value_ = &x.item_[pos_];
+					return;
+				}
+				extent_ = x.next;
+				pos_ = 0;
+			}
+			value_ = nullptr;
+		}
+
+		mhashmultimap* owner_;
+		mhashmap::key_cursor cursor_;
+		key_t key_;
+		int num_slots_;
+		uint32_t extent_;
+		uint32_t pos_;
+		value_t* value_;
+	};
+
+	struct value_range {
+		value_iterator first;
+		value_iterator second;
+
+		value_iterator begin() const { return first; }
+		value_iterator end() const { return second; }
+	};
+
+	mhashmultimap() : size_(0), free_extent_(kNoExtent) {}
+
+	size_t size() const { return size_; }
+	size_t num_keys_in_overflow() const { return overflow_.size(); }
+
+	void insert(const key_t& k, const value_t& v) {
+		mhashmap::key_cursor cursor = table_.find_all(k);
+		int num_slots = 0;
+		while (num_slots < kMaxSlotsPerKey && cursor.next() != nullptr) {
+			++num_slots;
+		}
+		if (num_slots < kMaxSlotsPerKey) {
+			table_.insert_duplicate(std::make_pair(k, v));
+		} else {
+			append_overflow(k, v);
+		}
+		++size_;
+	}
+
+	value_range equal_range(const key_t& k) {
+		value_range r = {value_iterator(this, k), value_iterator()};
+		return r;
+	}
+
+	size_t count(const key_t& k) {
+		size_t ret = 0;
+		for (value_iterator iter(this, k); iter != value_iterator(); ++iter) {
+			++ret;
+		}
+		return ret;
+	}
+
+	// Removes every value of |k| and returns how many there were.
+	size_t erase(const key_t& k) {
+		size_t ret = 0;
+		while (table_.erase(k)) {
+			++ret;
+		}
+		mhashmap::iterator iter = overflow_.find(k);
+		if (iter != overflow_.end()) {
+			uint32_t x = static_cast<uint32_t>(iter->second);
+			while (x != kNoExtent) {
+				uint32_t next = extents_[x].next;
+				ret += extents_[x].size;
+				extents_[x].next = free_extent_;
+				free_extent_ = x;
+				x = next;
+			}
+			overflow_.erase(k);
+		}
+		size_ -= ret;
+		return ret;
+	}
+
+private:
+	uint32_t overflow_head(const key_t& k) {
+		mhashmap::iterator iter = overflow_.find(k);
+		if (iter == overflow_.end()) {
+			return kNoExtent;
+		}
+		return static_cast<uint32_t>(iter->second);
+	}
+
+	uint32_t new_extent(uint32_t next) {
+		uint32_t x = free_extent_;
+		if (x != kNoExtent) {
+			free_extent_ = extents_[x].next;
+		} else {
+			x = static_cast<uint32_t>(extents_.size());
+			extents_.push_back(value_extent());
+		}
+		extents_[x].next = next;
+		extents_[x].size = 0;
+		return x;
+	}
+
+	void append_overflow(const key_t& k, const value_t& v) {
+		mhashmap::iterator iter = overflow_.find(k);
+		uint32_t x;
+		if (iter == overflow_.end()) {
+			x = new_extent(kNoExtent);
+			overflow_.insert(std::make_pair(k, static_cast<mhashmap::value_t>(x)));
+		} else {
+			x = static_cast<uint32_t>(iter->second);
+			if (extents_[x].size == value_extent::kMaxItem) {
+				x = new_extent(x);
+				iter->second = x;
+			}
+		}
+		extents_[x].item_[extents_[x].size++] = v;
+	}
+
+	mhashmap table_;
+	mhashmap overflow_;
+	std::vector<value_extent> extents_;
+	size_t size_;
+	uint32_t free_extent_;
+};
+
+#endif  // MHASHMULTIMAP_H_
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "mhashmultimap.h"
+
+TEST(mhashmultimap, CacheAlign) {
+	EXPECT_EQ(HASHPAGE_SIZE, sizeof(value_extent));
+}
+
+std::vector<uint64_t> values_of(mhashmultimap& m, uint64_t k) {
+	std::vector<uint64_t> ret;
+	for (uint64_t v : m.equal_range(k)) {
+		ret.push_back(v);
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+TEST(mhashmultimap, InsertAndEqualRange) {
+	mhashmultimap m;
+	m.insert(1, 10);
+	m.insert(2, 20);
+	m.insert(1, 11);
+	m.insert(1, 10);
+
+	EXPECT_EQ(4u, m.size());
+	EXPECT_EQ(std::vector<uint64_t>({10, 10, 11}), values_of(m, 1));
+	EXPECT_EQ(std::vector<uint64_t>({20}), values_of(m, 2));
+	EXPECT_TRUE(values_of(m, 3).empty());
+	EXPECT_EQ(0u, m.num_keys_in_overflow());
+}
+
+TEST(mhashmultimap, HeavyKeyOverflow) {
+	mhashmultimap m;
+	const uint64_t kValues = 1000;
+	for (uint64_t i = 0; i < kValues; ++i) {
+		m.insert(7, i);
+		m.insert(i + 100, i);
+	}
+	EXPECT_EQ(1u, m.num_keys_in_overflow());
+	std::vector<uint64_t> values = values_of(m, 7);
+	ASSERT_EQ(kValues, values.size());
+	for (uint64_t i = 0; i < kValues; ++i) {
+		EXPECT_EQ(i, values[i]);
+	}
+
+	EXPECT_EQ(kValues, m.erase(7));
+	EXPECT_EQ(0u, m.count(7));
+	EXPECT_EQ(0u, m.num_keys_in_overflow());
+	EXPECT_EQ(kValues, m.size());
+	EXPECT_EQ(1u, m.count(150));
+
+	// Freed extents are reused.
+	for (uint64_t i = 0; i < kValues; ++i) {
+		m.insert(8, i);
+	}
+	EXPECT_EQ(kValues, m.count(8));
+}
+
+// Keys sharing their low half share candidate pages, so their slots go to
+// an overflow tree where runs of one key can straddle extents, and their
+// further values fill several value_extents each.
+TEST(mhashmultimap, CollidingHeavyKeysErase) {
+	mhashmultimap m;
+	const uint64_t kKeys = 200;
+	const uint64_t kValues = 3 * value_extent::kMaxItem + mhashmultimap::kMaxSlotsPerKey;
+	for (uint64_t i = 0; i < kValues; ++i) {
+		for (uint64_t j = 1; j <= kKeys; ++j) {
+			m.insert((j << 32) | 7, i);
+		}
+	}
+	EXPECT_EQ(kKeys, m.num_keys_in_overflow());
+	for (uint64_t j = 1; j <= kKeys; ++j) {
+		ASSERT_EQ(kValues, values_of(m, (j << 32) | 7).size()) << j;
+	}
+
+	for (uint64_t j = 1; j <= kKeys; j += 2) {
+		EXPECT_EQ(kValues, m.erase((j << 32) | 7)) << j;
+		EXPECT_EQ(0u, m.count((j << 32) | 7)) << j;
+	}
+	EXPECT_EQ(kKeys / 2 * kValues, m.size());
+	for (uint64_t j = 2; j <= kKeys; j += 2) {
+		std::vector<uint64_t> values = values_of(m, (j << 32) | 7);
+		ASSERT_EQ(kValues, values.size()) << j;
+		for (uint64_t i = 0; i < kValues; ++i) {
+			EXPECT_EQ(i, values[i]);
+		}
+		EXPECT_EQ(kValues, m.erase((j << 32) | 7)) << j;
+	}
+	EXPECT_EQ(0u, m.size());
+	EXPECT_EQ(0u, m.num_keys_in_overflow());
+}
+
+// Key multiplicities follow a Zipf distribution over |num_keys| ranks.
+class zipf_keys {
+public:
+	zipf_keys(size_t num_keys, double s) {
+		double sum = 0;
+		for (size_t i = 1; i <= num_keys; ++i) {
+			sum += 1.0 / std::pow(static_cast<double>(i), s);
+			cdf_.push_back(sum);
+		}
+		for (auto& c : cdf_) {
+			c /= sum;
+		}
+	}
+
+	uint64_t operator()(std::default_random_engine& eng) {
+		double u = std::uniform_real_distribution<double>(0, 1)(eng);
+		size_t rank = std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+		return key_of(rank);
+	}
+
+	static uint64_t key_of(uint64_t rank) {
+		return (rank + 1) * 0x9e3779b97f4a7c15ULL;
+	}
+
+private:
+	std::vector<double> cdf_;
+};
+
+std::vector<uint64_t> make_zipf_keys(size_t n, size_t num_keys) {
+	std::default_random_engine eng;
+	zipf_keys zipf(num_keys, 1.0);
+	std::vector<uint64_t> keys(n);
+	for (auto& k : keys) {
+		k = zipf(eng);
+	}
+	return keys;
+}
+
+TEST(mhashmultimap, Zipf) {
+	std::vector<uint64_t> keys = make_zipf_keys(300000, 100000);
+	mhashmultimap m;
+	std::unordered_multimap<uint64_t, uint64_t> expected;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(keys[i], i);
+		expected.insert(std::make_pair(keys[i], i));
+	}
+	EXPECT_EQ(expected.size(), m.size());
+	EXPECT_LT(0u, m.num_keys_in_overflow());
+
+	for (uint64_t rank = 0; rank < 100000; rank += 7) {
+		uint64_t k = zipf_keys::key_of(rank);
+		std::vector<uint64_t> want;
+		auto range = expected.equal_range(k);
+		for (auto iter = range.first; iter != range.second; ++iter) {
+			want.push_back(iter->second);
+		}
+		std::sort(want.begin(), want.end());
+		ASSERT_EQ(want, values_of(m, k));
+	}
+
+	for (uint64_t rank = 0; rank < 1000; ++rank) {
+		uint64_t k = zipf_keys::key_of(rank);
+		EXPECT_EQ(expected.count(k), m.erase(k));
+		expected.erase(k);
+	}
+	EXPECT_EQ(expected.size(), m.size());
+	EXPECT_EQ(expected.count(zipf_keys::key_of(5000)), m.count(zipf_keys::key_of(5000)));
+}
+
+const size_t kBenchValues = 4000000;
+const size_t kBenchKeys = 1000000;
+
+std::vector<uint64_t>& bench_keys() {
+	static std::vector<uint64_t> keys = make_zipf_keys(kBenchValues, kBenchKeys);
+	return keys;
+}
+
+TEST(mhashmultimap, ZipfKeys) {
+	EXPECT_EQ(kBenchValues, bench_keys().size());
+}
+
+TEST(mhashmultimap, ZipfInsertAndScanBench) {
+	const std::vector<uint64_t>& keys = bench_keys();
+	mhashmultimap m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(keys[i], i);
+	}
+	uint64_t sum = 0;
+	for (uint64_t rank = 0; rank < kBenchKeys; ++rank) {
+		for (uint64_t v : m.equal_range(zipf_keys::key_of(rank))) {
+			sum += v;
+		}
+	}
+	std::cout << "Sum : " << sum << std::endl;
+}
+
+TEST(unordered_multimap, ZipfInsertAndScanBench) {
+	const std::vector<uint64_t>& keys = bench_keys();
+	std::unordered_multimap<uint64_t, uint64_t> m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(std::make_pair(keys[i], i));
+	}
+	uint64_t sum = 0;
+	for (uint64_t rank = 0; rank < kBenchKeys; ++rank) {
+		auto range = m.equal_range(zipf_keys::key_of(rank));
+		for (auto iter = range.first; iter != range.second; ++iter) {
+			sum += iter->second;
+		}
+	}
+	std::cout << "Sum : " << sum << std::endl;
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
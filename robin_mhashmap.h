@@ -0,0 +1,251 @@
+#ifndef ROBIN_MHASHMAP_H_
+#define ROBIN_MHASHMAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#define ROBIN_PAGE_SIZE 128
+
+// Page of robin_mhashmap. dist[i] is the number of pages entry i sits past
+// its home page.
+struct robin_page {
+	static const int num_max_entries = 7;
+	typedef uint64_t key_t;
+	typedef uint64_t value_t;
+	typedef std::pair<key_t, value_t> entry_t;
+	struct context {
+		uint8_t num_elements;
+		uint8_t dist[num_max_entries];
+		uint8_t padding__[8];
+	} cxt;
+	entry_t entries[num_max_entries];
+
+	bool full() const {
+		return cxt.num_elements == num_max_entries;
+	}
+
+	int find_index(const key_t& k) const {
+		for (int i = 0; i < cxt.num_elements; ++i) {
+			if (entries[i].first == k) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	// Slot of the entry closest to home, of a full page.
+	int richest() const {
+		int index = 0;
+		for (int i = 1; i < cxt.num_elements; ++i) {
+			if (cxt.dist[i] < cxt.dist[index]) {
+				index = i;
+			}
+		}
+		return index;
+	}
+
+	// Slot of the entry furthest from home, -1 if the page is empty.
+	int poorest() const {
+		int index = -1;
+		for (int i = 0; i < cxt.num_elements; ++i) {
+			if (index < 0 || cxt.dist[i] > cxt.dist[index]) {
+				index = i;
+			}
+		}
+		return index;
+	}
+
+	void append(const entry_t& e, int dist) {
+		entries[cxt.num_elements] = e;
+		cxt.dist[cxt.num_elements] = static_cast<uint8_t>(dist);
+		++cxt.num_elements;
+	}
+
+	void erase(int index) {
+		int last = --cxt.num_elements;
+		entries[index] = entries[last];
+		cxt.dist[index] = cxt.dist[last];
+	}
+};
+
+// Linear probing over adjacent pages with Robin Hood placement, as the
+// alternative to the four random candidate pages of mhashmap. An insert
+// that meets a full page takes the slot of its entry closest to home if
+// that entry is closer than the insert is, and carries the evicted entry
+// on. So every entry that probed past a page is at least as far from home
+// there as all entries of the page, and a lookup stops at the first page
+// that is not full or holds an entry closer to home than the key would be.
+// Erase shifts displaced entries back a page at a time to keep this.
+// Home pages come from the level 0 hash of mhashmap with the high half of
+// the key folded in, so keys below 2^32 land as they do in mhashmap, and
+// keys that differ only above bit 31 cannot pile up beyond what any growth
+// can spread.
+class robin_mhashmap {
+public:
+	typedef uint64_t key_t;
+	typedef uint64_t value_t;
+	typedef robin_page::entry_t entry_t;
+	typedef entry_t* iterator;
+
+	static const int32_t kInitialCapacity = 2;
+
+	robin_mhashmap() : max_dist_(0) {
+		init(kInitialCapacity);
+	}
+
+	~robin_mhashmap() {
+		free(page_);
+	}
+
+	size_t size() const { return num_entries_; }
+	size_t capacity() const { return capacity_ * robin_page::num_max_entries; }
+
+	int load_factor() const {
+		return num_entries_ * 1000LL / robin_page::num_max_entries / capacity_;
+	}
+
+	// Largest displacement any entry had since the last growth.
+	int max_displacement() const { return max_dist_; }
+
+	iterator find(const key_t& k) {
+		uint32_t p = home(k);
+		for (int d = 0; ; ++d) {
+			robin_page& page = page_[p];
+			int index = page.find_index(k);
+			if (index >= 0) {
+				return &page.entries[index];
+			}
+			if (!page.full() || page.cxt.dist[page.richest()] < d) {
+				return end();
+			}
+			p = (p + 1) & (capacity_ - 1);
+		}
+	}
+
+	iterator end() { return nullptr; }
+
+	void insert(const entry_t& element) {
+		if (find(element.first) != end()) {
+			return;
+		}
+		if (num_entries_ * 1000LL >= static_cast<int64_t>(capacity()) * load_factor_) {
+			rehash(capacity_ * 2);
+		}
+		entry_t e = element;
+		while (!place(e)) {
+			rehash(capacity_ * 2);
+		}
+		++num_entries_;
+	}
+
+	bool erase(const key_t& k) {
+		uint32_t p = home(k);
+		int index = -1;
+		for (int d = 0; ; ++d) {
+			index = page_[p].find_index(k);
+			if (index >= 0) {
+				break;
+			}
+			if (!page_[p].full() || page_[p].cxt.dist[page_[p].richest()] < d) {
+				return false;
+			}
+			p = (p + 1) & (capacity_ - 1);
+		}
+		page_[p].erase(index);
+		--num_entries_;
+
+		// Any displaced entry of the next page may fill the hole; entries
+		// further on did not probe past this page if none is displaced.
+		while (true) {
+			uint32_t next = (p + 1) & (capacity_ - 1);
+			int s = page_[next].poorest();
+			if (s < 0 || page_[next].cxt.dist[s] == 0) {
+				return true;
+			}
+			page_[p].append(page_[next].entries[s], page_[next].cxt.dist[s] - 1);
+			page_[next].erase(s);
+			p = next;
+		}
+	}
+
+private:
+	// Grows rather than let an entry drift further than this from home.
+	static const int kMaxDisplacement = 64;
+
+	// 90% occupancy
+	static const uint32_t load_factor_ = 900;
+
+	void init(int32_t capacity) {
+		capacity_ = capacity;
+		num_entries_ = 0;
+		size_t alloc_size = sizeof(robin_page) * capacity_;
+		if (posix_memalign(reinterpret_cast<void**>(&page_), ROBIN_PAGE_SIZE, alloc_size) != 0) {
+			abort();
+		}
+		memset(static_cast<void*>(page_), 0, alloc_size);
+	}
+
+	uint32_t home(const key_t& k) const {
+		return (static_cast<uint32_t>(k ^ (k >> 32)) + 1923775UL) * 512775UL & (capacity_ - 1);
+	}
+
+	// Places |e| or, once an entry would sit more than kMaxDisplacement
+	// pages from home, returns false with |e| set to the entry left over.
+	bool place(entry_t& e) {
+		uint32_t p = home(e.first);
+		int d = 0;
+		while (d <= kMaxDisplacement) {
+			robin_page& page = page_[p];
+			if (!page.full()) {
+				page.append(e, d);
+				max_dist_ = std::max(max_dist_, d);
+				return true;
+			}
+			int r = page.richest();
+			if (page.cxt.dist[r] < d) {
+				int evicted = page.cxt.dist[r];
+				std::swap(e, page.entries[r]);
+				page.cxt.dist[r] = static_cast<uint8_t>(d);
+				max_dist_ = std::max(max_dist_, d);
+				d = evicted;
+			}
+			++d;
+			p = (p + 1) & (capacity_ - 1);
+		}
+		return false;
+	}
+
+	void rehash(int32_t capacity) {
+		robin_page* old_page = page_;
+		int32_t old_capacity = capacity_;
+		int32_t num_entries = num_entries_;
+		while (true) {
+			init(capacity);
+			max_dist_ = 0;
+			bool placed = true;
+			for (int32_t i = 0; placed && i < old_capacity; ++i) {
+				for (int j = 0; placed && j < old_page[i].cxt.num_elements; ++j) {
+					entry_t e = old_page[i].entries[j];
+					placed = place(e);
+				}
+			}
+			if (placed) {
+				break;
+			}
+			free(page_);
+			capacity *= 2;
+		}
+		num_entries_ = num_entries;
+		free(old_page);
+	}
+
+	robin_page* page_;
+	int32_t capacity_;
+	int32_t num_entries_;
+	int max_dist_;
+};
+
+#endif  // ROBIN_MHASHMAP_H_
@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "mhashmap.h"
+#include "robin_mhashmap.h"
+
+TEST(robin_mhashmap, CacheAlign) {
+	EXPECT_EQ(ROBIN_PAGE_SIZE, sizeof(robin_page));
+}
+
+TEST(robin_mhashmap, InsertFindErase) {
+	robin_mhashmap m;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		m.insert(std::make_pair(i, i + 1000));
+	}
+	m.insert(std::make_pair(5ULL, 0ULL));
+	EXPECT_EQ(19999u, m.size());
+	EXPECT_EQ(1005u, m.find(5)->second);
+
+	for (uint64_t i = 1; i < 20000; i += 2) {
+		EXPECT_TRUE(m.erase(i)) << i;
+	}
+	EXPECT_FALSE(m.erase(1));
+	EXPECT_FALSE(m.erase(20001));
+
+	for (uint64_t i = 1; i < 20000; ++i) {
+		robin_mhashmap::iterator iter = m.find(i);
+		if (i % 2 == 1) {
+			EXPECT_EQ(m.end(), iter) << i;
+		} else {
+			ASSERT_NE(m.end(), iter) << i;
+			EXPECT_EQ(i + 1000, iter->second);
+		}
+	}
+}
+
+// Fills the table to just below its growth threshold, where runs of full
+// pages are long, then erases and inserts in turn so erases keep shifting
+// entries back across those runs.
+TEST(robin_mhashmap, InsertEraseChurn) {
+	robin_mhashmap m;
+	std::unordered_map<uint64_t, uint64_t> expected;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	while (m.size() < 1000 || m.load_factor() < 890) {
+		uint64_t k = dist(eng);
+		m.insert(std::make_pair(k, k));
+		expected[k] = k;
+		keys.push_back(k);
+	}
+	size_t capacity = m.capacity();
+	for (int round = 0; round < 200000; ++round) {
+		size_t i = dist(eng) % keys.size();
+		EXPECT_TRUE(m.erase(keys[i])) << keys[i];
+		expected.erase(keys[i]);
+		keys[i] = dist(eng);
+		m.insert(std::make_pair(keys[i], keys[i]));
+		expected[keys[i]] = keys[i];
+	}
+	EXPECT_EQ(capacity, m.capacity());
+	EXPECT_EQ(expected.size(), m.size());
+	for (const auto& e : expected) {
+		robin_mhashmap::iterator iter = m.find(e.first);
+		ASSERT_NE(m.end(), iter) << e.first;
+		EXPECT_EQ(e.second, iter->second);
+	}
+	std::cout << "Load : " << m.load_factor() << " max displacement : " << m.max_displacement() << std::endl;
+}
+
+TEST(robin_mhashmap, MegaRandomInsert) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::unordered_map<uint64_t, uint64_t> expected;
+	robin_mhashmap m;
+	for (int i = 0; i < 1000000; ++i) {
+		uint64_t k = dist(eng);
+		if (expected.insert(std::make_pair(k, i)).second) {
+			m.insert(std::make_pair(k, static_cast<uint64_t>(i)));
+		}
+	}
+	EXPECT_EQ(expected.size(), m.size());
+	for (const auto& e : expected) {
+		robin_mhashmap::iterator iter = m.find(e.first);
+		ASSERT_NE(m.end(), iter);
+		EXPECT_EQ(e.second, iter->second);
+	}
+	std::cout << "Load : " << m.load_factor() << " max displacement : " << m.max_displacement() << std::endl;
+}
+
+// The same workloads run against both policies through the API they share.
+const uint64_t kBenchKeys = 20000000;
+
+std::vector<uint64_t> sequential_keys() {
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 1; i <= kBenchKeys; ++i) {
+		keys.push_back(i);
+	}
+	return keys;
+}
+
+std::vector<uint64_t> random_keys() {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<uint64_t> keys;
+	for (uint64_t i = 0; i < kBenchKeys; ++i) {
+		keys.push_back(dist(eng));
+	}
+	return keys;
+}
+
+template <typename Map>
+void insert_all(Map& m, const std::vector<uint64_t>& keys) {
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(std::make_pair(keys[i], keys[i]));
+	}
+	EXPECT_LE(keys.size() * 99 / 100, m.size());
+}
+
+template <typename Map>
+void lookup_all(Map& m, std::vector<uint64_t> keys) {
+	insert_all(m, keys);
+	std::shuffle(keys.begin(), keys.end(), std::default_random_engine());
+	auto start = std::chrono::steady_clock::now();
+	uint64_t sum = 0;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		typename Map::iterator iter = m.find(keys[i]);
+		if (iter != m.end()) {
+			sum += iter->second;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Lookups : " << keys.size() / elapsed.count() / 1e6 << " M/s, load : " << m.load_factor()
+		<< ", sum : " << sum << std::endl;
+}
+
+TEST(MHASHMAP, SequentialInsertBench) {
+	mhashmap m;
+	insert_all(m, sequential_keys());
+}
+
+TEST(robin_mhashmap, SequentialInsertBench) {
+	robin_mhashmap m;
+	insert_all(m, sequential_keys());
+	std::cout << "Max displacement : " << m.max_displacement() << std::endl;
+}
+
+TEST(MHASHMAP, RandomInsertBench) {
+	mhashmap m;
+	insert_all(m, random_keys());
+}
+
+TEST(robin_mhashmap, RandomInsertBench) {
+	robin_mhashmap m;
+	insert_all(m, random_keys());
+	std::cout << "Max displacement : " << m.max_displacement() << std::endl;
+}
+
+TEST(MHASHMAP, SequentialLookupBench) {
+	mhashmap m;
+	lookup_all(m, sequential_keys());
+}
+
+TEST(robin_mhashmap, SequentialLookupBench) {
+	robin_mhashmap m;
+	lookup_all(m, sequential_keys());
+}
+
+TEST(MHASHMAP, RandomLookupBench) {
+	mhashmap m;
+	lookup_all(m, random_keys());
+}
+
+TEST(robin_mhashmap, RandomLookupBench) {
+	robin_mhashmap m;
+	lookup_all(m, random_keys());
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,411 @@
+#ifndef SEPARATED_MHASHMAP_H_
+#define SEPARATED_MHASHMAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <emmintrin.h>
+
+// Fixed-size value records stored in slabs. Each record starts with the key
+// that owns it, so removing a record can fill the hole with the last record
+// and keep the log dense.
+class value_log {
+public:
+	typedef uint64_t key_t;
+	typedef uint32_t handle_t;
+	static const int kSlabShift = 12;
+	static const uint32_t kSlabRecords = 1 << kSlabShift;
+
+	explicit value_log(size_t value_size)
+		: value_size_(value_size),
+		  stride_((sizeof(key_t) + value_size + 7) & ~static_cast<size_t>(7)),
+		  size_(0) {}
+
+	~value_log() {
+		for (size_t i = 0; i < slabs_.size(); ++i) {
+			free(slabs_[i]);
+		}
+	}
+
+	handle_t append(const key_t& k, const void* value) {
+		if ((size_ >> kSlabShift) == slabs_.size()) {
+			slabs_.push_back(reinterpret_cast<char*>(malloc(stride_ * kSlabRecords)));
+		}
+		handle_t h = size_++;
+		char* r = record(h);
+		memcpy(r, &k, sizeof(key_t));
+		memcpy(r + sizeof(key_t), value, value_size_);
+		return h;
+	}
+
+	// Moves the last record into |h|. Returns true and the key of the moved
+	// record when a record changed its handle.
+	bool remove(handle_t h, key_t* moved) {
+		handle_t last = --size_;
+		bool relocated = false;
+		if (h != last) {
+			memcpy(record(h), record(last), stride_);
+			memcpy(moved, record(h), sizeof(key_t));
+			relocated = true;
+		}
+
+		// Keep one spare slab so that churn at a slab boundary does not
+		// allocate on every insert.
+		size_t used_slabs = (size_ + kSlabRecords - 1) >> kSlabShift;
+		while (slabs_.size() > used_slabs + 1) {
+			free(slabs_.back());
+			slabs_.pop_back();
+		}
+		return relocated;
+	}
+
+	void* value(handle_t h) {
+		return record(h) + sizeof(key_t);
+	}
+
+	key_t key(handle_t h) {
+		key_t k;
+		memcpy(&k, record(h), sizeof(key_t));
+		return k;
+	}
+
+	void prefetch(handle_t h) {
+		const char* r = record(h);
+		for (size_t offset = 0; offset < stride_; offset += 64) {
+			_mm_prefetch(r + offset, _MM_HINT_T0);
+		}
+	}
+
+	size_t size() const { return size_; }
+	size_t value_size() const { return value_size_; }
+	size_t memory_usage() const { return slabs_.size() * stride_ * kSlabRecords; }
+
+private:
+	char* record(handle_t h) {
+		return slabs_[h >> kSlabShift] + (h & (kSlabRecords - 1)) * stride_;
+	}
+
+	const char* record(handle_t h) const {
+		return slabs_[h >> kSlabShift] + (h & (kSlabRecords - 1)) * stride_;
+	}
+
+	size_t value_size_;
+	size_t stride_;
+	uint32_t size_;
+	std::vector<char*> slabs_;
+};
+
+// Page of key_index: ten keys and their 32-bit handles in one 128 byte
+// line, where an mhashpage holds seven key/value pairs.
+struct key_handle_page {
+	static const int kMaxEntries = 10;
+	typedef uint64_t key_t;
+	typedef uint32_t handle_t;
+	struct context {
+		uint8_t num_elements;
+		uint8_t padding__;
+		// Bit i is set when entry i sits in the second candidate of its key.
+		uint16_t second;
+		// Entries that have this page as first candidate and sit in their
+		// second. A lookup that misses here stops unless this is nonzero.
+		uint32_t foreign_placed;
+	} cxt;
+	key_t keys[kMaxEntries];
+	handle_t handles[kMaxEntries];
+
+	bool full() const {
+		return cxt.num_elements == kMaxEntries;
+	}
+
+	int find_index(const key_t& k) const {
+		for (int i = 0; i < cxt.num_elements; ++i) {
+			if (keys[i] == k) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	bool second(int index) const {
+		return (cxt.second >> index) & 1;
+	}
+
+	void place(int index, const key_t& k, handle_t h, bool second) {
+		keys[index] = k;
+		handles[index] = h;
+		cxt.second = static_cast<uint16_t>((cxt.second & ~(1u << index)) | (second ? 1u << index : 0));
+	}
+
+	void append(const key_t& k, handle_t h, bool second) {
+		place(cxt.num_elements++, k, h, second);
+	}
+
+	void erase(int index) {
+		int last = --cxt.num_elements;
+		place(index, keys[last], handles[last], this->second(last));
+	}
+};
+
+// Keys and handles only, in pages of two-choice bucketized cuckoo hashing.
+// A key goes to its first candidate page, else to its second, else takes
+// the slot of a random entry of one of them, which moves on to its other
+// candidate, for at most kMaxKicks moves before the table doubles.
+class key_index {
+public:
+	typedef uint64_t key_t;
+	typedef uint32_t handle_t;
+
+	static const uint32_t kInitialCapacity = 2;
+
+	key_index() : rand_(88172645463325252ULL) {
+		init(kInitialCapacity);
+	}
+
+	~key_index() {
+		free(page_);
+	}
+
+	size_t size() const { return size_; }
+	size_t memory_usage() const { return sizeof(key_handle_page) * capacity_; }
+
+	// Pages whose misses go on to probe a second page.
+	size_t overflow_rate() const {
+		size_t num_overflow = 0;
+		for (uint32_t i = 0; i < capacity_; ++i) {
+			if (page_[i].cxt.foreign_placed != 0) {
+				++num_overflow;
+			}
+		}
+		return num_overflow;
+	}
+
+	handle_t* find(const key_t& k) {
+		key_handle_page& first = page_[page_index(k, 0)];
+		int i = first.find_index(k);
+		if (i >= 0) {
+			return &first.handles[i];
+		}
+		if (first.cxt.foreign_placed == 0) {
+			return nullptr;
+		}
+		key_handle_page& second = page_[page_index(k, 1)];
+		i = second.find_index(k);
+		return i < 0 ? nullptr : &second.handles[i];
+	}
+
+	void prefetch(const key_t& k) const {
+		const char* p = reinterpret_cast<const char*>(&page_[page_index(k, 0)]);
+		_mm_prefetch(p, _MM_HINT_T0);
+		_mm_prefetch(p + 64, _MM_HINT_T0);
+	}
+
+	// |k| must not be in the index.
+	void insert(const key_t& k, handle_t h) {
+		if (static_cast<uint64_t>(size_) * 1000 >= static_cast<uint64_t>(capacity_) * key_handle_page::kMaxEntries * load_factor_) {
+			rehash(capacity_ * 2);
+		}
+		std::pair<key_t, handle_t> e(k, h);
+		while (!place(e)) {
+			rehash(capacity_ * 2);
+		}
+		++size_;
+	}
+
+	bool erase(const key_t& k) {
+		uint32_t first = page_index(k, 0);
+		int i = page_[first].find_index(k);
+		if (i >= 0) {
+			// Both candidates may be this page.
+			if (page_[first].second(i)) {
+				--page_[first].cxt.foreign_placed;
+			}
+			page_[first].erase(i);
+			--size_;
+			return true;
+		}
+		if (page_[first].cxt.foreign_placed == 0) {
+			return false;
+		}
+		key_handle_page& second = page_[page_index(k, 1)];
+		i = second.find_index(k);
+		if (i < 0) {
+			return false;
+		}
+		second.erase(i);
+		--page_[first].cxt.foreign_placed;
+		--size_;
+		return true;
+	}
+
+private:
+	static const uint64_t load_factor_ = 900;
+	static const int kMaxKicks = 64;
+
+	void init(uint32_t capacity) {
+		capacity_ = capacity;
+		shift_ = 64;
+		while ((1u << (64 - shift_)) < capacity) {
+			--shift_;
+		}
+		size_ = 0;
+		size_t alloc_size = sizeof(key_handle_page) * capacity_;
+		if (posix_memalign(reinterpret_cast<void**>(&page_), sizeof(key_handle_page), alloc_size) != 0) {
+			abort();
+		}
+		memset(static_cast<void*>(page_), 0, alloc_size);
+	}
+
+	// Fibonacci hashing on the high bits of the product, so every key bit
+	// reaches the page index.
+	uint32_t page_index(const key_t& k, int level) const {
+		static const uint64_t kMult[2] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL};
+		return static_cast<uint32_t>((k * kMult[level]) >> shift_);
+	}
+
+	// Places |e| or returns false with |e| set to the entry left over.
+	bool place(std::pair<key_t, handle_t>& e) {
+		for (int kick = 0; kick <= kMaxKicks; ++kick) {
+			uint32_t first = page_index(e.first, 0);
+			uint32_t second = page_index(e.first, 1);
+			if (!page_[first].full()) {
+				page_[first].append(e.first, e.second, false);
+				return true;
+			}
+			if (!page_[second].full()) {
+				page_[second].append(e.first, e.second, true);
+				++page_[first].cxt.foreign_placed;
+				return true;
+			}
+			if (kick == kMaxKicks) {
+				break;
+			}
+			rand_ ^= rand_ << 13;
+			rand_ ^= rand_ >> 7;
+			rand_ ^= rand_ << 17;
+			bool to_second = rand_ & 1;
+			key_handle_page& page = page_[to_second ? second : first];
+			int slot = static_cast<int>((rand_ >> 1) % key_handle_page::kMaxEntries);
+			std::pair<key_t, handle_t> evicted(page.keys[slot], page.handles[slot]);
+			if (page.second(slot)) {
+				--page_[page_index(evicted.first, 0)].cxt.foreign_placed;
+			}
+			page.place(slot, e.first, e.second, to_second);
+			if (to_second) {
+				++page_[first].cxt.foreign_placed;
+			}
+			e = evicted;
+		}
+		return false;
+	}
+
+	void rehash(uint32_t capacity) {
+		key_handle_page* old_page = page_;
+		uint32_t old_capacity = capacity_;
+		uint32_t size = size_;
+		while (true) {
+			init(capacity);
+			bool placed = true;
+			for (uint32_t i = 0; placed && i < old_capacity; ++i) {
+				for (int j = 0; placed && j < old_page[i].cxt.num_elements; ++j) {
+					std::pair<key_t, handle_t> e(old_page[i].keys[j], old_page[i].handles[j]);
+					placed = place(e);
+				}
+			}
+			if (placed) {
+				break;
+			}
+			free(page_);
+			capacity *= 2;
+		}
+		size_ = size;
+		free(old_page);
+	}
+
+	key_handle_page* page_;
+	uint32_t capacity_;
+	uint32_t size_;
+	int shift_;
+	uint64_t rand_;
+};
+
+// Key index whose entries are 32-bit handles into a value_log. Large values
+// do not dilute the pages, and ten keys share a line where an mhashmap page
+// holds seven, so a probe touches one dense line of keys and only a hit pays
+// for the value line.
+class separated_mhashmap {
+public:
+	typedef uint64_t key_t;
+	typedef value_log::handle_t handle_t;
+
+	explicit separated_mhashmap(size_t value_size) : log_(value_size) {}
+
+	size_t size() const { return index_.size(); }
+	size_t value_size() const { return log_.value_size(); }
+
+	// Copies value_size() bytes from |value|. An existing key is overwritten.
+	void insert(const key_t& k, const void* value) {
+		handle_t* h = index_.find(k);
+		if (h != nullptr) {
+			memcpy(log_.value(*h), value, log_.value_size());
+			return;
+		}
+		index_.insert(k, log_.append(k, value));
+	}
+
+	void* find(const key_t& k) {
+		handle_t* h = index_.find(k);
+		return h == nullptr ? nullptr : log_.value(*h);
+	}
+
+	// Prefetches the index pages of a group of keys, then resolves them and
+	// prefetches every value of the group before any value is read, so the
+	// misses of the group overlap.
+	void find_batch(const key_t* keys, size_t n, void** values) {
+		handle_t* found[kFindBatch];
+		for (size_t begin = 0; begin < n; begin += kFindBatch) {
+			size_t end = std::min(n, begin + kFindBatch);
+			for (size_t i = begin; i < end; ++i) {
+				index_.prefetch(keys[i]);
+			}
+			for (size_t i = begin; i < end; ++i) {
+				found[i - begin] = index_.find(keys[i]);
+				if (found[i - begin] != nullptr) {
+					log_.prefetch(*found[i - begin]);
+				}
+			}
+			for (size_t i = begin; i < end; ++i) {
+				values[i] = found[i - begin] == nullptr ? nullptr : log_.value(*found[i - begin]);
+			}
+		}
+	}
+
+	bool erase(const key_t& k) {
+		handle_t* found = index_.find(k);
+		if (found == nullptr) {
+			return false;
+		}
+		handle_t h = *found;
+		index_.erase(k);
+
+		key_t moved;
+		if (log_.remove(h, &moved)) {
+			*index_.find(moved) = h;
+		}
+		return true;
+	}
+
+	const key_index& index() const { return index_; }
+	const value_log& log() const { return log_; }
+
+private:
+	static const size_t kFindBatch = 16;
+
+	key_index index_;
+	value_log log_;
+};
+
+#endif  // SEPARATED_MHASHMAP_H_
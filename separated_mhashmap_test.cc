@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "mhashmap.h"
+#include "separated_mhashmap.h"
+
+TEST(value_log, AppendAndRemove) {
+	value_log log(48);
+	char buf[48];
+	for (uint64_t i = 0; i < 3 * value_log::kSlabRecords; ++i) {
+		memset(buf, static_cast<int>(i), sizeof(buf));
+		EXPECT_EQ(i, log.append(i, buf));
+	}
+
+	uint64_t moved;
+	ASSERT_TRUE(log.remove(5, &moved));
+	EXPECT_EQ(3 * value_log::kSlabRecords - 1, moved);
+	EXPECT_EQ(moved, log.key(5));
+	EXPECT_EQ(static_cast<char>(moved), reinterpret_cast<char*>(log.value(5))[47]);
+
+	EXPECT_FALSE(log.remove(static_cast<value_log::handle_t>(log.size() - 1), &moved));
+	EXPECT_EQ(3 * value_log::kSlabRecords - 2, log.size());
+}
+
+TEST(key_index, CacheAlign) {
+	EXPECT_EQ(128u, sizeof(key_handle_page));
+}
+
+// Keys that differ only in their high half, or in bits above the page
+// index, still spread.
+TEST(key_index, RandomChurn) {
+	key_index index;
+	std::unordered_map<uint64_t, uint32_t> ref;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, 50000);
+	for (int i = 0; i < 1000000; ++i) {
+		uint64_t k = dist(eng);
+		k = i % 2 == 0 ? k << 32 : k << 12;
+		if (i % 3 == 0) {
+			EXPECT_EQ(ref.erase(k) == 1, index.erase(k)) << k;
+		} else if (ref.count(k) == 0) {
+			ref[k] = static_cast<uint32_t>(i);
+			index.insert(k, static_cast<uint32_t>(i));
+		}
+	}
+	EXPECT_EQ(ref.size(), index.size());
+	for (auto& item : ref) {
+		uint32_t* h = index.find(item.first);
+		ASSERT_NE(nullptr, h) << item.first;
+		EXPECT_EQ(item.second, *h);
+	}
+	EXPECT_EQ(nullptr, index.find(1));
+}
+
+// A key whose two candidates are the same page can still be kicked to its
+// second; erasing it has to drop the page's foreign count all the same.
+TEST(key_index, EraseLeavesNoOverflow) {
+	key_index index;
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	for (int round = 0; round < 1000; ++round) {
+		std::vector<uint64_t> keys;
+		for (int i = 0; i < 20; ++i) {
+			keys.push_back(dist(eng));
+			index.insert(keys.back(), static_cast<uint32_t>(i));
+		}
+		for (uint64_t k : keys) {
+			ASSERT_TRUE(index.erase(k)) << round;
+		}
+		ASSERT_EQ(0u, index.size());
+		ASSERT_EQ(0u, index.overflow_rate()) << round;
+	}
+}
+
+// Ten keys to a line instead of seven.
+TEST(key_index, Density) {
+	key_index index;
+	mhashmap m;
+	for (uint64_t i = 1; i <= 1000000; ++i) {
+		index.insert(i * 7919, static_cast<uint32_t>(i));
+		m.insert(std::make_pair(i * 7919, i));
+	}
+	std::cout << "key_index : " << index.memory_usage() / 1024 << " KB, mhashmap : "
+		<< m.memory_usage().total() / 1024 << " KB" << std::endl;
+	EXPECT_LT(index.memory_usage(), m.memory_usage().total());
+}
+
+TEST(separated_mhashmap, InsertFindErase) {
+	separated_mhashmap m(200);
+	char buf[200];
+	for (uint64_t i = 1; i < 10000; ++i) {
+		memset(buf, static_cast<int>(i), sizeof(buf));
+		m.insert(i, buf);
+	}
+	EXPECT_EQ(9999u, m.size());
+
+	for (uint64_t i = 1; i < 10000; i += 3) {
+		EXPECT_TRUE(m.erase(i)) << i;
+	}
+	EXPECT_FALSE(m.erase(1));
+	EXPECT_EQ(m.size(), m.log().size());
+
+	for (uint64_t i = 1; i < 10000; ++i) {
+		char* v = reinterpret_cast<char*>(m.find(i));
+		if (i % 3 == 1) {
+			EXPECT_EQ(nullptr, v) << i;
+		} else {
+			ASSERT_NE(nullptr, v) << i;
+			EXPECT_EQ(static_cast<char>(i), v[0]);
+			EXPECT_EQ(static_cast<char>(i), v[199]);
+		}
+	}
+
+	memset(buf, 'x', sizeof(buf));
+	m.insert(2, buf);
+	EXPECT_EQ('x', reinterpret_cast<char*>(m.find(2))[100]);
+}
+
+TEST(separated_mhashmap, RandomChurn) {
+	const size_t kValueSize = 64;
+	separated_mhashmap m(kValueSize);
+	std::unordered_map<uint64_t, std::string> ref;
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, 100000);
+	for (int i = 0; i < 1000000; ++i) {
+		uint64_t k = dist(eng);
+		if (i % 3 == 0) {
+			EXPECT_EQ(ref.erase(k) == 1, m.erase(k)) << k;
+		} else {
+			std::string v(kValueSize, static_cast<char>(i));
+			ref[k] = v;
+			m.insert(k, v.data());
+		}
+	}
+
+	EXPECT_EQ(ref.size(), m.size());
+	for (auto& item : ref) {
+		void* v = m.find(item.first);
+		ASSERT_NE(nullptr, v) << item.first;
+		EXPECT_EQ(0, memcmp(item.second.data(), v, kValueSize));
+	}
+}
+
+const uint64_t kNumRecords = 4000000;
+const size_t kRecordSize = 128;
+const int kBatch = 16;
+
+TEST(separated_mhashmap, LookupBench) {
+	separated_mhashmap m(kRecordSize);
+	char buf[kRecordSize] = {0};
+	for (uint64_t i = 1; i <= kNumRecords; ++i) {
+		buf[0] = static_cast<char>(i);
+		m.insert(i, buf);
+	}
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, kNumRecords);
+	uint64_t keys[kBatch];
+	void* values[kBatch];
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < kNumRecords * 3; i += kBatch) {
+		for (int j = 0; j < kBatch; ++j) {
+			keys[j] = dist(eng);
+		}
+		m.find_batch(keys, kBatch, values);
+		for (int j = 0; j < kBatch; ++j) {
+			sum += reinterpret_cast<char*>(values[j])[0];
+		}
+	}
+	std::cout << "Value log memory : " << m.log().memory_usage() / 1024 / 1024 << " MB ("
+		<< sum << ")" << std::endl;
+}
+
+// The layout this mode replaces: an index into a side vector of records.
+TEST(mhashmap_side_vector, LookupBench) {
+	mhashmap m;
+	std::vector<char> records(kNumRecords * kRecordSize);
+	for (uint64_t i = 1; i <= kNumRecords; ++i) {
+		records[(i - 1) * kRecordSize] = static_cast<char>(i);
+		m.insert(std::make_pair(i, i - 1));
+	}
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist(1, kNumRecords);
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < kNumRecords * 3; ++i) {
+		mhashmap::iterator iter = m.find(dist(eng));
+		sum += records[iter->second * kRecordSize];
+	}
+	std::cout << "(" << sum << ")" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,221 @@
+#ifndef SHARDED_MHASHMAP_H_
+#define SHARDED_MHASHMAP_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "mhashmap.h"
+
+// A shard owns its own line so that workers filling neighbouring shards do
+// not share cache lines.
+struct alignas(HASHPAGE_SIZE) mhashmap_shard {
+	mhashmap map;
+};
+
+// Routes keys by the high bits of a 64-bit mix to independent mhashmap
+// shards. Threads build into private local_builders without locks, and
+// merge() then combines the builders shard by shard in parallel. No shard is
+// ever touched by two threads at once, so the shards need no locking.
+class sharded_mhashmap {
+public:
+	typedef mhashmap::key_t key_t;
+	typedef mhashmap::value_t value_t;
+	typedef mhashpage::entry_t entry_t;
+
+	// Keeps the value already present.
+	struct keep_first {
+		value_t operator()(const value_t& existing, const value_t&) const {
+			return existing;
+		}
+	};
+
+	// Per-thread partial table with the same routing as its owner.
+	class local_builder {
+	public:
+		explicit local_builder(const sharded_mhashmap& owner)
+			: shard_bits_(owner.shard_bits_), shards_(new mhashmap[owner.num_shards()]) {}
+
+		~local_builder() {
+			delete[] shards_;
+		}
+
+		template <typename Combine>
+		void insert(const entry_t& e, Combine combine) {
+			upsert(shards_[shard_of(e.first, shard_bits_)], e, combine);
+		}
+
+		void insert(const entry_t& e) {
+			insert(e, keep_first());
+		}
+
+		mhashmap& shard(int s) { return shards_[s]; }
+
+	private:
+		local_builder(const local_builder&);
+		local_builder& operator=(const local_builder&);
+
+		int shard_bits_;
+		mhashmap* shards_;
+	};
+
+	// |num_shards| is rounded up to a power of two.
+	explicit sharded_mhashmap(int num_shards) {
+		shard_bits_ = 0;
+		while ((1 << shard_bits_) < num_shards) {
+			++shard_bits_;
+		}
+		void* mem = nullptr;
+		if (posix_memalign(&mem, HASHPAGE_SIZE, sizeof(mhashmap_shard) * this->num_shards()) != 0) {
+			throw std::bad_alloc();
+		}
+		shards_ = static_cast<mhashmap_shard*>(mem);
+		for (int i = 0; i < this->num_shards(); ++i) {
+			new (&shards_[i]) mhashmap_shard();
+		}
+	}
+
+	~sharded_mhashmap() {
+		for (int i = 0; i < num_shards(); ++i) {
+			shards_[i].~mhashmap_shard();
+		}
+		free(shards_);
+	}
+
+	int num_shards() const { return 1 << shard_bits_; }
+
+	size_t size() const {
+		size_t ret = 0;
+		for (int i = 0; i < num_shards(); ++i) {
+			ret += shards_[i].map.size();
+		}
+		return ret;
+	}
+
+	mhashmap& shard(int s) { return shards_[s].map; }
+
+	void insert(const entry_t& e) {
+		shards_[shard_of(e.first, shard_bits_)].map.insert(e);
+	}
+
+	entry_t* find(const key_t& k) {
+		mhashmap& m = shards_[shard_of(k, shard_bits_)].map;
+		mhashmap::iterator iter = m.find(k);
+		return iter == m.end() ? nullptr : &*iter;
+	}
+
+	// Moves the content of every builder into this map, one worker per shard
+	// at a time. Builders fold in order: a key already present is set to
+	// combine(existing, incoming), where existing comes from the map or an
+	// earlier builder. For each shard the largest table is adopted by
+	// swapping page arrays and the smaller ones are inserted into it, with
+	// the operands kept in that order. The builders are left empty.
+	template <typename Combine>
+	void merge(const std::vector<local_builder*>& builders, int num_threads, Combine combine) {
+		parallel_for_shards(num_threads, [&](int s) {
+			mhashmap& dst = shards_[s].map;
+			for (size_t b = 0; b < builders.size(); ++b) {
+				mhashmap& src = builders[b]->shard(s);
+				if (src.size() > dst.size()) {
+					// dst now holds the incoming entries, src the existing ones.
+					dst.swap(src);
+					src.for_each([&](entry_t& e) {
+						upsert_existing(dst, e, combine);
+					});
+				} else {
+					src.for_each([&](entry_t& e) {
+						upsert(dst, e, combine);
+					});
+				}
+				src.clear();
+			}
+		});
+	}
+
+	void merge(const std::vector<local_builder*>& builders, int num_threads) {
+		merge(builders, num_threads, keep_first());
+	}
+
+	// Calls |f| on every entry from |num_threads| workers. Entries of one
+	// shard are always visited by the same worker.
+	template <typename F>
+	void for_each(F f, int num_threads) {
+		parallel_for_shards(num_threads, [&](int s) {
+			shards_[s].map.for_each(f);
+		});
+	}
+
+	static int shard_of(const key_t& k, int shard_bits) {
+		if (shard_bits == 0) {
+			return 0;
+		}
+		return static_cast<int>(mix(k) >> (64 - shard_bits));
+	}
+
+private:
+	sharded_mhashmap(const sharded_mhashmap&);
+	sharded_mhashmap& operator=(const sharded_mhashmap&);
+
+	// mhashmap hashes the low 32 bits of the key, so routing uses the high
+	// bits of an unrelated mix to keep shards and pages independent.
+	static uint64_t mix(uint64_t k) {
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	template <typename Combine>
+	static void upsert(mhashmap& m, const entry_t& e, Combine combine) {
+		mhashmap::iterator iter = m.find(e.first);
+		if (iter != m.end()) {
+			iter->second = combine(iter->second, e.second);
+		} else {
+			m.insert(e);
+		}
+	}
+
+	// mhashmap::insert already keeps an existing entry.
+	static void upsert(mhashmap& m, const entry_t& e, keep_first) {
+		m.insert(e);
+	}
+
+	// upsert() with |e| as the existing entry and |m| holding the incoming.
+	template <typename Combine>
+	static void upsert_existing(mhashmap& m, const entry_t& e, Combine combine) {
+		mhashmap::iterator iter = m.find(e.first);
+		if (iter != m.end()) {
+			iter->second = combine(e.second, iter->second);
+		} else {
+			m.insert(e);
+		}
+	}
+
+	template <typename F>
+	void parallel_for_shards(int num_threads, F f) {
+		std::atomic<int> next(0);
+		auto worker = [&]() {
+			for (int s = next++; s < num_shards(); s = next++) {
+				f(s);
+			}
+		};
+		std::vector<std::thread> threads;
+		for (int i = 1; i < num_threads; ++i) {
+			threads.push_back(std::thread(worker));
+		}
+		worker();
+		for (size_t i = 0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+	}
+
+	int shard_bits_;
+	mhashmap_shard* shards_;
+};
+
+#endif  // SHARDED_MHASHMAP_H_
@@ -0,0 +1,178 @@
+#include <atomic>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "sharded_mhashmap.h"
+
+struct add_values {
+	uint64_t operator()(uint64_t a, uint64_t b) const { return a + b; }
+};
+
+TEST(sharded_mhashmap, ShardAlign) {
+	EXPECT_EQ(0u, sizeof(mhashmap_shard) % HASHPAGE_SIZE);
+}
+
+TEST(sharded_mhashmap, InsertAndFind) {
+	sharded_mhashmap m(6);
+	EXPECT_EQ(8, m.num_shards());
+	for (uint64_t i = 1; i < 100000; ++i) {
+		m.insert(std::make_pair(i, i + 1));
+	}
+	EXPECT_EQ(99999u, m.size());
+	for (uint64_t i = 1; i < 100000; ++i) {
+		mhashpage::entry_t* e = m.find(i);
+		ASSERT_NE(nullptr, e) << i;
+		EXPECT_EQ(i + 1, e->second);
+	}
+	EXPECT_EQ(nullptr, m.find(100000));
+	for (int s = 0; s < m.num_shards(); ++s) {
+		EXPECT_LT(0u, m.shard(s).size());
+	}
+}
+
+// Records the fold order as decimal digits.
+struct keep_second_digit {
+	uint64_t operator()(uint64_t existing, uint64_t incoming) const { return existing * 10 + incoming; }
+};
+
+// Key 7 is in every builder, which grow in size, so each merge step adopts
+// the incoming table.
+TEST(sharded_mhashmap, MergeOrder) {
+	for (int growing = 0; growing < 2; ++growing) {
+		sharded_mhashmap first(1);
+		sharded_mhashmap combined(1);
+		std::vector<sharded_mhashmap::local_builder*> builders;
+		for (uint64_t b = 1; b <= 3; ++b) {
+			builders.push_back(new sharded_mhashmap::local_builder(first));
+			uint64_t others = growing ? b * 1000 : (4 - b) * 1000;
+			for (uint64_t i = 0; i < others; ++i) {
+				builders.back()->insert(std::make_pair(b * 100000 + i, 0ULL));
+			}
+			builders.back()->insert(std::make_pair(7ULL, b));
+		}
+		first.insert(std::make_pair(7ULL, 9ULL));
+		first.merge(builders, 1);
+		EXPECT_EQ(9u, first.find(7)->second) << growing;
+
+		for (uint64_t b = 1; b <= 3; ++b) {
+			builders[b - 1]->insert(std::make_pair(7ULL, b));
+			for (uint64_t i = 0; i < (growing ? b * 1000 : (4 - b) * 1000); ++i) {
+				builders[b - 1]->insert(std::make_pair(b * 100000 + i, 0ULL));
+			}
+		}
+		combined.merge(builders, 1, keep_second_digit());
+		EXPECT_EQ(123u, combined.find(7)->second) << growing;
+		for (size_t b = 0; b < builders.size(); ++b) {
+			delete builders[b];
+		}
+	}
+}
+
+TEST(sharded_mhashmap, ParallelAggregate) {
+	const int kThreads = 4;
+	const int kPerThread = 200000;
+	sharded_mhashmap m(16);
+
+	std::vector<sharded_mhashmap::local_builder*> builders;
+	for (int t = 0; t < kThreads; ++t) {
+		builders.push_back(new sharded_mhashmap::local_builder(m));
+	}
+	std::vector<std::thread> threads;
+	for (int t = 0; t < kThreads; ++t) {
+		threads.push_back(std::thread([&, t]() {
+			std::default_random_engine eng(t);
+			std::uniform_int_distribution<uint64_t> dist(1, 50000);
+			for (int i = 0; i < kPerThread; ++i) {
+				builders[t]->insert(std::make_pair(dist(eng), 1ULL), add_values());
+			}
+		}));
+	}
+	for (auto& th : threads) {
+		th.join();
+	}
+	m.merge(builders, kThreads, add_values());
+
+	std::unordered_map<uint64_t, uint64_t> ref;
+	for (int t = 0; t < kThreads; ++t) {
+		std::default_random_engine eng(t);
+		std::uniform_int_distribution<uint64_t> dist(1, 50000);
+		for (int i = 0; i < kPerThread; ++i) {
+			++ref[dist(eng)];
+		}
+		EXPECT_EQ(0u, builders[t]->shard(0).size());
+		delete builders[t];
+	}
+
+	EXPECT_EQ(ref.size(), m.size());
+	for (auto& item : ref) {
+		mhashpage::entry_t* e = m.find(item.first);
+		ASSERT_NE(nullptr, e) << item.first;
+		EXPECT_EQ(item.second, e->second);
+	}
+
+	std::atomic<uint64_t> total(0);
+	m.for_each([&](mhashpage::entry_t& e) {
+		total += e.second;
+	}, kThreads);
+	EXPECT_EQ(static_cast<uint64_t>(kThreads) * kPerThread, total.load());
+}
+
+const uint64_t kInsertIteration = 20000000;
+
+// Scrambled so that the single table does not get a sequential page walk.
+uint64_t bench_key(uint64_t i) {
+	i ^= i >> 33;
+	i *= 0xff51afd7ed558ccdULL;
+	i ^= i >> 33;
+	return i;
+}
+
+TEST(sharded_mhashmap, ParallelBuildBench) {
+	int num_threads = std::max(1u, std::thread::hardware_concurrency());
+	sharded_mhashmap m(num_threads * 4);
+	std::vector<sharded_mhashmap::local_builder*> builders;
+	for (int t = 0; t < num_threads; ++t) {
+		builders.push_back(new sharded_mhashmap::local_builder(m));
+	}
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < num_threads; ++t) {
+		threads.push_back(std::thread([&, t]() {
+			for (uint64_t i = 1 + t; i < kInsertIteration; i += num_threads) {
+				builders[t]->insert(std::make_pair(bench_key(i), 1000ULL + i));
+			}
+		}));
+	}
+	for (auto& th : threads) {
+		th.join();
+	}
+	m.merge(builders, num_threads);
+	for (int t = 0; t < num_threads; ++t) {
+		delete builders[t];
+	}
+	EXPECT_EQ(kInsertIteration - 1, m.size());
+
+	std::atomic<uint64_t> total(0);
+	m.for_each([&](mhashpage::entry_t& e) {
+		total += e.second & 1;
+	}, num_threads);
+	std::cout << "Threads : " << num_threads << " (" << total.load() << ")" << std::endl;
+}
+
+TEST(MHASHMAP, SingleThreadBuildBench) {
+	mhashmap m;
+	for (uint64_t i = 1; i < kInsertIteration; ++i) {
+		m.insert(std::make_pair(bench_key(i), 1000ULL + i));
+	}
+	EXPECT_EQ(kInsertIteration - 1, m.size());
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,282 @@
+#ifndef SOA_MHASHMAP_H_
+#define SOA_MHASHMAP_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <emmintrin.h>
+
+#include "cuckoo_path.h"
+#include "mhashmap.h"
+
+#define SOA_KEYPAGE_SIZE 64
+
+// Key half of a split page: the context and the keys of one page share a
+// single cache line, and the values live in a parallel array.
+struct soa_keypage {
+	static const int kMaxLevel = 3;
+	static const int num_max_entries = 6;
+	typedef uint64_t key_t;
+	struct context {
+		uint16_t foreign_placed[kMaxLevel];
+		uint8_t num_elements;
+		uint8_t flags[num_max_entries];
+		uint8_t padding__[3];
+	} cxt;
+	key_t keys[num_max_entries];
+
+	bool overflow(int level) const {
+		return cxt.foreign_placed[level] != 0;
+	}
+
+	bool full() const {
+		return cxt.num_elements == num_max_entries;
+	}
+
+	int level(int index) const {
+		return cxt.flags[index];
+	}
+
+	int find_index(const key_t& k) const {
+		for (int i = 0; i < cxt.num_elements; ++i) {
+			if (keys[i] == k) {
+				return i;
+			}
+		}
+		return -1;
+	}
+};
+
+// mhashmap with keys and values in separate page arrays. A lookup scans one
+// key line and reads the value array only on a hit, so a miss costs one line
+// instead of the two of an mhashpage. Candidate pages are computed exactly as
+// in mhashmap so the two layouts can be compared directly.
+class soa_mhashmap {
+	template <typename, int, int> friend class cuckoo_path;
+
+public:
+	typedef uint64_t key_t;
+	typedef uint64_t value_t;
+	static const int kMaxPlacementStatus = soa_keypage::kMaxLevel + 1;
+	typedef mhashmap::hash_array_t hash_array_t;
+	typedef soa_keypage page_t;
+
+	soa_mhashmap() {
+		const uint32_t kInitialCapacity = 2;
+		num_entries_ = 0;
+		init_pages(kInitialCapacity);
+		hash_add_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mhashmap::hash_add_constants()));
+		hash_mult_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mhashmap::hash_mult_constants()));
+	}
+
+	~soa_mhashmap() {
+		free(page_);
+		free(value_);
+	}
+
+	size_t size() const { return num_entries_; }
+	size_t capacity() const { return capacity_ * soa_keypage::num_max_entries; }
+
+	size_t memory_usage() const {
+		return capacity_ * (sizeof(soa_keypage) + sizeof(value_t) * soa_keypage::num_max_entries);
+	}
+
+	int load_factor() const {
+		return num_entries_ * 1000LL / soa_keypage::num_max_entries / capacity_;
+	}
+
+	// Returns false if the key already exists.
+	bool insert(const key_t& k, const value_t& v) {
+		hash_array_t key_hash;
+		compute_hash(k, key_hash);
+		if (find_internal(k, key_hash) != nullptr) {
+			return false;
+		}
+		while (!insert_internal(key_hash, k, v)) {
+			rebuild();
+			compute_hash(k, key_hash);
+		}
+		++num_entries_;
+		return true;
+	}
+
+	value_t* find(const key_t& k) {
+		hash_array_t key_hash;
+		compute_hash(k, key_hash);
+		return find_internal(k, key_hash);
+	}
+
+	bool erase(const key_t& k) {
+		hash_array_t key_hash;
+		compute_hash(k, key_hash);
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			uint32_t p = candidate(key_hash, i);
+			soa_keypage& page = page_[p];
+			int index = page.find_index(k);
+			if (index >= 0) {
+				int level = page.cxt.flags[index];
+				int last = --page.cxt.num_elements;
+				if (index != last) {
+					page.keys[index] = page.keys[last];
+					page.cxt.flags[index] = page.cxt.flags[last];
+					value_at(p, index) = value_at(p, last);
+				}
+				decrease_foreign_element(level, key_hash);
+				--num_entries_;
+				return true;
+			}
+			if (i != soa_keypage::kMaxLevel && !page.overflow(i)) {
+				break;
+			}
+		}
+		return false;
+	}
+
+	void compute_hash(const key_t& key, hash_array_t& h) const {
+		h = _mm_set1_epi32(static_cast<uint32_t>(key));
+		h = _mm_add_epi32(h, hash_add_);
+		h = mullo_epi32(h, hash_mult_);
+		h = _mm_and_si128(h, _mm_set1_epi32(capacity_ - 1));
+	}
+
+private:
+	static const int kMaxCuckooPathDepth = 4;
+	static const int kMaxCuckooSearchNodes = 128;
+
+	// Above 95% occupancy a full set of candidate pages grows the table.
+	static const int max_load_factor_ = 950;
+
+	static uint32_t candidate(const hash_array_t& h, int i) {
+		return mhashmap::hash_at(h, i);
+	}
+
+	void init_pages(uint32_t capacity) {
+		capacity_ = capacity;
+		size_t key_size = sizeof(soa_keypage) * capacity_;
+		if (posix_memalign(reinterpret_cast<void**>(&page_), SOA_KEYPAGE_SIZE, key_size) != 0) {
+			abort();
+		}
+		memset(page_, 0, key_size);
+		value_ = reinterpret_cast<value_t*>(malloc(sizeof(value_t) * soa_keypage::num_max_entries * capacity_));
+	}
+
+	value_t& value_at(uint32_t p, int slot) {
+		return value_[p * soa_keypage::num_max_entries + slot];
+	}
+
+	value_t* find_internal(const key_t& k, const hash_array_t& key_hash) {
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			uint32_t p = candidate(key_hash, i);
+			int index = page_[p].find_index(k);
+			if (index >= 0) {
+				return &value_at(p, index);
+			}
+			if (i != soa_keypage::kMaxLevel && !page_[p].overflow(i)) {
+				break;
+			}
+		}
+		return nullptr;
+	}
+
+	void increase_foreign_element(int level, const hash_array_t& key_hash) {
+		for (int i = 0; i < level; ++i) {
+			++page_[candidate(key_hash, i)].cxt.foreign_placed[i];
+		}
+	}
+
+	void decrease_foreign_element(int level, const hash_array_t& key_hash) {
+		for (int i = 0; i < level; ++i) {
+			--page_[candidate(key_hash, i)].cxt.foreign_placed[i];
+		}
+	}
+
+	void place(uint32_t p, int slot, const key_t& k, const value_t& v, int level) {
+		page_[p].keys[slot] = k;
+		page_[p].cxt.flags[slot] = level;
+		value_at(p, slot) = v;
+	}
+
+	bool try_insert(const hash_array_t& key_hash, const key_t& k, const value_t& v) {
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			uint32_t p = candidate(key_hash, i);
+			if (!page_[p].full()) {
+				place(p, page_[p].cxt.num_elements++, k, v, i);
+				increase_foreign_element(i, key_hash);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool slot_hash(const soa_keypage& page, int slot, hash_array_t& h) const {
+		compute_hash(page.keys[slot], h);
+		return true;
+	}
+
+	void copy_slot(uint32_t from, int from_slot, uint32_t to, int to_slot, int to_level) {
+		if (to_slot < 0) {
+			to_slot = page_[to].cxt.num_elements++;
+		}
+		place(to, to_slot, page_[from].keys[from_slot], value_at(from, from_slot), to_level);
+	}
+
+	bool insert_internal(const hash_array_t& key_hash, const key_t& k, const value_t& v) {
+		if (try_insert(key_hash, k, v)) {
+			return true;
+		}
+		if (load_factor() >= max_load_factor_) {
+			return false;
+		}
+
+		cuckoo_path<soa_mhashmap, kMaxCuckooPathDepth, kMaxCuckooSearchNodes> path;
+		if (!path.find(*this, key_hash)) {
+			return false;
+		}
+		uint32_t p;
+		int slot;
+		int level;
+		path.execute(*this, &p, &slot, &level);
+		place(p, slot, k, v, level);
+		increase_foreign_element(level, key_hash);
+		return true;
+	}
+
+	// Rehashes every entry into page arrays of twice the size.
+	void rebuild() {
+		soa_keypage* old_page = page_;
+		value_t* old_value = value_;
+		uint32_t old_capacity = capacity_;
+		uint32_t new_capacity = capacity_ * 2;
+
+		while (true) {
+			init_pages(new_capacity);
+			bool ok = true;
+			for (uint32_t i = 0; i < old_capacity && ok; ++i) {
+				const soa_keypage& page = old_page[i];
+				for (int j = 0; j < page.cxt.num_elements && ok; ++j) {
+					hash_array_t h;
+					compute_hash(page.keys[j], h);
+					ok = insert_internal(h, page.keys[j], old_value[i * soa_keypage::num_max_entries + j]);
+				}
+			}
+			if (ok) {
+				break;
+			}
+			free(page_);
+			free(value_);
+			new_capacity *= 2;
+		}
+		free(old_page);
+		free(old_value);
+	}
+
+	soa_keypage* page_;
+	value_t* value_;
+	uint32_t capacity_;
+	uint32_t num_entries_;
+	hash_array_t hash_add_;
+	hash_array_t hash_mult_;
+};
+
+#endif  // SOA_MHASHMAP_H_
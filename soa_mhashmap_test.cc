@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "mhashmap.h"
+#include "soa_mhashmap.h"
+
+TEST(soa_mhashmap, CacheAlign) {
+	EXPECT_EQ(SOA_KEYPAGE_SIZE, sizeof(soa_keypage));
+}
+
+TEST(soa_mhashmap, InsertFindErase) {
+	soa_mhashmap m;
+	for (uint64_t i = 1; i < 20000; ++i) {
+		EXPECT_TRUE(m.insert(i, i + 1000));
+	}
+	EXPECT_FALSE(m.insert(5, 0));
+	EXPECT_EQ(19999u, m.size());
+
+	for (uint64_t i = 1; i < 20000; i += 2) {
+		EXPECT_TRUE(m.erase(i)) << i;
+	}
+	EXPECT_FALSE(m.erase(1));
+	EXPECT_FALSE(m.erase(20001));
+
+	for (uint64_t i = 1; i < 20000; ++i) {
+		uint64_t* v = m.find(i);
+		if (i % 2 == 1) {
+			EXPECT_EQ(nullptr, v) << i;
+		} else {
+			ASSERT_NE(nullptr, v) << i;
+			EXPECT_EQ(i + 1000, *v);
+		}
+	}
+}
+
+TEST(soa_mhashmap, MegaRandomInsert) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::unordered_map<uint64_t, uint64_t> expected;
+	soa_mhashmap m;
+	for (int i = 0; i < 1000000; ++i) {
+		uint64_t k = dist(eng);
+		if (expected.insert(std::make_pair(k, i)).second) {
+			EXPECT_TRUE(m.insert(k, i));
+		}
+	}
+	EXPECT_EQ(expected.size(), m.size());
+	for (const auto& e : expected) {
+		uint64_t* v = m.find(e.first);
+		ASSERT_NE(nullptr, v);
+		EXPECT_EQ(e.second, *v);
+	}
+}
+
+// Both layouts hold the same random keys. Hit lookups use those keys and
+// miss lookups use keys that were never inserted.
+const int kLookupKeys = 8000000;
+
+struct lookup_tables {
+	std::vector<uint64_t> hit_keys;
+	std::vector<uint64_t> miss_keys;
+	mhashmap aos;
+	soa_mhashmap soa;
+
+	lookup_tables() {
+		std::default_random_engine eng;
+		std::uniform_int_distribution<uint64_t> dist;
+		for (int i = 0; i < kLookupKeys; ++i) {
+			uint64_t k = dist(eng);
+			hit_keys.push_back(k);
+			miss_keys.push_back(k ^ 0x5555555555555555ULL);
+			aos.insert(std::make_pair(k, k));
+			soa.insert(k, k);
+		}
+		std::shuffle(hit_keys.begin(), hit_keys.end(), eng);
+	}
+};
+
+lookup_tables& tables() {
+	static lookup_tables t;
+	return t;
+}
+
+TEST(soa_mhashmap, LookupTables) {
+	EXPECT_EQ(tables().aos.size(), tables().soa.size());
+	std::cout << "Bytes per entry : aos " << HASHPAGE_SIZE * tables().aos.capacity() /
+		mhashpage::num_max_entries / tables().aos.size() << " soa " <<
+		tables().soa.memory_usage() / tables().soa.size() << std::endl;
+}
+
+template <typename Map>
+uint64_t lookup_sum(Map& m, const std::vector<uint64_t>& keys);
+
+template <>
+uint64_t lookup_sum(mhashmap& m, const std::vector<uint64_t>& keys) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		mhashmap::iterator iter = m.find(keys[i]);
+		if (iter != m.end()) {
+			sum += iter->second;
+		}
+	}
+	return sum;
+}
+
+template <>
+uint64_t lookup_sum(soa_mhashmap& m, const std::vector<uint64_t>& keys) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		uint64_t* v = m.find(keys[i]);
+		if (v != nullptr) {
+			sum += *v;
+		}
+	}
+	return sum;
+}
+
+TEST(MHASHMAP, HitLookupBench) {
+	std::cout << "Sum : " << lookup_sum(tables().aos, tables().hit_keys) << std::endl;
+}
+
+TEST(soa_mhashmap, HitLookupBench) {
+	std::cout << "Sum : " << lookup_sum(tables().soa, tables().hit_keys) << std::endl;
+}
+
+TEST(MHASHMAP, MissLookupBench) {
+	std::cout << "Sum : " << lookup_sum(tables().aos, tables().miss_keys) << std::endl;
+}
+
+TEST(soa_mhashmap, MissLookupBench) {
+	std::cout << "Sum : " << lookup_sum(tables().soa, tables().miss_keys) << std::endl;
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,338 @@
+#ifndef STRING_MHASHMAP_H_
+#define STRING_MHASHMAP_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "cuckoo_path.h"
+#include "lookup3.h"
+
+#include <emmintrin.h>
+
+#define STRING_HASHPAGE_SIZE 128
+
+// Reference to a variable-length key. Keys up to kMaxInlineKey bytes are
+// stored in place with their length in the last byte; longer keys live in
+// the key arena of the map and the last byte is kArenaKey.
+struct string_key_ref {
+	static const int kMaxInlineKey = 15;
+	static const uint8_t kArenaKey = 0xff;
+
+	union {
+		char bytes[kMaxInlineKey + 1];
+		struct {
+			uint64_t offset;
+			uint32_t length;
+		} arena;
+	};
+
+	bool is_inline() const {
+		return static_cast<uint8_t>(bytes[kMaxInlineKey]) != kArenaKey;
+	}
+
+	size_t length() const {
+		return is_inline() ? static_cast<uint8_t>(bytes[kMaxInlineKey]) : arena.length;
+	}
+
+	const char* data(const char* arena_base) const {
+		return is_inline() ? bytes : arena_base + arena.offset;
+	}
+
+	bool equals(const char* key, size_t length, const char* arena_base) const {
+		if (is_inline()) {
+			return static_cast<uint8_t>(bytes[kMaxInlineKey]) == length && memcmp(bytes, key, length) == 0;
+		}
+		return arena.length == length && memcmp(arena_base + arena.offset, key, length) == 0;
+	}
+};
+
+struct string_hashpage {
+	static const int kMaxLevel = 3;
+	static const int num_max_entries = 4;
+	typedef uint64_t value_t;
+	struct context {
+		uint32_t tag[num_max_entries];
+		uint16_t foreign_placed[kMaxLevel];
+		uint8_t num_elements;
+		uint8_t flags[num_max_entries];
+		uint8_t padding__[5];
+	} cxt;
+	string_key_ref keys[num_max_entries];
+	value_t values[num_max_entries];
+
+	bool overflow(int level) const {
+		return cxt.foreign_placed[level] != 0;
+	}
+
+	bool full() const {
+		return cxt.num_elements == num_max_entries;
+	}
+
+	int level(int index) const {
+		return cxt.flags[index];
+	}
+
+	// Compares all tags at once and only runs memcmp on tag hits.
+	int find_index(uint32_t tag, const char* key, size_t length, const char* arena_base) const {
+		__m128i tags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cxt.tag));
+		__m128i hit = _mm_cmpeq_epi32(tags, _mm_set1_epi32(tag));
+		int bits = _mm_movemask_ps(_mm_castsi128_ps(hit)) & ((1 << cxt.num_elements) - 1);
+		while (bits != 0) {
+			int i = __builtin_ctz(bits);
+			if (keys[i].equals(key, length, arena_base)) {
+				return i;
+			}
+			bits &= bits - 1;
+		}
+		return -1;
+	}
+
+	void place(int index, uint32_t tag, const string_key_ref& key, value_t v, int level) {
+		cxt.tag[index] = tag;
+		keys[index] = key;
+		values[index] = v;
+		cxt.flags[index] = level;
+	}
+
+	bool insert(uint32_t tag, const string_key_ref& key, value_t v, int level) {
+		if (full()) {
+			return false;
+		}
+		place(cxt.num_elements, tag, key, v, level);
+		++cxt.num_elements;
+		return true;
+	}
+};
+
+// Four-choice cuckoo map from byte strings to 8 byte values. hashlittle2
+// supplies two 32-bit hashes per key: the first picks the first candidate
+// page and the second is both the probe stride and the in-page tag.
+class string_mhashmap {
+	template <typename, int, int> friend class cuckoo_path;
+
+public:
+	typedef uint64_t value_t;
+	static const int kMaxPlacementStatus = string_hashpage::kMaxLevel + 1;
+
+	struct hash_array_t {
+		uint32_t page[kMaxPlacementStatus];
+		uint32_t tag;
+	};
+	typedef string_hashpage page_t;
+
+	string_mhashmap() {
+		const uint32_t kInitialCapacity = 16;
+		arena_ = nullptr;
+		arena_size_ = 0;
+		arena_capacity_ = 0;
+		num_entries_ = 0;
+		init_pages(kInitialCapacity);
+	}
+
+	~string_mhashmap() {
+		free(page_);
+		free(arena_);
+	}
+
+	size_t size() const { return num_entries_; }
+	size_t capacity() const { return capacity_ * string_hashpage::num_max_entries; }
+	size_t arena_size() const { return arena_size_; }
+
+	int load_factor() const {
+		return num_entries_ * 1000LL / string_hashpage::num_max_entries / capacity_;
+	}
+
+	// Returns false if the key already exists.
+	bool insert(const char* key, size_t length, value_t v) {
+		hash_array_t key_hash;
+		compute_hash(key, length, key_hash);
+		if (find_internal(key, length, key_hash) != nullptr) {
+			return false;
+		}
+
+		string_key_ref ref;
+		if (length <= string_key_ref::kMaxInlineKey) {
+			memset(ref.bytes, 0, sizeof(ref.bytes));
+			memcpy(ref.bytes, key, length);
+			ref.bytes[string_key_ref::kMaxInlineKey] = static_cast<char>(length);
+		} else {
+			ref.arena.offset = append_to_arena(key, length);
+			ref.arena.length = static_cast<uint32_t>(length);
+			ref.bytes[string_key_ref::kMaxInlineKey] = static_cast<char>(string_key_ref::kArenaKey);
+		}
+
+		while (!insert_internal(key_hash, ref, v)) {
+			rebuild();
+			compute_hash(key, length, key_hash);
+		}
+		++num_entries_;
+		return true;
+	}
+
+	bool insert(const std::string& key, value_t v) {
+		return insert(key.data(), key.size(), v);
+	}
+
+	value_t* find(const char* key, size_t length) {
+		hash_array_t key_hash;
+		compute_hash(key, length, key_hash);
+		return find_internal(key, length, key_hash);
+	}
+
+	value_t* find(const std::string& key) {
+		return find(key.data(), key.size());
+	}
+
+	void compute_hash(const char* key, size_t length, hash_array_t& h) const {
+		uint32_t pc = 0;
+		uint32_t pb = 0;
+		hashlittle2(key, length, &pc, &pb);
+		uint32_t step = pb | 1;
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			h.page[i] = (pc + i * step) & (capacity_ - 1);
+		}
+		h.tag = pb;
+	}
+
+private:
+	static const int kMaxCuckooPathDepth = 3;
+	static const int kMaxCuckooSearchNodes = 64;
+
+	// Above 95% occupancy a full set of candidate pages grows the table.
+	static const int max_load_factor_ = 950;
+
+	void init_pages(uint32_t capacity) {
+		capacity_ = capacity;
+		page_ = reinterpret_cast<string_hashpage*>(malloc(sizeof(string_hashpage) * capacity_));
+		memset(page_, 0, sizeof(string_hashpage) * capacity_);
+	}
+
+	uint64_t append_to_arena(const char* key, size_t length) {
+		if (arena_size_ + length > arena_capacity_) {
+			arena_capacity_ = std::max<size_t>(arena_capacity_ * 2, arena_size_ + length);
+			arena_ = reinterpret_cast<char*>(realloc(arena_, arena_capacity_));
+		}
+		uint64_t offset = arena_size_;
+		memcpy(arena_ + offset, key, length);
+		arena_size_ += length;
+		return offset;
+	}
+
+	static uint32_t candidate(const hash_array_t& h, int i) {
+		return h.page[i];
+	}
+
+	void hash_of(const string_key_ref& ref, hash_array_t& h) const {
+		compute_hash(ref.data(arena_), ref.length(), h);
+	}
+
+	value_t* find_internal(const char* key, size_t length, const hash_array_t& key_hash) {
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			string_hashpage& page = page_[key_hash.page[i]];
+			int index = page.find_index(key_hash.tag, key, length, arena_);
+			if (index >= 0) {
+				return &page.values[index];
+			}
+			if (i != string_hashpage::kMaxLevel && !page.overflow(i)) {
+				break;
+			}
+		}
+		return nullptr;
+	}
+
+	void increase_foreign_element(int level, const hash_array_t& key_hash) {
+		for (int i = 0; i < level; ++i) {
+			++page_[key_hash.page[i]].cxt.foreign_placed[i];
+		}
+	}
+
+	void decrease_foreign_element(int level, const hash_array_t& key_hash) {
+		for (int i = 0; i < level; ++i) {
+			--page_[key_hash.page[i]].cxt.foreign_placed[i];
+		}
+	}
+
+	bool try_insert(const hash_array_t& key_hash, const string_key_ref& ref, value_t v) {
+		for (int i = 0; i < kMaxPlacementStatus; ++i) {
+			if (page_[key_hash.page[i]].insert(key_hash.tag, ref, v, i)) {
+				increase_foreign_element(i, key_hash);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool slot_hash(const string_hashpage& page, int slot, hash_array_t& h) const {
+		hash_of(page.keys[slot], h);
+		return true;
+	}
+
+	void copy_slot(uint32_t from, int from_slot, uint32_t to, int to_slot, int to_level) {
+		const string_hashpage& src = page_[from];
+		if (to_slot < 0) {
+			page_[to].insert(src.cxt.tag[from_slot], src.keys[from_slot], src.values[from_slot], to_level);
+		} else {
+			page_[to].place(to_slot, src.cxt.tag[from_slot], src.keys[from_slot], src.values[from_slot], to_level);
+		}
+	}
+
+	bool insert_internal(const hash_array_t& key_hash, const string_key_ref& ref, value_t v) {
+		if (try_insert(key_hash, ref, v)) {
+			return true;
+		}
+		if (load_factor() >= max_load_factor_) {
+			return false;
+		}
+
+		cuckoo_path<string_mhashmap, kMaxCuckooPathDepth, kMaxCuckooSearchNodes> path;
+		if (!path.find(*this, key_hash)) {
+			return false;
+		}
+		uint32_t p;
+		int slot;
+		int level;
+		path.execute(*this, &p, &slot, &level);
+		page_[p].place(slot, key_hash.tag, ref, v, level);
+		increase_foreign_element(level, key_hash);
+		return true;
+	}
+
+	// Rehashes every entry into a page array of twice the size. Keys stay in
+	// the arena; only their references move.
+	void rebuild() {
+		string_hashpage* old_page = page_;
+		uint32_t old_capacity = capacity_;
+		uint32_t new_capacity = capacity_ * 2;
+
+		while (true) {
+			init_pages(new_capacity);
+			bool ok = true;
+			for (uint32_t i = 0; i < old_capacity && ok; ++i) {
+				const string_hashpage& page = old_page[i];
+				for (int j = 0; j < page.cxt.num_elements && ok; ++j) {
+					hash_array_t h;
+					hash_of(page.keys[j], h);
+					ok = insert_internal(h, page.keys[j], page.values[j]);
+				}
+			}
+			if (ok) {
+				break;
+			}
+			free(page_);
+			new_capacity *= 2;
+		}
+		free(old_page);
+	}
+
+	string_hashpage* page_;
+	uint32_t capacity_;
+	uint32_t num_entries_;
+	char* arena_;
+	size_t arena_size_;
+	size_t arena_capacity_;
+};
+
+#endif  // STRING_MHASHMAP_H_
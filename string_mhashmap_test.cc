@@ -0,0 +1,126 @@
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+
+#include "gtest/gtest.h"
+
+#include "string_mhashmap.h"
+
+TEST(string_mhashmap, CacheAlign) {
+	EXPECT_EQ(STRING_HASHPAGE_SIZE, sizeof(string_hashpage));
+	EXPECT_EQ(16u, sizeof(string_key_ref));
+}
+
+TEST(string_mhashmap, InlineAndArenaKeys) {
+	string_mhashmap m;
+	const std::string short_key = "user-agent";
+	const std::string boundary_key(string_key_ref::kMaxInlineKey, 'a');
+	const std::string long_key = "https://example.com/a/rather/long/path?with=query";
+
+	EXPECT_TRUE(m.insert(short_key, 1));
+	EXPECT_TRUE(m.insert(boundary_key, 2));
+	EXPECT_TRUE(m.insert(long_key, 3));
+	EXPECT_TRUE(m.insert("", 4));
+	EXPECT_FALSE(m.insert(long_key, 5));
+
+	EXPECT_EQ(long_key.size(), m.arena_size());
+	ASSERT_NE(nullptr, m.find(short_key));
+	EXPECT_EQ(1u, *m.find(short_key));
+	ASSERT_NE(nullptr, m.find(boundary_key));
+	EXPECT_EQ(2u, *m.find(boundary_key));
+	ASSERT_NE(nullptr, m.find(long_key));
+	EXPECT_EQ(3u, *m.find(long_key));
+	ASSERT_NE(nullptr, m.find(""));
+	EXPECT_EQ(4u, *m.find(""));
+
+	EXPECT_EQ(nullptr, m.find("user-agen"));
+	EXPECT_EQ(nullptr, m.find(std::string(string_key_ref::kMaxInlineKey + 1, 'a')));
+	EXPECT_EQ(nullptr, m.find(long_key + "x"));
+}
+
+std::vector<std::string> make_keys(size_t n) {
+	std::default_random_engine eng;
+	std::uniform_int_distribution<uint64_t> dist;
+	std::vector<std::string> keys;
+	keys.reserve(n);
+	for (size_t i = 0; i < n; ++i) {
+		if (i % 2 == 0) {
+			keys.push_back("https://example.com/item/" + std::to_string(dist(eng)));
+		} else {
+			keys.push_back("ua" + std::to_string(dist(eng) % 1000000000000ULL));
+		}
+	}
+	return keys;
+}
+
+TEST(string_mhashmap, MegaRandomInsert) {
+	std::vector<std::string> keys = make_keys(1000000);
+	string_mhashmap m;
+	std::unordered_map<std::string, uint64_t> ref;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		EXPECT_EQ(ref.insert(std::make_pair(keys[i], i)).second, m.insert(keys[i], i));
+	}
+	EXPECT_EQ(ref.size(), m.size());
+
+	for (auto& item : ref) {
+		uint64_t* v = m.find(item.first);
+		ASSERT_NE(nullptr, v) << item.first;
+		EXPECT_EQ(item.second, *v);
+	}
+	std::cout << "Load Factor : " << m.load_factor() << std::endl;
+}
+
+const size_t kNumStringKeys = 4000000;
+
+TEST(string_mhashmap, MegaInsertBench) {
+	std::vector<std::string> keys = make_keys(kNumStringKeys);
+	string_mhashmap m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(keys[i], i);
+	}
+	std::cout << "Memory usage : " << (m.capacity() / string_hashpage::num_max_entries * sizeof(string_hashpage)
+		+ m.arena_size()) / 1024 / 1024 << " MB" << std::endl;
+}
+
+TEST(string_mhashmap, MegaLookupBench) {
+	std::vector<std::string> keys = make_keys(kNumStringKeys);
+	string_mhashmap m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(keys[i], i);
+	}
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<size_t> dist(0, keys.size() - 1);
+	for (size_t i = 0; i < kNumStringKeys * 3; ++i) {
+		EXPECT_NE(nullptr, m.find(keys[dist(eng)]));
+	}
+}
+
+TEST(unordered_map, StringInsertBench) {
+	std::vector<std::string> keys = make_keys(kNumStringKeys);
+	std::unordered_map<std::string, uint64_t> m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(std::make_pair(keys[i], i));
+	}
+}
+
+TEST(unordered_map, StringLookupBench) {
+	std::vector<std::string> keys = make_keys(kNumStringKeys);
+	std::unordered_map<std::string, uint64_t> m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m.insert(std::make_pair(keys[i], i));
+	}
+
+	std::default_random_engine eng;
+	std::uniform_int_distribution<size_t> dist(0, keys.size() - 1);
+	for (size_t i = 0; i < kNumStringKeys * 3; ++i) {
+		EXPECT_NE(m.end(), m.find(keys[dist(eng)]));
+	}
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}